@@ -6,6 +6,9 @@
  */
 
 #include "pictDB.h"
+#include "db_index.h"
+
+#include <inttypes.h> // for PRIu32
 
 /**
  *  @brief  Creates the database called db_filename. Writes the header and the
@@ -29,6 +32,8 @@ int do_create(const char* db_filename, struct pictdb_file* db_file)
 
     db_file->header.db_version = 0;
     db_file->header.num_files = 0;
+    db_file->header.format = PICTDB_CONTIGUOUS;
+    db_file->header.directory = 0;
 
     if (db_file->header.max_files > MAX_MAX_FILES) {
         db_file->header.max_files = MAX_MAX_FILES;
@@ -43,6 +48,50 @@ int do_create(const char* db_filename, struct pictdb_file* db_file)
         db_file->metadata[i].is_valid = EMPTY;
     }
 
+    db_file->fpdb = NULL;
+    db_file->chunks = NULL;
+    db_file->chunk_count = 0;
+    db_file->map = NULL;
+    db_file->map_size = 0;
+    db_file->flags = 0;
+    db_file->id_index.buckets = NULL;
+    db_file->id_index.dirty = NULL;
+    db_file->sha_index.buckets = NULL;
+    db_file->sha_index.dirty = NULL;
+    db_file->stored.offset = 0;
+    db_file->stored.buckets = 0;
+    db_file->stored.stamp = 0;
+    db_file->stored.valid = 0;
+    db_file->stored.stale = 0;
+    db_file->free_slots.bits = NULL;
+    db_file->mirror.id_hashes = NULL;
+    db_file->mirror.sha_prefixes = NULL;
+    db_file->mirror.offsets = NULL;
+    db_file->mirror.sizes = NULL;
+    db_file->refs.offsets = NULL;
+    db_file->refs.counts = NULL;
+    db_file->free_extents.items = NULL;
+    db_file->free_extents.count = 0;
+    db_file->free_extents.capacity = 0;
+    db_file->free_extents.bytes = 0;
+    db_file->free_extents.epoch = 0;
+    db_file->free_extents.pins[0] = 0;
+    db_file->free_extents.pins[1] = 0;
+    db_file->free_extents.frozen = 0;
+    db_file->dirty.bits = NULL;
+    db_file->dirty.first = 0;
+    db_file->dirty.last = 0;
+    db_file->dirty.header = 0;
+    db_file->wal = NULL;
+    db_file->pager = NULL;
+    db_file->generation = 0;
+    int ret = 0;
+
+    if ((ret = load_chunks(db_file)) ||
+        (ret = index_build(db_file))) {
+        return ret;
+    }
+
     FILE* file = fopen(db_filename, "w+b");
 
     if (file == NULL) {
@@ -50,21 +99,14 @@ int do_create(const char* db_filename, struct pictdb_file* db_file)
     }
 
     db_file->fpdb = file;
+    pthread_rwlock_init(&db_file->lock, NULL);
 
-    int ret = 0;
-    int counter = 1;
-
-    if ((ret = write_header(db_file, file, 0, 1))) {
+    if ((ret = write_header(db_file, file, 0, 1)) ||
+        (ret = write_metadata_range(db_file, file, 0,
+                                    db_file->header.max_files))) {
         return ret;
     }
 
-    for (int i = 0; i < db_file->header.max_files; i++) {
-        if ((ret = write_metadata(db_file, file, i))) {
-            return ret;
-        }
-        counter++;
-    }
-
-    printf("%d item(s) written\n", counter);
+    printf("%" PRIu32 " item(s) written\n", db_file->header.max_files + 1);
     return 0;
 }
@@ -6,6 +6,8 @@
  */
 
 #include "pictDB.h"
+#include "db_index.h"
+#include "wal.h"
 
 /**
  *	@brief  Deletes the image with id "id", passed through the arguments, by
@@ -24,18 +26,28 @@ int do_delete(const char* id, struct pictdb_file* db_file)
     }
 
     size_t i = 0;
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&db_file->lock);
 
     if ((i = find_index(db_file, id)) == -1) {
-        return ERR_INVALID_PICID;
+        ret = ERR_INVALID_PICID;
     } else {
-        db_file->metadata[i].is_valid = EMPTY;
-        int ret = 0;
+        index_remove(db_file, i);
+        get_metadata(db_file, i)->is_valid = EMPTY;
+
+        mark_header(db_file, -1, 1);
 
-        if ((ret = write_metadata(db_file, db_file->fpdb, i)) ||
-            (ret = write_header(db_file, db_file->fpdb, -1, 1))) {
-            return ret;
+        if (!(ret = mark_metadata(db_file, i))) {
+            ret = flush_dirty(db_file);
         }
+    }
 
-        return 0;
+    pthread_rwlock_unlock(&db_file->lock);
+
+    if (ret) {
+        return ret;
     }
+
+    return wal_commit(db_file);
 }
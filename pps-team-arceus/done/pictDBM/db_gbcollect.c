@@ -1,89 +1,666 @@
 /**
  * @file db_gbcollect.c
+ * @brief pictDB library: incremental garbage collection.
+ *
+ * The images of the valid pictures are copied byte for byte to a new file,
+ * in steps that only lock the database shared, so it is still served in the
+ * meantime. Images are only ever appended to the database, so what was
+ * copied stays valid; a map from the old offsets to the new ones keeps the
+ * images shared by several pictures shared. The last step locks the database
+ * exclusively, copies the images that appeared in between, writes the
+ * metadata with the new offsets and renames the new file over the database.
+ *
+ * Free extents are not reused while a garbage collection is running: an
+ * offset already copied would then hold another image.
+ *
+ * The images are copied in the order of their offsets, each of them once,
+ * and consecutive ones with a single copy_file_range, so the kernel copies
+ * them without going through user space. Where it is not supported, large
+ * sequential reads and writes are used instead.
  *
  * @date 26 mai 2016
  */
 
+#define _GNU_SOURCE // for copy_file_range
+
 #include "pictDB.h"
-#include "image_content.h"
+#include "db_index.h"
+#include "index_store.h"
+#include "wal.h"
+
+#include <errno.h>
+#include <unistd.h> // for copy_file_range, fsync, pwrite
+
+#define GC_BUFFER_SIZE (1 << 20)	// bytes read at once without copy_file_range
+#define MAX_RUN_SIZE (64 << 20)	// bytes of consecutive images copied at once
+#define MIN_MOVED 64
+
+/*map from the offset of an image in the database to its offset in the
+ *compacted file, by open addressing. 0 marks an empty bucket.*/
+struct offset_map {
+    uint64_t*				keys;
+    uint64_t*				values;
+    size_t					mask;		// number of buckets - 1
+    size_t					count;
+};
+
+/*image of the database to copy*/
+struct extent {
+    uint64_t				offset;
+    uint32_t				size;
+};
+
+/*state of a garbage collection*/
+struct pictdb_gc {
+    struct pictdb_file*		db_file;
+    char*					filename;
+    char*					tempname;
+    FILE*					file;		// the compacted file
+    uint64_t				end;		// size of the compacted file
+    struct extent*			extents;	// images at gc_begin, by offset
+    size_t					count;
+    size_t					next;		// next image to copy
+    struct offset_map		moved;		// images copied so far
+    char*					buffer;		// NULL until copy_file_range fails
+};
 
 /**
- *  @brief  Copies only the valid data from the db_file called filename
- * 			into a new created db_file called with tempname, removes the
- * 			filename and renames the tempname with filename
+ *  @brief  Allocates an empty map of count buckets, a power of two
  *
- *  @param 	db_file :       The file we want to clean
- * 	@param 	filename :		The name of the file from from which we want to clean
- * 							the invalid data
- * 	@param 	tempname :		The name of the file were we want to copy
- * 							the temporary data
+ *  @param  map :       The map to allocate
+ *  @param  count :     The number of buckets
  *
  *  @return An error code
  */
-int do_gbcollect(struct pictdb_file* db_file, const char* filename, const char* tempname)
+static int map_alloc(struct offset_map* map, size_t count)
+{
+    map->keys = calloc(count, sizeof(uint64_t));
+    map->values = calloc(count, sizeof(uint64_t));
+
+    if (map->keys == NULL || map->values == NULL) {
+        free(map->keys);
+        free(map->values);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    map->mask = count - 1;
+    map->count = 0;
+    return 0;
+}
+
+/**
+ *  @brief  Returns the bucket of key in map, or the empty bucket where it
+ *          belongs
+ *
+ *  @param  map :       The map to search into
+ *  @param  key :       The offset to look for
+ *
+ *  @return The index of the bucket
+ */
+static size_t map_bucket(const struct offset_map* map, uint64_t key)
+{
+    size_t b = (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 24) & map->mask;
+
+    while (map->keys[b] != 0 && map->keys[b] != key) {
+        b = (b + 1) & map->mask;
+    }
+
+    return b;
+}
+
+/**
+ *  @brief  Adds key to map, growing it to keep it at most half full
+ *
+ *  @param  map :       The map to update
+ *  @param  key :       The offset of the image in the database
+ *  @param  value :     Its offset in the compacted file
+ *
+ *  @return An error code
+ */
+static int map_put(struct offset_map* map, uint64_t key, uint64_t value)
 {
+    if (2 * (map->count + 1) > map->mask + 1) {
+        struct offset_map bigger;
+        int ret = 0;
+
+        if ((ret = map_alloc(&bigger, 2 * (map->mask + 1)))) {
+            return ret;
+        }
+
+        for (size_t i = 0; i <= map->mask; i++) {
+            if (map->keys[i] != 0) {
+                const size_t b = map_bucket(&bigger, map->keys[i]);
+                bigger.keys[b] = map->keys[i];
+                bigger.values[b] = map->values[i];
+            }
+        }
+
+        bigger.count = map->count;
+        free(map->keys);
+        free(map->values);
+        *map = bigger;
+    }
+
+    const size_t b = map_bucket(map, key);
+
+    if (map->keys[b] == 0) {
+        map->keys[b] = key;
+        map->count++;
+    }
+
+    map->values[b] = value;
+    return 0;
+}
+
+/**
+ *  @brief  Copies size bytes at offset in the database to the end of the
+ *          compacted file
+ *
+ *  @param  gc :        The garbage collection
+ *  @param  offset :    The offset of the bytes in the database
+ *  @param  size :      The number of bytes
+ *
+ *  @return An error code
+ */
+static int copy_range(struct pictdb_gc* gc, uint64_t offset, uint64_t size)
+{
+    const int in = fileno(gc->db_file->fpdb);
+    const int out = fileno(gc->file);
+    off64_t from = (off64_t) offset;
+    off64_t to = (off64_t) gc->end;
+    uint64_t done = 0;
     int ret = 0;
-    char* tab;
-    uint32_t size = 0;
 
-    if (db_file == NULL || db_file->fpdb == NULL) {
-        return ERR_INVALID_ARGUMENT;
+    while (gc->buffer == NULL && done < size) {
+        const ssize_t n = copy_file_range(in, &from, out, &to, size - done, 0);
+
+        if (n > 0) {
+            done += (uint64_t) n;
+        } else if (n == 0 || (errno != ENOSYS && errno != EXDEV &&
+                              errno != EINVAL && errno != EOPNOTSUPP)) {
+            return ERR_IO;
+        } else if ((gc->buffer = malloc(GC_BUFFER_SIZE)) == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
     }
 
-    struct pictdb_file database;
-    database.header.max_files = db_file->header.max_files;
+    while (done < size) {
+        const size_t length = size - done < GC_BUFFER_SIZE ?
+                              size - done : GC_BUFFER_SIZE;
+
+        if ((ret = read_disk_image(gc->db_file->fpdb, &gc->buffer, length,
+                                   offset + done))) {
+            return ret;
+        }
+
+        for (size_t written = 0; written < length;) {
+            const ssize_t n = pwrite(out, gc->buffer + written, length - written,
+                                     (off_t) (gc->end + done + written));
+
+            if (n <= 0) {
+                return ERR_IO;
+            }
 
-    for (size_t i = 0; i < 2 * (NB_RES - 1); i++) {
-        database.header.res_resized[i] = db_file->header.res_resized[i];
+            written += (size_t) n;
+        }
+
+        done += length;
     }
 
-    if ((ret = do_create(tempname, &database))) {
+    gc->end += size;
+    return 0;
+}
+
+/**
+ *  @brief  Copies the image at offset in the database to the end of the
+ *          compacted file, unless it was already
+ *
+ *  @param  gc :        The garbage collection
+ *  @param  offset :    The offset of the image in the database
+ *  @param  size :      The size of the image
+ *  @param  moved :     Its offset in the compacted file
+ *  @param  copied :    Incremented by the number of bytes copied
+ *
+ *  @return An error code
+ */
+static int copy_image(struct pictdb_gc* gc, uint64_t offset, uint32_t size,
+                      uint64_t* moved, size_t* copied)
+{
+    const size_t b = map_bucket(&gc->moved, offset);
+    int ret = 0;
+
+    if (gc->moved.keys[b] != 0) {
+        *moved = gc->moved.values[b];
+        return 0;
+    }
+
+    *moved = gc->end;
+
+    if ((ret = copy_range(gc, offset, size))) {
         return ret;
     }
 
-    size_t index = 0;
+    *copied += size;
+    return map_put(&gc->moved, offset, *moved);
+}
 
-    for (size_t i = 0; i < db_file->header.max_files; i++) {
-        if (db_file->metadata[i].is_valid == NON_EMPTY) {
-            if ((ret = do_read(db_file->metadata[i].pict_id, RES_ORIG, &tab, &size, db_file))) {
-                do_close(&database);
-                return ret;
+/**
+ *  @brief  Compares two extents by offset, for qsort
+ *
+ *  @param  a :         The first extent
+ *  @param  b :         The second extent
+ *
+ *  @return A negative, zero or positive value as a is before, at or after b
+ */
+static int compare_extents(const void* a, const void* b)
+{
+    const uint64_t x = ((const struct extent*) a)->offset;
+    const uint64_t y = ((const struct extent*) b)->offset;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ *  @brief  Lists the images of the valid pictures of the database in the
+ *          order of their offsets, each of them once. The database must be
+ *          locked.
+ *
+ *  @param  gc :        The garbage collection
+ *
+ *  @return An error code
+ */
+static int list_extents(struct pictdb_gc* gc)
+{
+    struct pictdb_file* db_file = gc->db_file;
+    size_t count = 0;
+
+    if ((gc->extents = calloc((size_t) db_file->header.max_files * NB_RES + 1,
+                              sizeof(struct extent))) == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    for (size_t i = index_next_valid(db_file, 0); i < db_file->header.max_files;
+         i = index_next_valid(db_file, i + 1)) {
+        const struct pict_metadata* metadata = &db_file->metadata[i];
+
+        for (int code = 0; code < NB_RES; code++) {
+            // the mirror, when built, spares reading the metadata
+            const uint64_t offset = db_file->mirror.offsets != NULL ?
+                                    db_file->mirror.offsets[i * NB_RES + code] :
+                                    metadata->offset[code];
+
+            if (offset != 0) {
+                gc->extents[count].offset = offset;
+                gc->extents[count].size = db_file->mirror.sizes != NULL ?
+                                          db_file->mirror.sizes[i * NB_RES + code] :
+                                          metadata->size[code];
+                count++;
             }
+        }
+    }
+
+    qsort(gc->extents, count, sizeof(struct extent), compare_extents);
+
+    // shared images appear once per picture
+    gc->count = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (gc->count == 0 ||
+            gc->extents[gc->count - 1].offset != gc->extents[i].offset) {
+            gc->extents[gc->count++] = gc->extents[i];
+        }
+    }
 
-            if ((ret = do_insert(tab, size, db_file->metadata[i].pict_id, &database))) {
-                free(tab);
-                do_close(&database);
+    return 0;
+}
+
+/**
+ *  @brief  Copies the images of the picture at index, if it is valid
+ *
+ *  @param  gc :        The garbage collection
+ *  @param  index :     The index of the picture
+ *  @param  metadata :  Set to the metadata with the new offsets, if not NULL
+ *  @param  copied :    Incremented by the number of bytes copied
+ *
+ *  @return An error code
+ */
+static int copy_picture(struct pictdb_gc* gc, size_t index,
+                        struct pict_metadata* metadata, size_t* copied)
+{
+    const struct pict_metadata* old = &gc->db_file->metadata[index];
+    uint64_t moved = 0;
+    int ret = 0;
+
+    if (old->is_valid != NON_EMPTY) {
+        return 0;
+    }
+
+    if (metadata != NULL) {
+        *metadata = *old;
+    }
+
+    for (int code = 0; code < NB_RES; code++) {
+        if (old->offset[code] != 0) {
+            if ((ret = copy_image(gc, old->offset[code], old->size[code],
+                                  &moved, copied))) {
                 return ret;
             }
 
-            free(tab);
+            if (metadata != NULL) {
+                metadata->offset[code] = moved;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Makes a copy of string
+ *
+ *  @param  string :    The string to copy
+ *
+ *  @return The copy, NULL if it could not be allocated
+ */
+static char* copy_string(const char* string)
+{
+    char* copy = malloc(strlen(string) + 1);
+
+    if (copy != NULL) {
+        strcpy(copy, string);
+    }
+
+    return copy;
+}
+
+/**
+ *  @brief  Frees a garbage collection and closes its file, if it is still
+ *          open
+ *
+ *  @param  gc :        The garbage collection
+ */
+static void gc_free(struct pictdb_gc* gc)
+{
+    if (gc->file != NULL) {
+        fclose(gc->file);
+    }
+
+    free(gc->moved.keys);
+    free(gc->moved.values);
+    free(gc->extents);
+    free(gc->buffer);
+    free(gc->filename);
+    free(gc->tempname);
+    free(gc);
+}
+
+/**
+ *  @brief  Starts an incremental garbage collection of db_file, the database
+ *          called filename, into a new file called tempname
+ *
+ *  @param  db_file :   The database to compact
+ *  @param  filename :  The name of the database
+ *  @param  tempname :  The name of the compacted file, until it replaces the
+ *                      database
+ *  @param  gc :        The state of the garbage collection
+ *
+ *  @return An error code
+ */
+int gc_begin(struct pictdb_file* db_file, const char* filename,
+             const char* tempname, struct pictdb_gc** gc)
+{
+    if (db_file == NULL || filename == NULL || tempname == NULL || gc == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct pictdb_gc* state = calloc(1, sizeof(struct pictdb_gc));
+
+    if (state == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    state->db_file = db_file;
+
+    if ((state->filename = copy_string(filename)) == NULL ||
+        (state->tempname = copy_string(tempname)) == NULL ||
+        map_alloc(&state->moved, MIN_MOVED)) {
+        gc_free(state);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&db_file->lock);
+
+    if (db_file->fpdb == NULL || db_file->metadata == NULL) {
+        pthread_rwlock_unlock(&db_file->lock);
+        gc_free(state);
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    db_file->free_extents.frozen++;
+    pthread_rwlock_unlock(&db_file->lock);
+
+    pthread_rwlock_rdlock(&db_file->lock);
+    ret = list_extents(state);
+    pthread_rwlock_unlock(&db_file->lock);
+
+    if (ret) {
+        gc_abort(state);
+        return ret;
+    }
+
+    // the images follow the metadata, which is written last
+    state->end = sizeof(struct pictdb_header) +
+                 (uint64_t) db_file->header.max_files * sizeof(struct pict_metadata);
+
+    if ((state->file = fopen(tempname, "w+b")) == NULL) {
+        gc_abort(state);
+        return ERR_IO;
+    }
+
+    *gc = state;
+    return 0;
+}
+
+/**
+ *  @brief  Copies the next images to the compacted file, byte for byte,
+ *          until about budget bytes were copied. The lock of the database is
+ *          only taken shared, so that it can still be read.
+ *
+ *  @param  gc :        The garbage collection
+ *  @param  budget :    The number of bytes to copy
+ *  @param  done :      Set once every image was copied
+ *
+ *  @return An error code
+ */
+int gc_step(struct pictdb_gc* gc, size_t budget, int* done)
+{
+    if (gc == NULL || done == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct pictdb_file* db_file = gc->db_file;
+    size_t copied = 0;
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&db_file->lock);
+
+    while (!ret && copied < budget && gc->next < gc->count) {
+        const struct extent* first = &gc->extents[gc->next];
+        const uint64_t base = gc->end;
+        uint64_t size = first->size;
+        size_t last = gc->next + 1;
+
+        // images that follow each other are copied together
+        while (last < gc->count && size < MAX_RUN_SIZE &&
+               gc->extents[last].offset == first->offset + size) {
+            size += gc->extents[last].size;
+            last++;
+        }
 
-            for (size_t j = 0; j < NB_RES; j++) {
-                if (db_file->metadata[i].offset[j]) {
-                    if ((ret = lazily_resize(j, &database, index))) {
-                        do_close(&database);
-                        return ret;
-                    }
-                }
+        if (!(ret = copy_range(gc, first->offset, size))) {
+            copied += size;
+
+            for (; !ret && gc->next < last; gc->next++) {
+                const struct extent* extent = &gc->extents[gc->next];
+                ret = map_put(&gc->moved, extent->offset,
+                              base + (extent->offset - first->offset));
             }
+        }
+    }
+
+    *done = gc->next >= gc->count;
+
+    pthread_rwlock_unlock(&db_file->lock);
+    return ret;
+}
+
+/**
+ *  @brief  Copies the images that changed during the steps, writes the
+ *          metadata and replaces the database by the compacted file, which
+ *          becomes the fpdb of the database. The lock of the database is
+ *          taken exclusively, for a time bounded by these changes. The
+ *          garbage collection is freed in any case.
+ *
+ *  @param  gc :        The garbage collection
+ *
+ *  @return An error code
+ */
+int gc_finish(struct pictdb_gc* gc)
+{
+    if (gc == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct pictdb_file* db_file = gc->db_file;
+    const size_t max_files = db_file->header.max_files;
+    struct pict_metadata* metadata = NULL;
+    struct pictdb_header header;
+    size_t copied = 0;
+    int ret = 0;
+
+    if ((metadata = calloc(max_files, sizeof(struct pict_metadata))) == NULL) {
+        gc_abort(gc);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    pthread_rwlock_wrlock(&db_file->lock);
+
+    // offsets that are not in the map were written after the steps
+    for (size_t i = index_next_valid(db_file, 0); !ret && i < max_files;
+         i = index_next_valid(db_file, i + 1)) {
+        ret = copy_picture(gc, i, &metadata[i], &copied);
+    }
+
+    // the log refers to the old offsets: it must be empty before the rename
+    if (!ret && db_file->wal != NULL) {
+        ret = wal_checkpoint(db_file);
+    }
 
-            index++;
+    // the compacted table is contiguous, even if the database was grown
+    header = db_file->header;
+    header.format = PICTDB_CONTIGUOUS;
+    header.directory = 0;
+
+    if (!ret &&
+        (fseek(gc->file, 0, SEEK_SET) ||
+         fwrite(&header, sizeof(struct pictdb_header), 1, gc->file) != 1 ||
+         fwrite(metadata, sizeof(struct pict_metadata), max_files,
+                gc->file) != max_files ||
+         fflush(gc->file) || fsync(fileno(gc->file)))) {
+        ret = ERR_IO;
+    }
+
+    // on failure, the database keeps its file and the compacted one is removed
+    if (!ret && !(ret = swap_database_file(db_file, gc->file, gc->tempname,
+                                           gc->filename))) {
+        if (db_file->map == NULL) {
+            memcpy(db_file->metadata, metadata,
+                   max_files * sizeof(struct pict_metadata));
+        }
+
+        gc->file = NULL;
+        db_file->free_extents.frozen--;
+        db_file->header = header;
+        load_chunks(db_file);
+
+        // the images moved and the free extents are gone; without the
+        // indexes, lookups fall back to scanning the metadata
+        if (!index_build(db_file)) {
+            index_store_sync(db_file);
         }
     }
 
-    strncpy(database.header.db_name, db_file->header.db_name, MAX_DB_NAME);
-    database.header.db_version = db_file->header.db_version;
-    if ((ret = write_header(&database, database.fpdb, 0, 0))) {
-        do_close(&database);
+    pthread_rwlock_unlock(&db_file->lock);
+
+    free(metadata);
+
+    if (ret) {
+        gc_abort(gc);
+    } else {
+        gc_free(gc);
+    }
+
+    return ret;
+}
+
+/**
+ *  @brief  Stops a garbage collection, removes the compacted file and frees it
+ *
+ *  @param  gc :        The garbage collection
+ */
+void gc_abort(struct pictdb_gc* gc)
+{
+    if (gc != NULL) {
+        pthread_rwlock_wrlock(&gc->db_file->lock);
+        gc->db_file->free_extents.frozen--;
+        pthread_rwlock_unlock(&gc->db_file->lock);
+
+        if (gc->file != NULL) {
+            fclose(gc->file);
+            gc->file = NULL;
+            remove(gc->tempname);
+        }
+
+        gc_free(gc);
+    }
+}
+
+/**
+ *  @brief  Compacts db_file, the database called filename, through the
+ *          temporary file tempname, then closes it. The pictures keep their
+ *          index and their images are copied byte for byte.
+ *
+ *  @param  db_file :   The database to compact
+ *  @param  filename :  The name of the database
+ *  @param  tempname :  The name of the temporary file
+ *
+ *  @return An error code
+ */
+int do_gbcollect(struct pictdb_file* db_file, const char* filename, const char* tempname)
+{
+    struct pictdb_gc* gc = NULL;
+    int done = 0;
+    int ret = 0;
+
+    if ((ret = gc_begin(db_file, filename, tempname, &gc))) {
         return ret;
     }
 
-    do_close(db_file);
-    do_close(&database);
+    while (!done && !ret) {
+        ret = gc_step(gc, (size_t) -1, &done);
+    }
 
-    if (remove(filename) || rename(tempname, filename)) {
-        return ERR_IO;
+    if (ret) {
+        gc_abort(gc);
+        return ret;
     }
 
+    if ((ret = gc_finish(gc))) {
+        return ret;
+    }
+
+    do_close(db_file);
     return 0;
 }
@@ -0,0 +1,203 @@
+/**
+ * @file db_grow.c
+ * @brief pictDB library: do_grow implementation.
+ *
+ * The new metadata is appended to the file as a chunk, followed by a new
+ * chunk directory, and both are synced before the header is rewritten to
+ * point to them. A crash before the header is written leaves the database as
+ * it was, with unreferenced bytes at its end; the previous directory is
+ * reclaimed like a deleted image once the header is.
+ *
+ * The chunks of a grown table are not contiguous, so a database opened with
+ * OPEN_MMAP has its table copied to memory and unmapped when it grows: from
+ * then on, it is read and written as without OPEN_MMAP, like do_open does
+ * for a chunked database.
+ *
+ * @date 17 Oct 2026
+ */
+
+#include "pictDB.h"
+#include "db_index.h"
+#include "index_store.h"
+#include "wal.h"
+
+#include <sys/mman.h> // for munmap
+#include <unistd.h> // for fsync
+
+/**
+ *  @brief  Appends a chunk of files empty metadata to the file of db_file,
+ *          then a directory listing the chunks of db_file and the new one
+ *
+ *  @param  db_file :   The database
+ *  @param  chunk :     The new chunk, its offset set here
+ *  @param  directory : The offset of the new directory
+ *
+ *  @return An error code
+ */
+static int append_chunk(struct pictdb_file* db_file, struct pictdb_chunk* chunk,
+                        uint64_t* directory)
+{
+    struct pictdb_directory start;
+    size_t size = 0;
+    int ret = 0;
+
+    if ((ret = get_file_size(db_file->fpdb, &size))) {
+        return ret;
+    }
+
+    chunk->offset = size;
+    *directory = size + (uint64_t) chunk->files * sizeof(struct pict_metadata);
+
+    memset(&start, 0, sizeof(start));
+    start.magic = PICTDB_CHUNKED;
+    start.count = (uint32_t) db_file->chunk_count + 1;
+
+    // the new records are zeroed in memory already
+    if (fseek(db_file->fpdb, (long) chunk->offset, SEEK_SET) ||
+        fwrite(&db_file->metadata[chunk->first], sizeof(struct pict_metadata),
+               chunk->files, db_file->fpdb) != chunk->files ||
+        fwrite(&start, sizeof(start), 1, db_file->fpdb) != 1 ||
+        fwrite(db_file->chunks, sizeof(struct pictdb_chunk),
+               db_file->chunk_count, db_file->fpdb) != db_file->chunk_count ||
+        fwrite(chunk, sizeof(struct pictdb_chunk), 1, db_file->fpdb) != 1 ||
+        fflush(db_file->fpdb) || fsync(fileno(db_file->fpdb))) {
+        return ERR_IO;
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Copies the metadata of db_file to a table of max_files metadata in
+ *          memory, the new ones zeroed, and unmaps the file if the metadata
+ *          was mapped
+ *
+ *  @param  db_file :   The database, whose table is written
+ *  @param  max_files : The new maximum number of files
+ *
+ *  @return An error code
+ */
+static int extend_table(struct pictdb_file* db_file, uint32_t max_files)
+{
+    const size_t old_files = db_file->header.max_files;
+    struct pict_metadata* metadata = NULL;
+
+    if (db_file->map == NULL) {
+        if ((metadata = realloc(db_file->metadata, max_files *
+                                sizeof(struct pict_metadata))) == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+    } else {
+        if ((metadata = malloc(max_files * sizeof(struct pict_metadata))) == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        memcpy(metadata, db_file->metadata,
+               old_files * sizeof(struct pict_metadata));
+
+        // the shared mapping was written, its pages reach the file anyway
+        munmap(db_file->map, db_file->map_size);
+        db_file->map = NULL;
+        db_file->map_size = 0;
+        db_file->flags &= ~(OPEN_MMAP | OPEN_MMAP_SYNC);
+    }
+
+    memset(&metadata[old_files], 0,
+           (max_files - old_files) * sizeof(struct pict_metadata));
+    db_file->metadata = metadata;
+
+    return 0;
+}
+
+/**
+ *  @brief  Grows the metadata table of db_file to max_files. See pictDB.h.
+ *
+ *  @param  db_file :   The database to grow
+ *  @param  max_files : The new maximum number of files
+ *
+ *  @return An error code
+ */
+int do_grow(struct pictdb_file* db_file, uint32_t max_files)
+{
+    if (db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    if (max_files > MAX_CHUNKED_FILES) {
+        return ERR_MAX_FILES;
+    }
+
+    pthread_rwlock_wrlock(&db_file->lock);
+
+    if (db_file->fpdb == NULL || db_file->metadata == NULL) {
+        pthread_rwlock_unlock(&db_file->lock);
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const struct pictdb_header header = db_file->header;
+    struct pictdb_chunk chunk;
+    struct pictdb_chunk* chunks = NULL;
+    uint64_t directory = 0;
+    int ret = 0;
+
+    if (db_file->free_extents.frozen > 0) {
+        // a garbage collection is copying the table
+        ret = ERR_GC_RUNNING;
+    } else if (max_files <= header.max_files) {
+        ret = ERR_MAX_FILES;
+    } else if (db_file->wal != NULL) {
+        // the log then only has to hold records of the new size
+        ret = wal_checkpoint(db_file);
+    } else {
+        ret = write_dirty(db_file);
+    }
+
+    if (!ret) {
+        if ((chunks = realloc(db_file->chunks, (db_file->chunk_count + 1) *
+                              sizeof(struct pictdb_chunk))) == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+        } else {
+            db_file->chunks = chunks;
+            ret = extend_table(db_file, max_files);
+        }
+    }
+
+    if (!ret) {
+        chunk.first = header.max_files;
+        chunk.files = max_files - header.max_files;
+
+        ret = append_chunk(db_file, &chunk, &directory);
+    }
+
+    if (!ret) {
+        db_file->header.format = PICTDB_CHUNKED;
+        db_file->header.directory = directory;
+        db_file->header.max_files = max_files;
+
+        if ((ret = write_header(db_file, db_file->fpdb, 0, 1)) ||
+            fflush(db_file->fpdb) || fsync(fileno(db_file->fpdb))) {
+            ret = ret ? ret : ERR_IO;
+            db_file->header = header;
+        }
+    }
+
+    if (!ret) {
+        db_file->chunks[db_file->chunk_count++] = chunk;
+
+        // sized by max_files, so allocated again when needed
+        free(db_file->dirty.bits);
+        db_file->dirty.bits = NULL;
+        db_file->dirty.first = 0;
+        db_file->dirty.last = 0;
+
+        if (!(ret = wal_resize(db_file)) &&
+            !(ret = index_build(db_file))) {
+            // stored indexes have the size of the table
+            index_store_sync(db_file);
+        }
+    }
+
+    pthread_rwlock_unlock(&db_file->lock);
+
+    return ret;
+}
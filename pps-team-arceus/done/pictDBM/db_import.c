@@ -0,0 +1,324 @@
+/**
+ * @file db_import.c
+ * @brief pictDB library: do_import implementation.
+ *
+ * Files are imported in batches. The files of a batch are read, hashed and
+ * probed for their resolution by a pool of threads, without holding the lock
+ * of the database. The batch is then appended with the lock held
+ * exclusively: pictures already in the database are deduplicated through the
+ * content index, and the new metadata is marked dirty and flushed once per
+ * batch. The header is written once, at the end of the import.
+ *
+ * @date 17 Oct 2026
+ */
+
+#include "pictDB.h"
+#include "db_index.h"
+#include "image_content.h"
+#include "wal.h"
+
+#include <openssl/sha.h>
+#include <pthread.h>
+#include <unistd.h> // for sysconf
+
+#define FILES_PER_THREAD 16	// files of a batch per thread
+#define MAX_IMPORT_THREADS 64
+
+/*file of the batch being imported*/
+struct import_item {
+    const char*		filename;
+    const char*		pict_id;
+    int*			result;
+    char*			image;
+    size_t			size;
+    unsigned char	SHA[SHA256_DIGEST_LENGTH];
+    uint32_t		height;
+    uint32_t		width;
+};
+
+/*batch shared by the preparing threads*/
+struct import_batch {
+    struct import_item*	items;
+    size_t				count;
+    size_t				next;		// first item no thread has taken yet
+    pthread_mutex_t		mutex;
+};
+
+/**
+ *  @brief  Reads, hashes and probes the resolution of the file of an item.
+ *          Sets the result of the item on failure.
+ *
+ *  @param  item :      The item to prepare
+ */
+static void prepare_item(struct import_item* item)
+{
+    FILE* file = NULL;
+    int ret = 0;
+
+    if ((file = fopen(item->filename, "rb")) == NULL) {
+        *item->result = ERR_IO;
+        return;
+    }
+
+    if (!(ret = get_file_size(file, &item->size))) {
+        if ((item->image = calloc(item->size, sizeof(char))) == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+        } else if (!(ret = read_disk_image(file, &item->image, item->size, 0))) {
+            SHA256((unsigned char*) item->image, item->size, item->SHA);
+            ret = get_resolution(&item->height, &item->width, item->image,
+                                 item->size);
+        }
+    }
+
+    fclose(file);
+
+    if (ret) {
+        free(item->image);
+        item->image = NULL;
+        *item->result = ret;
+    }
+}
+
+/**
+ *  @brief  Prepares the items of a batch until there are none left
+ *
+ *  @param  arg :       The batch
+ *
+ *  @return NULL
+ */
+static void* prepare_main(void* arg)
+{
+    struct import_batch* batch = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&batch->mutex);
+        const size_t i = batch->next++;
+        pthread_mutex_unlock(&batch->mutex);
+
+        if (i >= batch->count) {
+            break;
+        }
+
+        prepare_item(&batch->items[i]);
+    }
+
+    vips_thread_shutdown();
+    return NULL;
+}
+
+/**
+ *  @brief  Prepares the items of a batch on threads threads, the calling
+ *          thread being one of them
+ *
+ *  @param  batch :     The batch to prepare
+ *  @param  threads :   The number of threads to use
+ */
+static void prepare_batch(struct import_batch* batch, size_t threads)
+{
+    pthread_t workers[MAX_IMPORT_THREADS];
+    size_t started = 0;
+
+    batch->next = 0;
+
+    while (started + 1 < threads &&
+           !pthread_create(&workers[started], NULL, prepare_main, batch)) {
+        started++;
+    }
+
+    prepare_main(batch);
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+/**
+ *  @brief  Appends a prepared item to db_file, which must be locked
+ *          exclusively, and marks its metadata dirty
+ *
+ *  @param  item :      The item to append
+ *  @param  db_file :   The database
+ *  @param  index :     The index the item was given
+ *
+ *  @return An error code
+ */
+static int append_item(const struct import_item* item,
+                       struct pictdb_file* db_file, size_t* index)
+{
+    if (item->pict_id[0] == '\0' || strlen(item->pict_id) > MAX_PIC_ID) {
+        return ERR_INVALID_PICID;
+    }
+
+    if (find_index(db_file, item->pict_id) != (size_t) -1) {
+        return ERR_DUPLICATE_ID;
+    }
+
+    if (db_file->header.num_files >= db_file->header.max_files ||
+        (*index = find_free_slot(db_file)) == (size_t) -1) {
+        return ERR_FULL_DATABASE;
+    }
+
+    struct pict_metadata* metadata = &db_file->metadata[*index];
+    const size_t twin = index_find_sha(db_file, item->SHA, *index);
+    int ret = 0;
+
+    memset(metadata, 0, sizeof(struct pict_metadata));
+    strncpy(metadata->pict_id, item->pict_id, MAX_PIC_ID);
+    memcpy(metadata->SHA, item->SHA, SHA256_DIGEST_LENGTH);
+
+    if (twin != (size_t) -1) {
+        const struct pict_metadata* other = &db_file->metadata[twin];
+
+        memcpy(metadata->offset, other->offset, sizeof(metadata->offset));
+        memcpy(metadata->size, other->size, sizeof(metadata->size));
+        metadata->res_orig[0] = other->res_orig[0];
+        metadata->res_orig[1] = other->res_orig[1];
+    } else {
+        metadata->res_orig[0] = item->width;
+        metadata->res_orig[1] = item->height;
+        metadata->size[RES_ORIG] = (uint32_t) item->size;
+
+        if ((ret = store_image(db_file, item->image, item->size,
+                               &(metadata->offset[RES_ORIG])))) {
+            return ret;
+        }
+    }
+
+    metadata->is_valid = NON_EMPTY;
+    index_add(db_file, *index);
+    db_file->header.num_files++;
+
+    return mark_metadata(db_file, *index);
+}
+
+/**
+ *  @brief  Appends the prepared items of a batch to db_file and writes their
+ *          metadata
+ *
+ *  @param  batch :     The prepared batch
+ *  @param  db_file :   The database
+ *  @param  imported :  Incremented for every picture imported
+ *
+ *  @return An error code, if the database could not be written
+ */
+static int append_batch(struct import_batch* batch, struct pictdb_file* db_file,
+                        size_t* imported)
+{
+    size_t index = 0;
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&db_file->lock);
+
+    for (size_t i = 0; i < batch->count; i++) {
+        struct import_item* item = &batch->items[i];
+
+        if (*item->result == 0) {
+            *item->result = append_item(item, db_file, &index);
+
+            if (*item->result == 0) {
+                (*imported)++;
+            } else if (*item->result == ERR_IO) {
+                // the database itself could not be written
+                ret = ERR_IO;
+            }
+        }
+    }
+
+    const int err = flush_dirty(db_file);
+    pthread_rwlock_unlock(&db_file->lock);
+
+    return ret ? ret : err;
+}
+
+/**
+ *  @brief  Imports count image files into db_file. The files are read,
+ *          hashed and probed in parallel, then appended in batches with a
+ *          single header update at the end. A file that cannot be imported
+ *          doesn't stop the others.
+ *
+ *  @param  filenames : The names of the files to import
+ *  @param  pict_ids :  The ids to give to the pictures
+ *  @param  results :   The error code of the import of each file
+ *  @param  count :     The number of files
+ *  @param  imported :  The number of pictures imported
+ *  @param  db_file :   The database to import into
+ *
+ *  @return An error code, if the database itself could not be written
+ */
+int do_import(const char* const* filenames, const char* const* pict_ids,
+              int* results, size_t count, size_t* imported,
+              struct pictdb_file* db_file)
+{
+    if (filenames == NULL || pict_ids == NULL || results == NULL ||
+        imported == NULL || db_file == NULL || db_file->metadata == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads < 1) {
+        threads = 1;
+    } else if (threads > MAX_IMPORT_THREADS) {
+        threads = MAX_IMPORT_THREADS;
+    }
+
+    const size_t batch_size = (size_t) threads * FILES_PER_THREAD;
+    struct import_batch batch;
+    int ret = 0;
+
+    *imported = 0;
+
+    if ((batch.items = calloc(batch_size, sizeof(struct import_item))) == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    pthread_mutex_init(&batch.mutex, NULL);
+
+    size_t start = 0;
+
+    for (; !ret && start < count; start += batch_size) {
+        batch.count = count - start < batch_size ? count - start : batch_size;
+
+        for (size_t i = 0; i < batch.count; i++) {
+            struct import_item* item = &batch.items[i];
+
+            memset(item, 0, sizeof(struct import_item));
+            item->filename = filenames[start + i];
+            item->pict_id = pict_ids[start + i];
+            item->result = &results[start + i];
+            *item->result = 0;
+        }
+
+        prepare_batch(&batch, (size_t) threads);
+        ret = append_batch(&batch, db_file, imported);
+
+        for (size_t i = 0; i < batch.count; i++) {
+            free(batch.items[i].image);
+        }
+    }
+
+    // the files after a failed batch are not imported
+    for (size_t i = start; i < count; i++) {
+        results[i] = ret;
+    }
+
+    if (*imported > 0) {
+        pthread_rwlock_wrlock(&db_file->lock);
+        mark_header(db_file, 0, 1);
+        const int err = flush_dirty(db_file);
+        pthread_rwlock_unlock(&db_file->lock);
+
+        if (!ret) {
+            ret = err;
+        }
+    }
+
+    if (!ret) {
+        ret = wal_commit(db_file);
+    }
+
+    pthread_mutex_destroy(&batch.mutex);
+    free(batch.items);
+
+    return ret;
+}
@@ -0,0 +1,1161 @@
+/**
+ * @file db_index.c
+ * @brief in-memory indexes over the metadata of a pictDB
+ *
+ * Both indexes are open-addressing hash tables with linear probing. Buckets
+ * store the metadata index + 1 of a valid picture (0 marks an empty bucket)
+ * and keys are read back from the metadata, so the tables themselves stay
+ * small. Deletions shift the following entries back instead of leaving
+ * tombstones, which keeps probe sequences short after many deletes.
+ *
+ * The pict_id index holds unique keys. The SHA index may hold several
+ * pictures with the same content, which then sit in the same probe sequence.
+ *
+ * Empty slots are tracked in a bitmap. A cursor remembers the first word that
+ * may still hold a set bit, so finding the first empty slot does not rescan
+ * the full words in front of it. Its complement is the validity of the
+ * pictures, which scans read 64 slots at a time.
+ *
+ * The hashes of the keys and the images of the valid pictures are mirrored
+ * in arrays of their own. Probes and scans compare them first, and only read
+ * the metadata of a picture, a few hundred bytes, once its hash matches.
+ *
+ * Deduplicated pictures share their images, so a third table counts the valid
+ * pictures that refer to each offset of the data section. It is rebuilt from
+ * the metadata at every open rather than stored in the file, so it can never
+ * disagree with it. When a count drops to zero, the image goes to the list of
+ * free extents of the database.
+ *
+ * The free extents are kept by offset and merged with their neighbours, and
+ * store_image takes the smallest one that fits. At open, every part of the
+ * data section that no valid picture refers to is free. An extent is reused
+ * only once no location found before its release can still be read, and,
+ * with a log, once its release is durable: otherwise a crash could bring
+ * back a picture whose image was overwritten.
+ *
+ * The pict_id and SHA tables may also be stored in the file (see
+ * index_store.h). They are then read back at open instead of being rebuilt,
+ * and the blocks of buckets they change are marked to be stored again.
+ *
+ * @date 17 Oct 2026
+ */
+
+#include "pictDB.h"
+#include "db_index.h"
+#include "index_store.h"
+#include "scan.h"
+#include "wal.h"
+
+#define MIN_BUCKETS 16
+#define MIN_FREE_EXTENTS 16
+
+typedef uint64_t (*key_hash)(const struct pictdb_file*, size_t);
+
+/**
+ *  @brief  Hashes a string with 64-bit FNV-1a
+ *
+ *  @param  string :    The string to hash
+ *
+ *  @return The hash value
+ */
+static uint64_t hash_string(const char* string)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (; *string != '\0'; string++) {
+        hash ^= (unsigned char) *string;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ *  @brief  Hashes a SHA. Its first bytes are already uniformly distributed.
+ *
+ *  @param  SHA :   The SHA to hash
+ *
+ *  @return The hash value
+ */
+static uint64_t hash_sha(const unsigned char* SHA)
+{
+    uint64_t hash = 0;
+    memcpy(&hash, SHA, sizeof(hash));
+    return hash;
+}
+
+/**
+ *  @brief  Returns the key hash of the picture at index of db_file, mirrored
+ *          in keys. The hashes are computed on first use, so that opening a
+ *          database whose tables are stored doesn't hash every key. Readers
+ *          that share the lock may compute one together: they store the same
+ *          value.
+ *
+ *  @param  keys :      The mirrored hashes, 0 until computed
+ *  @param  index :     The index of the picture
+ *  @param  key :       The hash of the key of a metadata
+ *  @param  metadata :  The metadata of the picture
+ *
+ *  @return The hash value
+ */
+static uint64_t mirrored_hash(uint64_t* keys, size_t index,
+                              uint64_t (*key)(const struct pict_metadata*),
+                              const struct pict_metadata* metadata)
+{
+    uint64_t hash = __atomic_load_n(&keys[index], __ATOMIC_RELAXED);
+
+    // a key that hashes to 0 is hashed again each time, which is only slower
+    if (hash == 0) {
+        hash = key(metadata);
+        __atomic_store_n(&keys[index], hash, __ATOMIC_RELAXED);
+    }
+
+    return hash;
+}
+
+static uint64_t metadata_id_hash(const struct pict_metadata* metadata)
+{
+    return hash_string(metadata->pict_id);
+}
+
+static uint64_t metadata_sha_hash(const struct pict_metadata* metadata)
+{
+    return hash_sha(metadata->SHA);
+}
+
+static uint64_t id_hash(const struct pictdb_file* db_file, size_t index)
+{
+    return mirrored_hash(db_file->mirror.id_hashes, index, metadata_id_hash,
+                         &db_file->metadata[index]);
+}
+
+static uint64_t sha_hash(const struct pictdb_file* db_file, size_t index)
+{
+    return mirrored_hash(db_file->mirror.sha_prefixes, index, metadata_sha_hash,
+                         &db_file->metadata[index]);
+}
+
+/**
+ *  @brief  Marks the block of bucket b of table to be stored again, if the
+ *          table is stored
+ *
+ *  @param  table :     The table
+ *  @param  b :         The changed bucket
+ */
+static void table_touch(struct pict_index* table, size_t b)
+{
+    if (table->dirty != NULL) {
+        const size_t block = b / INDEX_BLOCK;
+        table->dirty[block / WORD_BITS] |= (uint64_t) 1 << (block % WORD_BITS);
+    }
+}
+
+/**
+ *  @brief  Allocates an empty table for max_files pictures
+ *
+ *  @param  table :     The table to allocate
+ *  @param  max_files : The number of pictures it must hold
+ *
+ *  @return An error code
+ */
+static int table_alloc(struct pict_index* table, size_t max_files)
+{
+    const size_t count = index_buckets(max_files);
+
+    if ((table->buckets = calloc(count, sizeof(uint32_t))) == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    table->mask = count - 1;
+    return 0;
+}
+
+/**
+ *  @brief  Inserts the picture at index in table
+ *
+ *  @param  table :     The table to update
+ *  @param  db_file :   The database, with the picture mirrored
+ *  @param  index :     The index of the picture
+ *  @param  hash :      The key hash function of the table
+ */
+static void table_add(struct pict_index* table,
+                      const struct pictdb_file* db_file,
+                      size_t index, key_hash hash)
+{
+    if (table->buckets == NULL) {
+        return;
+    }
+
+    size_t b = hash(db_file, index) & table->mask;
+
+    while (table->buckets[b] != 0) {
+        b = (b + 1) & table->mask;
+    }
+
+    table->buckets[b] = (uint32_t) index + 1;
+    table_touch(table, b);
+}
+
+/**
+ *  @brief  Removes the picture at index from table
+ *
+ *  @param  table :     The table to update
+ *  @param  db_file :   The database, with the picture mirrored
+ *  @param  index :     The index of the picture
+ *  @param  hash :      The key hash function of the table
+ */
+static void table_remove(struct pict_index* table,
+                         const struct pictdb_file* db_file,
+                         size_t index, key_hash hash)
+{
+    if (table->buckets == NULL) {
+        return;
+    }
+
+    uint32_t* buckets = table->buckets;
+    const size_t mask = table->mask;
+    size_t hole = hash(db_file, index) & mask;
+
+    while (buckets[hole] != index + 1) {
+        if (buckets[hole] == 0) {
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+
+    // backward shift: move up every entry whose probe sequence crosses the hole
+    for (size_t b = (hole + 1) & mask; buckets[b] != 0; b = (b + 1) & mask) {
+        size_t home = hash(db_file, buckets[b] - 1) & mask;
+
+        if (((b - home) & mask) >= ((b - hole) & mask)) {
+            buckets[hole] = buckets[b];
+            table_touch(table, hole);
+            hole = b;
+        }
+    }
+
+    buckets[hole] = 0;
+    table_touch(table, hole);
+}
+
+/**
+ *  @brief  Marks the slot at index as empty or used in the free slot bitmap
+ *
+ *  @param  slots :     The bitmap to update
+ *  @param  index :     The index of the slot
+ *  @param  empty :     Whether the slot is now empty
+ */
+static void slots_mark(struct free_slots* slots, size_t index, int empty)
+{
+    if (slots->bits == NULL) {
+        return;
+    }
+
+    const size_t word = index / WORD_BITS;
+    const uint64_t bit = (uint64_t) 1 << (index % WORD_BITS);
+
+    if (empty) {
+        slots->bits[word] |= bit;
+        if (word < slots->first) {
+            slots->first = word;
+        }
+    } else {
+        slots->bits[word] &= ~bit;
+    }
+}
+
+/**
+ *  @brief  Allocates the mirror of db_file for its max_files metadata
+ *
+ *  @param  mirror :    The mirror to allocate
+ *  @param  max_files : The number of metadata
+ *
+ *  @return An error code
+ */
+static int mirror_alloc(struct metadata_mirror* mirror, size_t max_files)
+{
+    if ((mirror->id_hashes = calloc(max_files, sizeof(uint64_t))) == NULL ||
+        (mirror->sha_prefixes = calloc(max_files, sizeof(uint64_t))) == NULL ||
+        (mirror->offsets = calloc(max_files * NB_RES, sizeof(uint64_t))) == NULL ||
+        (mirror->sizes = calloc(max_files * NB_RES, sizeof(uint32_t))) == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Copies the images of the metadata at index of db_file to its
+ *          mirror. Its keys are hashed again on first use.
+ *
+ *  @param  db_file :   The database
+ *  @param  index :     The index of the metadata
+ */
+static void mirror_set(struct pictdb_file* db_file, size_t index)
+{
+    struct metadata_mirror* mirror = &db_file->mirror;
+
+    if (mirror->id_hashes == NULL) {
+        return;
+    }
+
+    const struct pict_metadata* metadata = get_metadata(db_file, index);
+
+    mirror->id_hashes[index] = 0;
+    mirror->sha_prefixes[index] = 0;
+
+    for (int code = 0; code < NB_RES; code++) {
+        mirror->offsets[index * NB_RES + code] = metadata->offset[code];
+        mirror->sizes[index * NB_RES + code] = metadata->size[code];
+    }
+}
+
+/**
+ *  @brief  Allocates an empty reference table of count buckets, a power of two
+ *
+ *  @param  refs :      The table to allocate
+ *  @param  count :     The number of buckets
+ *
+ *  @return An error code
+ */
+static int refs_alloc(struct extent_refs* refs, size_t count)
+{
+    refs->offsets = calloc(count, sizeof(uint64_t));
+    refs->counts = calloc(count, sizeof(uint32_t));
+
+    if (refs->offsets == NULL || refs->counts == NULL) {
+        free(refs->offsets);
+        free(refs->counts);
+        refs->offsets = NULL;
+        refs->counts = NULL;
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    refs->mask = count - 1;
+    refs->count = 0;
+    return 0;
+}
+
+/**
+ *  @brief  Returns the first bucket of the probe sequence of offset in refs
+ *
+ *  @param  refs :      The table
+ *  @param  offset :    The offset of an image
+ *
+ *  @return The index of the bucket
+ */
+static size_t refs_home(const struct extent_refs* refs, uint64_t offset)
+{
+    // offsets are not uniformly distributed, their product by this constant is
+    return (size_t) ((offset * 0x9E3779B97F4A7C15ULL) >> 24) & refs->mask;
+}
+
+/**
+ *  @brief  Returns the bucket of offset in refs, or the empty bucket where it
+ *          belongs
+ *
+ *  @param  refs :      The table to search into
+ *  @param  offset :    The offset to look for
+ *
+ *  @return The index of the bucket
+ */
+static size_t refs_bucket(const struct extent_refs* refs, uint64_t offset)
+{
+    size_t b = refs_home(refs, offset);
+
+    while (refs->offsets[b] != 0 && refs->offsets[b] != offset) {
+        b = (b + 1) & refs->mask;
+    }
+
+    return b;
+}
+
+/**
+ *  @brief  Counts one more reference to the image at offset. If the table
+ *          cannot grow, it is dropped and the images are no longer counted
+ *          until the next open.
+ *
+ *  @param  refs :      The table to update
+ *  @param  offset :    The offset of the image
+ */
+static void refs_add(struct extent_refs* refs, uint64_t offset)
+{
+    if (refs->offsets == NULL || offset == 0) {
+        return;
+    }
+
+    // at most half full, so that probe sequences stay short
+    if (2 * (refs->count + 1) > refs->mask + 1) {
+        struct extent_refs bigger;
+
+        if (refs_alloc(&bigger, 2 * (refs->mask + 1))) {
+            free(refs->offsets);
+            free(refs->counts);
+            refs->offsets = NULL;
+            refs->counts = NULL;
+            return;
+        }
+
+        for (size_t i = 0; i <= refs->mask; i++) {
+            if (refs->offsets[i] != 0) {
+                const size_t b = refs_bucket(&bigger, refs->offsets[i]);
+                bigger.offsets[b] = refs->offsets[i];
+                bigger.counts[b] = refs->counts[i];
+            }
+        }
+
+        bigger.count = refs->count;
+        free(refs->offsets);
+        free(refs->counts);
+        *refs = bigger;
+    }
+
+    const size_t b = refs_bucket(refs, offset);
+
+    if (refs->offsets[b] == 0) {
+        refs->offsets[b] = offset;
+        refs->count++;
+    }
+
+    refs->counts[b]++;
+}
+
+/**
+ *  @brief  Counts one less reference to the image at offset
+ *
+ *  @param  refs :      The table to update
+ *  @param  offset :    The offset of the image
+ *
+ *  @return Whether no valid picture refers to the image anymore
+ */
+static int refs_remove(struct extent_refs* refs, uint64_t offset)
+{
+    if (refs->offsets == NULL || offset == 0) {
+        return 0;
+    }
+
+    const size_t mask = refs->mask;
+    size_t hole = refs_bucket(refs, offset);
+
+    if (refs->offsets[hole] == 0 || --refs->counts[hole] > 0) {
+        return 0;
+    }
+
+    // backward shift, as in table_remove
+    for (size_t b = (hole + 1) & mask; refs->offsets[b] != 0; b = (b + 1) & mask) {
+        size_t home = refs_home(refs, refs->offsets[b]);
+
+        if (((b - home) & mask) >= ((b - hole) & mask)) {
+            refs->offsets[hole] = refs->offsets[b];
+            refs->counts[hole] = refs->counts[b];
+            hole = b;
+        }
+    }
+
+    refs->offsets[hole] = 0;
+    refs->counts[hole] = 0;
+    refs->count--;
+    return 1;
+}
+
+/**
+ *  @brief  Adds an extent to the free extents of db_file, merged with its
+ *          neighbours. It is lost until the next open if the list cannot grow.
+ *
+ *  @param  db_file :   The database to update
+ *  @param  extent :    The extent to add
+ */
+static void free_extent_add(struct pictdb_file* db_file,
+                            const struct free_extent* extent)
+{
+    struct free_extents* extents = &db_file->free_extents;
+    struct free_extent* items = extents->items;
+    size_t low = 0;
+    size_t high = extents->count;
+
+    if (extent->size == 0) {
+        return;
+    }
+
+    // first extent after this one
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+
+        if (items[middle].offset < extent->offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    const int before = low > 0 &&
+                       items[low - 1].offset + items[low - 1].size == extent->offset;
+    const int after = low < extents->count &&
+                      extent->offset + extent->size == items[low].offset;
+    struct free_extent* merged = NULL;
+
+    if (before) {
+        merged = &items[low - 1];
+        merged->size += extent->size;
+
+        if (after) {
+            merged->size += items[low].size;
+            merged->logged = merged->logged > items[low].logged ?
+                             merged->logged : items[low].logged;
+            merged->epoch = merged->epoch > items[low].epoch ?
+                            merged->epoch : items[low].epoch;
+            memmove(&items[low], &items[low + 1],
+                    (extents->count - low - 1) * sizeof(struct free_extent));
+            extents->count--;
+        }
+    } else if (after) {
+        merged = &items[low];
+        merged->offset = extent->offset;
+        merged->size += extent->size;
+    } else {
+        if (extents->count == extents->capacity) {
+            const size_t capacity = extents->capacity == 0 ?
+                                    MIN_FREE_EXTENTS : 2 * extents->capacity;
+
+            if ((items = realloc(items, capacity * sizeof(struct free_extent))) == NULL) {
+                return;
+            }
+
+            extents->items = items;
+            extents->capacity = capacity;
+        }
+
+        memmove(&items[low + 1], &items[low],
+                (extents->count - low) * sizeof(struct free_extent));
+        items[low] = *extent;
+        extents->count++;
+        extents->bytes += extent->size;
+        return;
+    }
+
+    // a merged extent waits for its most recent part
+    if (extent->logged > merged->logged) {
+        merged->logged = extent->logged;
+    }
+    if (extent->epoch > merged->epoch) {
+        merged->epoch = extent->epoch;
+    }
+
+    extents->bytes += extent->size;
+}
+
+/**
+ *  @brief  Frees the extent at offset, which nothing in the database refers
+ *          to anymore
+ *
+ *  @param  db_file :   The database to update, locked exclusively
+ *  @param  offset :    The offset of the extent
+ *  @param  size :      The size of the extent
+ */
+void index_release_extent(struct pictdb_file* db_file, uint64_t offset,
+                          uint64_t size)
+{
+    struct free_extent extent;
+
+    extent.offset = offset;
+    extent.size = size;
+    // the update that releases it is logged after the current position
+    extent.logged = wal_position(db_file) + 1;
+    extent.epoch = db_file->free_extents.epoch;
+
+    free_extent_add(db_file, &extent);
+}
+
+/**
+ *  @brief  Compares two extents by offset, for qsort
+ *
+ *  @param  a :         The first extent
+ *  @param  b :         The second extent
+ *
+ *  @return A negative, zero or positive value as a is before, at or after b
+ */
+static int compare_extents(const void* a, const void* b)
+{
+    const uint64_t x = ((const struct free_extent*) a)->offset;
+    const uint64_t y = ((const struct free_extent*) b)->offset;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ *  @brief  Frees every part of the file of db_file that neither the metadata
+ *          table, the chunk directory, the stored indexes nor a valid picture
+ *          refers to
+ *
+ *  @param  db_file :   The database, with an empty list of free extents and
+ *                      its valid pictures mirrored
+ *
+ *  @return An error code
+ */
+static int build_free_extents(struct pictdb_file* db_file)
+{
+    size_t file_size = 0;
+
+    if (db_file->fpdb == NULL || get_file_size(db_file->fpdb, &file_size)) {
+        // not written yet
+        return 0;
+    }
+
+    struct free_extent* used = NULL;
+    size_t count = 0;
+
+    if ((used = calloc((size_t) db_file->header.max_files * NB_RES +
+                       db_file->chunk_count + 2,
+                       sizeof(struct free_extent))) == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    for (size_t i = 0; i < db_file->chunk_count; i++) {
+        used[count].offset = db_file->chunks[i].offset;
+        used[count].size = (uint64_t) db_file->chunks[i].files *
+                           sizeof(struct pict_metadata);
+        count++;
+    }
+
+    if (db_file->header.format == PICTDB_CHUNKED) {
+        used[count].offset = db_file->header.directory;
+        used[count].size = sizeof(struct pictdb_directory) +
+                           db_file->chunk_count * sizeof(struct pictdb_chunk);
+        count++;
+    }
+
+    if (db_file->stored.offset != 0) {
+        used[count].offset = db_file->stored.offset;
+        used[count].size = index_store_size(db_file->stored.buckets);
+        count++;
+    }
+
+    const struct metadata_mirror* mirror = &db_file->mirror;
+
+    for (size_t i = index_next_valid(db_file, 0); i < db_file->header.max_files;
+         i = index_next_valid(db_file, i + 1)) {
+        for (size_t e = i * NB_RES; e < (i + 1) * NB_RES; e++) {
+            if (mirror->offsets[e] != 0) {
+                used[count].offset = mirror->offsets[e];
+                used[count].size = mirror->sizes[e];
+                count++;
+            }
+        }
+    }
+
+    qsort(used, count, sizeof(struct free_extent), compare_extents);
+
+    struct free_extent gap;
+    uint64_t end = sizeof(struct pictdb_header);
+
+    gap.logged = 0;
+    gap.epoch = db_file->free_extents.epoch;
+
+    // shared images appear once per picture and leave no gap between them
+    for (size_t i = 0; i <= count; i++) {
+        const uint64_t start = i < count ? used[i].offset : (uint64_t) file_size;
+
+        if (start > end) {
+            gap.offset = end;
+            gap.size = start - end;
+            free_extent_add(db_file, &gap);
+        }
+
+        if (i < count && used[i].offset + used[i].size > end) {
+            end = used[i].offset + used[i].size;
+        }
+    }
+
+    free(used);
+    return 0;
+}
+
+/**
+ *  @brief  Returns the number of buckets of a pict_id or SHA table for
+ *          max_files pictures
+ *
+ *  @param  max_files : The number of pictures the table must hold
+ *
+ *  @return The number of buckets, a power of two
+ */
+size_t index_buckets(size_t max_files)
+{
+    // at most half full, so that probe sequences stay short
+    size_t count = MIN_BUCKETS;
+    while (count < 2 * max_files) {
+        count *= 2;
+    }
+
+    return count;
+}
+
+/**
+ *  @brief  Returns the hash of pict_id in the pict_id table
+ *
+ *  @param  pict_id :   The id
+ *
+ *  @return The hash value
+ */
+uint64_t index_hash_id(const char* pict_id)
+{
+    return hash_string(pict_id);
+}
+
+/**
+ *  @brief  Returns the hash of SHA in the SHA table
+ *
+ *  @param  SHA :       The SHA
+ *
+ *  @return The hash value
+ */
+uint64_t index_hash_sha(const unsigned char* SHA)
+{
+    return hash_sha(SHA);
+}
+
+/**
+ *  @brief  Builds the indexes of db_file from its metadata, reading the
+ *          pict_id and SHA tables from the file if they are stored there and
+ *          up to date. The previous indexes, if any, are freed first.
+ *
+ *  @param  db_file :   The database to index
+ *
+ *  @return An error code
+ */
+int index_build(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->metadata == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    index_free(db_file);
+
+    int ret = 0;
+    const size_t words = (db_file->header.max_files + WORD_BITS - 1) / WORD_BITS;
+
+    if ((ret = table_alloc(&db_file->id_index, db_file->header.max_files)) ||
+        (ret = table_alloc(&db_file->sha_index, db_file->header.max_files)) ||
+        (ret = mirror_alloc(&db_file->mirror, db_file->header.max_files))) {
+        index_free(db_file);
+        return ret;
+    }
+
+    if ((db_file->free_slots.bits = calloc(words, sizeof(uint64_t))) == NULL ||
+        refs_alloc(&db_file->refs, MIN_BUCKETS)) {
+        index_free(db_file);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    db_file->free_slots.first = words;
+
+    index_store_load(db_file);
+
+    // inserting every key is only needed if the stored tables can't be used
+    const int hashed = !db_file->stored.valid || index_store_read(db_file);
+
+    if (hashed) {
+        memset(db_file->id_index.buckets, 0,
+               (db_file->id_index.mask + 1) * sizeof(uint32_t));
+        memset(db_file->sha_index.buckets, 0,
+               (db_file->sha_index.mask + 1) * sizeof(uint32_t));
+        db_file->stored.valid = 0;
+    }
+
+    for (size_t i = 0; i < db_file->header.max_files; i++) {
+        if (db_file->metadata[i].is_valid != NON_EMPTY) {
+            slots_mark(&db_file->free_slots, i, 1);
+        } else {
+            mirror_set(db_file, i);
+
+            if (hashed) {
+                if (index_find(db_file, db_file->metadata[i].pict_id) ==
+                    (size_t) -1) {
+                    table_add(&db_file->id_index, db_file, i, id_hash);
+                }
+                table_add(&db_file->sha_index, db_file, i, sha_hash);
+            }
+
+            for (int code = 0; code < NB_RES; code++) {
+                refs_add(&db_file->refs, db_file->metadata[i].offset[code]);
+            }
+        }
+    }
+
+    if ((ret = build_free_extents(db_file))) {
+        index_free(db_file);
+        return ret;
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Frees the indexes of db_file and leaves them empty
+ *
+ *  @param  db_file :   The database whose indexes are freed
+ */
+void index_free(struct pictdb_file* db_file)
+{
+    if (db_file != NULL) {
+        free(db_file->id_index.buckets);
+        free(db_file->id_index.dirty);
+        db_file->id_index.buckets = NULL;
+        db_file->id_index.dirty = NULL;
+        db_file->id_index.mask = 0;
+
+        free(db_file->sha_index.buckets);
+        free(db_file->sha_index.dirty);
+        db_file->sha_index.buckets = NULL;
+        db_file->sha_index.dirty = NULL;
+        db_file->sha_index.mask = 0;
+
+        free(db_file->free_slots.bits);
+        db_file->free_slots.bits = NULL;
+        db_file->free_slots.first = 0;
+
+        free(db_file->mirror.id_hashes);
+        free(db_file->mirror.sha_prefixes);
+        free(db_file->mirror.offsets);
+        free(db_file->mirror.sizes);
+        db_file->mirror.id_hashes = NULL;
+        db_file->mirror.sha_prefixes = NULL;
+        db_file->mirror.offsets = NULL;
+        db_file->mirror.sizes = NULL;
+
+        free(db_file->refs.offsets);
+        free(db_file->refs.counts);
+        db_file->refs.offsets = NULL;
+        db_file->refs.counts = NULL;
+        db_file->refs.mask = 0;
+        db_file->refs.count = 0;
+
+        free(db_file->free_extents.items);
+        db_file->free_extents.items = NULL;
+        db_file->free_extents.count = 0;
+        db_file->free_extents.capacity = 0;
+        db_file->free_extents.bytes = 0;
+    }
+}
+
+/**
+ *  @brief  Adds the valid picture at index to the indexes of db_file
+ *
+ *  @param  db_file :   The database to update
+ *  @param  index :     The index of the picture to add
+ */
+void index_add(struct pictdb_file* db_file, size_t index)
+{
+    if (db_file != NULL) {
+        mirror_set(db_file, index);
+        table_add(&db_file->id_index, db_file, index, id_hash);
+        table_add(&db_file->sha_index, db_file, index, sha_hash);
+        slots_mark(&db_file->free_slots, index, 0);
+
+        for (int code = 0; code < NB_RES; code++) {
+            refs_add(&db_file->refs, get_metadata(db_file, index)->offset[code]);
+        }
+    }
+}
+
+/**
+ *  @brief  Sets the image of resolution code of the picture at index. If the
+ *          picture is valid, its reference moves from the previous image to
+ *          the new one, and the previous image becomes a free extent if no
+ *          other valid picture refers to it.
+ *
+ *  @param  db_file :   The database to update
+ *  @param  index :     The index of the picture
+ *  @param  code :      The resolution of the image
+ *  @param  offset :    The offset of the new image, 0 if there is none
+ *  @param  size :      The size of the new image
+ */
+void index_set_image(struct pictdb_file* db_file, size_t index, int code,
+                     uint64_t offset, uint32_t size)
+{
+    if (db_file == NULL) {
+        return;
+    }
+
+    struct pict_metadata* metadata = get_metadata(db_file, index);
+    const uint64_t old_offset = metadata->offset[code];
+    const uint32_t old_size = metadata->size[code];
+
+    metadata->offset[code] = offset;
+    metadata->size[code] = size;
+
+    if (db_file->mirror.offsets != NULL) {
+        db_file->mirror.offsets[index * NB_RES + code] = offset;
+        db_file->mirror.sizes[index * NB_RES + code] = size;
+    }
+
+    if (metadata->is_valid == NON_EMPTY) {
+        refs_add(&db_file->refs, offset);
+
+        if (refs_remove(&db_file->refs, old_offset)) {
+            index_release_extent(db_file, old_offset, old_size);
+        }
+    }
+}
+
+/**
+ *  @brief  Removes the picture at index from the indexes of db_file. Its
+ *          images that no other valid picture refers to become free extents.
+ *          Must be called while its metadata still holds the indexed values.
+ *          A paged database has its stored tables updated instead.
+ *
+ *  @param  db_file :   The database to update
+ *  @param  index :     The index of the picture to remove
+ */
+void index_remove(struct pictdb_file* db_file, size_t index)
+{
+    if (db_file != NULL) {
+        table_remove(&db_file->id_index, db_file, index, id_hash);
+        table_remove(&db_file->sha_index, db_file, index, sha_hash);
+        slots_mark(&db_file->free_slots, index, 1);
+
+        // a paged database has no table in memory to store
+        if (db_file->pager != NULL) {
+            index_store_remove(db_file, index);
+        }
+
+        const struct pict_metadata* metadata = get_metadata(db_file, index);
+
+        for (int code = 0; code < NB_RES; code++) {
+            if (refs_remove(&db_file->refs, metadata->offset[code])) {
+                index_release_extent(db_file, metadata->offset[code],
+                                     metadata->size[code]);
+            }
+        }
+    }
+}
+
+/**
+ *  @brief  Looks pict_id up in the pict_id index of db_file
+ *
+ *  @param  db_file :   The database to search into
+ *  @param  pict_id :   The id to look for
+ *
+ *  @return The index of the picture, -1 if it wasn't found or if the index
+ *          has not been built
+ */
+size_t index_find(const struct pictdb_file* db_file, const char* pict_id)
+{
+    if (db_file == NULL || pict_id == NULL ||
+        db_file->id_index.buckets == NULL) {
+        return -1;
+    }
+
+    const struct pict_index* table = &db_file->id_index;
+    const uint64_t hash = hash_string(pict_id);
+
+    for (size_t b = hash & table->mask;
+         table->buckets[b] != 0; b = (b + 1) & table->mask) {
+        const size_t i = table->buckets[b] - 1;
+
+        if (id_hash(db_file, i) == hash &&
+            db_file->metadata[i].is_valid == NON_EMPTY &&
+            !strcmp(db_file->metadata[i].pict_id, pict_id)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ *  @brief  Looks SHA up in the content index of db_file
+ *
+ *  @param  db_file :   The database to search into
+ *  @param  SHA :       The SHA to look for
+ *  @param  exclude :   An index to skip, typically the picture being compared
+ *
+ *  @return The index of a valid picture with that SHA, -1 if there is none or
+ *          if the index has not been built
+ */
+size_t index_find_sha(const struct pictdb_file* db_file,
+                      const unsigned char* SHA, size_t exclude)
+{
+    if (db_file == NULL || SHA == NULL ||
+        db_file->sha_index.buckets == NULL) {
+        return -1;
+    }
+
+    const struct pict_index* table = &db_file->sha_index;
+    const uint64_t prefix = hash_sha(SHA);
+
+    for (size_t b = prefix & table->mask;
+         table->buckets[b] != 0; b = (b + 1) & table->mask) {
+        const size_t i = table->buckets[b] - 1;
+
+        if (i != exclude && sha_hash(db_file, i) == prefix &&
+            db_file->metadata[i].is_valid == NON_EMPTY &&
+            !compare_sha(db_file->metadata[i].SHA, SHA)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ *  @brief  Moves the reader epoch of db_file on, as far as the pinned
+ *          locations allow
+ *
+ *  @param  extents :   The free extents of the database
+ */
+static void advance_epoch(struct free_extents* extents)
+{
+    // moving to e + 1 needs the readers of e - 1, of the same parity, gone
+    for (int k = 0; k < 2 &&
+         __atomic_load_n(&extents->pins[(extents->epoch + 1) & 1],
+                         __ATOMIC_ACQUIRE) == 0; k++) {
+        extents->epoch++;
+    }
+}
+
+/**
+ *  @brief  Takes the best fitting free extent of db_file for an image of size
+ *          bytes, or the start of it. Extents that may still be read through
+ *          a location, or whose release is not durable yet, are skipped, and
+ *          none is reused while a garbage collection is running.
+ *
+ *  @param  db_file :   The database, locked exclusively
+ *  @param  size :      The size of the image
+ *
+ *  @return The offset of the extent, 0 if none fits
+ */
+uint64_t index_alloc_extent(struct pictdb_file* db_file, uint64_t size)
+{
+    if (db_file == NULL || size == 0) {
+        return 0;
+    }
+
+    struct free_extents* extents = &db_file->free_extents;
+
+    // the offsets copied by a garbage collection must keep their images
+    if (extents->count == 0 || extents->frozen > 0) {
+        return 0;
+    }
+
+    advance_epoch(extents);
+
+    const uint64_t durable = wal_durable(db_file);
+    size_t best = (size_t) -1;
+
+    for (size_t i = 0; i < extents->count; i++) {
+        const struct free_extent* extent = &extents->items[i];
+
+        if (extent->size >= size && extent->logged <= durable &&
+            extents->epoch - extent->epoch >= 2 &&
+            (best == (size_t) -1 || extent->size < extents->items[best].size)) {
+            best = i;
+
+            if (extent->size == size) {
+                break;
+            }
+        }
+    }
+
+    if (best == (size_t) -1) {
+        return 0;
+    }
+
+    struct free_extent* extent = &extents->items[best];
+    const uint64_t offset = extent->offset;
+
+    extent->offset += size;
+    extent->size -= size;
+    extents->bytes -= size;
+
+    if (extent->size == 0) {
+        memmove(extent, extent + 1,
+                (extents->count - best - 1) * sizeof(struct free_extent));
+        extents->count--;
+    }
+
+    return offset;
+}
+
+/**
+ *  @brief  Pins the current reader epoch of db_file, so that the images it
+ *          refers to now are not overwritten until index_unpin. db_file must
+ *          be locked.
+ *
+ *  @param  db_file :   The database
+ *
+ *  @return The pinned epoch
+ */
+uint32_t index_pin(struct pictdb_file* db_file)
+{
+    // the epoch only moves with the lock held exclusively
+    const uint32_t epoch = db_file->free_extents.epoch;
+
+    __atomic_add_fetch(&db_file->free_extents.pins[epoch & 1], 1, __ATOMIC_ACQ_REL);
+    return epoch;
+}
+
+/**
+ *  @brief  Releases an epoch pinned by index_pin. Doesn't need the lock.
+ *
+ *  @param  db_file :   The database
+ *  @param  epoch :     The pinned epoch
+ */
+void index_unpin(struct pictdb_file* db_file, uint32_t epoch)
+{
+    __atomic_sub_fetch(&db_file->free_extents.pins[epoch & 1], 1, __ATOMIC_ACQ_REL);
+}
+
+/**
+ *  @brief  Returns the first empty index according to the free slot bitmap of
+ *          db_file
+ *
+ *  @param  db_file :   The database to search into
+ *
+ *  @return The first empty index, -1 if the database is full or if the
+ *          bitmap has not been built
+ */
+size_t index_free_slot(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->free_slots.bits == NULL) {
+        return -1;
+    }
+
+    struct free_slots* slots = &db_file->free_slots;
+    const size_t words = (db_file->header.max_files + WORD_BITS - 1) / WORD_BITS;
+
+    for (; slots->first < words; slots->first++) {
+        if (slots->bits[slots->first] != 0) {
+            return slots->first * WORD_BITS +
+                   __builtin_ctzll(slots->bits[slots->first]);
+        }
+    }
+
+    return -1;
+}
+
+/**
+ *  @brief  Returns the first valid index of db_file from from on. The free
+ *          slot bitmap is scanned if it has been built (see scan.h), the
+ *          metadata otherwise.
+ *
+ *  @param  db_file :   The database to search into
+ *  @param  from :      The first index to test
+ *
+ *  @return The index of the picture, max_files if there is none
+ */
+size_t index_next_valid(struct pictdb_file* db_file, size_t from)
+{
+    const size_t max_files = db_file->header.max_files;
+    const uint64_t* bits = db_file->free_slots.bits;
+
+    if (bits == NULL) {
+        while (from < max_files &&
+               get_metadata(db_file, from)->is_valid != NON_EMPTY) {
+            from++;
+        }
+
+        return from < max_files ? from : max_files;
+    }
+
+    return scan_next_valid(bits, from, max_files);
+}
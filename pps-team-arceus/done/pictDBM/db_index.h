@@ -0,0 +1,194 @@
+/**
+ * @file db_index.h
+ * @brief in-memory indexes over the metadata of a pictDB
+ *
+ * @date 17 Oct 2026
+ */
+
+#ifndef PICTDBPRJ_DB_INDEX_H
+#define PICTDBPRJ_DB_INDEX_H
+
+#include "pictDB.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define INDEX_BLOCK 1024	// buckets stored again at once, see index_store.h
+
+/**
+ *  @brief  Returns the number of buckets of a pict_id or SHA table for
+ *          max_files pictures
+ *
+ *  @param  max_files : The number of pictures the table must hold
+ *
+ *  @return The number of buckets, a power of two
+ */
+size_t index_buckets(size_t max_files);
+
+/**
+ *  @brief  Returns the hash of pict_id in the pict_id table
+ *
+ *  @param  pict_id :   The id
+ *
+ *  @return The hash value
+ */
+uint64_t index_hash_id(const char* pict_id);
+
+/**
+ *  @brief  Returns the hash of SHA in the SHA table
+ *
+ *  @param  SHA :       The SHA
+ *
+ *  @return The hash value
+ */
+uint64_t index_hash_sha(const unsigned char* SHA);
+
+/**
+ *  @brief  Builds the indexes of db_file from its metadata, reading the
+ *          pict_id and SHA tables from the file if they are stored there and
+ *          up to date. The previous indexes, if any, are freed first.
+ *
+ *  @param  db_file :   The database to index
+ *
+ *  @return An error code
+ */
+int index_build(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Frees the indexes of db_file and leaves them empty
+ *
+ *  @param  db_file :   The database whose indexes are freed
+ */
+void index_free(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Adds the valid picture at index to the indexes of db_file
+ *
+ *  @param  db_file :   The database to update
+ *  @param  index :     The index of the picture to add
+ */
+void index_add(struct pictdb_file* db_file, size_t index);
+
+/**
+ *  @brief  Sets the image of resolution code of the picture at index. If the
+ *          picture is valid, its reference moves from the previous image to
+ *          the new one, and the previous image becomes a free extent if no
+ *          other valid picture refers to it.
+ *
+ *  @param  db_file :   The database to update
+ *  @param  index :     The index of the picture
+ *  @param  code :      The resolution of the image
+ *  @param  offset :    The offset of the new image, 0 if there is none
+ *  @param  size :      The size of the new image
+ */
+void index_set_image(struct pictdb_file* db_file, size_t index, int code,
+                     uint64_t offset, uint32_t size);
+
+/**
+ *  @brief  Removes the picture at index from the indexes of db_file. Its
+ *          images that no other valid picture refers to become free extents.
+ *          Must be called while its metadata still holds the indexed values.
+ *          A paged database has its stored tables updated instead.
+ *
+ *  @param  db_file :   The database to update
+ *  @param  index :     The index of the picture to remove
+ */
+void index_remove(struct pictdb_file* db_file, size_t index);
+
+/**
+ *  @brief  Looks pict_id up in the pict_id index of db_file
+ *
+ *  @param  db_file :   The database to search into
+ *  @param  pict_id :   The id to look for
+ *
+ *  @return The index of the picture, -1 if it wasn't found or if the index
+ *          has not been built
+ */
+size_t index_find(const struct pictdb_file* db_file, const char* pict_id);
+
+/**
+ *  @brief  Looks SHA up in the content index of db_file
+ *
+ *  @param  db_file :   The database to search into
+ *  @param  SHA :       The SHA to look for
+ *  @param  exclude :   An index to skip, typically the picture being compared
+ *
+ *  @return The index of a valid picture with that SHA, -1 if there is none or
+ *          if the index has not been built
+ */
+size_t index_find_sha(const struct pictdb_file* db_file,
+                      const unsigned char* SHA, size_t exclude);
+
+/**
+ *  @brief  Frees the extent at offset, which nothing in the database refers
+ *          to anymore
+ *
+ *  @param  db_file :   The database to update, locked exclusively
+ *  @param  offset :    The offset of the extent
+ *  @param  size :      The size of the extent
+ */
+void index_release_extent(struct pictdb_file* db_file, uint64_t offset,
+                          uint64_t size);
+
+/**
+ *  @brief  Takes the best fitting free extent of db_file for an image of size
+ *          bytes, or the start of it. Extents that may still be read through
+ *          a location, or whose release is not durable yet, are skipped, and
+ *          none is reused while a garbage collection is running.
+ *
+ *  @param  db_file :   The database, locked exclusively
+ *  @param  size :      The size of the image
+ *
+ *  @return The offset of the extent, 0 if none fits
+ */
+uint64_t index_alloc_extent(struct pictdb_file* db_file, uint64_t size);
+
+/**
+ *  @brief  Pins the current reader epoch of db_file, so that the images it
+ *          refers to now are not overwritten until index_unpin. db_file must
+ *          be locked.
+ *
+ *  @param  db_file :   The database
+ *
+ *  @return The pinned epoch
+ */
+uint32_t index_pin(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Releases an epoch pinned by index_pin. Doesn't need the lock.
+ *
+ *  @param  db_file :   The database
+ *  @param  epoch :     The pinned epoch
+ */
+void index_unpin(struct pictdb_file* db_file, uint32_t epoch);
+
+/**
+ *  @brief  Returns the first empty index according to the free slot bitmap of
+ *          db_file
+ *
+ *  @param  db_file :   The database to search into
+ *
+ *  @return The first empty index, -1 if the database is full or if the
+ *          bitmap has not been built
+ */
+size_t index_free_slot(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Returns the first valid index of db_file from from on. The free
+ *          slot bitmap is scanned if it has been built (see scan.h), the
+ *          metadata otherwise.
+ *
+ *  @param  db_file :   The database to search into
+ *  @param  from :      The first index to test
+ *
+ *  @return The index of the picture, max_files if there is none
+ */
+size_t index_next_valid(struct pictdb_file* db_file, size_t from);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -5,15 +5,16 @@
  */
 
 #include "pictDB.h"
+#include "db_index.h"
 #include "dedup.h"
 #include "image_content.h"
+#include "wal.h"
 
 #include <openssl/sha.h>
 
 /**
- *  @brief	Inserts an image contained in tab, of size size, with name pict_id
- *			into the first free index of db_file. Deduplicates eventual
- *			identical pictures in the process.
+ *  @brief	Inserts the image into the first free index of db_file, which must
+ *			be locked exclusively
  *
  *	@param	tab :		An array of bytes that contains the image to insert
  *	@param	size :		The size of the image to insert
@@ -22,62 +23,92 @@
  *
  *	@return An error code
  */
-int do_insert(const char* tab, size_t size, char* pict_id,
-              struct pictdb_file* db_file)
+static int insert(const char* tab, size_t size, char* pict_id,
+                  struct pictdb_file* db_file)
 {
-    if (db_file == NULL) {
-        return ERR_INVALID_ARGUMENT;
+    if (db_file->header.num_files >= db_file->header.max_files) {
+        return ERR_FULL_DATABASE;
     }
 
-    if (db_file->header.num_files >= db_file->header.max_files) {
+    size_t i = 0;
+
+    if ((i = find_free_slot(db_file)) == (size_t) -1) {
         return ERR_FULL_DATABASE;
     }
 
-    for (size_t i = 0; i < db_file->header.max_files; i++) {
-        if (db_file->metadata[i].is_valid == EMPTY) {
-            SHA256((unsigned char*) tab, size, db_file->metadata[i].SHA);
-            strncpy(db_file->metadata[i].pict_id, pict_id, MAX_PIC_ID + 1);
-            db_file->metadata[i].size[RES_ORIG] = (uint32_t) size;
+    struct pict_metadata* metadata = get_metadata(db_file, i);
+
+    // the slot may still hold the images of a deleted picture
+    memset(metadata->offset, 0, sizeof(metadata->offset));
+    memset(metadata->size, 0, sizeof(metadata->size));
 
-            int ret = 0;
+    SHA256((unsigned char*) tab, size, metadata->SHA);
+    strncpy(metadata->pict_id, pict_id, MAX_PIC_ID + 1);
+    metadata->size[RES_ORIG] = (uint32_t) size;
 
-            if ((ret = do_name_and_content_dedup(db_file, i))) {
-                return ret;
-            }
+    int ret = 0;
 
-            if (db_file->metadata[i].offset[RES_ORIG] == 0) {
-                uint32_t height = 0;
-                uint32_t width = 0;
+    if ((ret = do_name_and_content_dedup(db_file, i))) {
+        return ret;
+    }
 
-                if ((ret = get_resolution(&height, &width, tab, size))) {
-                    return ret;
-                }
+    if (metadata->offset[RES_ORIG] == 0) {
+        uint32_t height = 0;
+        uint32_t width = 0;
+
+        if ((ret = get_resolution(&height, &width, tab, size))) {
+            return ret;
+        }
 
-                db_file->metadata[i].res_orig[0] = width;
-                db_file->metadata[i].res_orig[1] = height;
+        metadata->res_orig[0] = width;
+        metadata->res_orig[1] = height;
 
-                if ((ret = write_disk_image(db_file->fpdb, tab, size,
-                                            &(db_file->metadata[i].offset[RES_ORIG])))) {
-                    return ret;
-                }
+        if ((ret = store_image(db_file, tab, size,
+                               &(metadata->offset[RES_ORIG])))) {
+            return ret;
+        }
 
-                db_file->metadata[i].offset[RES_SMALL] = 0;
-                db_file->metadata[i].offset[RES_THUMB] = 0;
+        metadata->offset[RES_SMALL] = 0;
+        metadata->offset[RES_THUMB] = 0;
 
-                db_file->metadata[i].size[RES_SMALL] = 0;
-                db_file->metadata[i].size[RES_THUMB] = 0;
-            }
+        metadata->size[RES_SMALL] = 0;
+        metadata->size[RES_THUMB] = 0;
+    }
 
-            db_file->metadata[i].is_valid = NON_EMPTY;
+    metadata->is_valid = NON_EMPTY;
+    index_add(db_file, i);
 
-            if ((ret = write_header(db_file, db_file->fpdb, 1, 1)) ||
-                (ret = write_metadata(db_file, db_file->fpdb, i))) {
-                return ret;
-            }
+    mark_header(db_file, 1, 1);
+    return mark_metadata(db_file, i);
+}
 
-            return 0;
-        }
+/**
+ *  @brief	Inserts an image contained in tab, of size size, with name pict_id
+ *			into the first free index of db_file. Deduplicates eventual
+ *			identical pictures in the process.
+ *
+ *	@param	tab :		An array of bytes that contains the image to insert
+ *	@param	size :		The size of the image to insert
+ *	@param	pict_id :	The id to give to the picture
+ *	@param	db_file :	The file to add the picture to
+ *
+ *	@return An error code
+ */
+int do_insert(const char* tab, size_t size, char* pict_id,
+              struct pictdb_file* db_file)
+{
+    if (db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    pthread_rwlock_wrlock(&db_file->lock);
+    int ret = insert(tab, size, pict_id, db_file);
+    const int err = flush_dirty(db_file);
+    pthread_rwlock_unlock(&db_file->lock);
+
+    if ((ret = ret ? ret : err)) {
+        return ret;
     }
 
-    return ERR_IO;
+    return wal_commit(db_file);
 }
@@ -12,13 +12,13 @@
  */
 
 #include "pictDB.h"
+#include "db_index.h"
 #include <json-c/json.h>
 
 #define ERROR_MSG_SIZE 64
 
 /**
- *  @brief  Prints the database to stdout if list = STDOUT, or returns a message
- *          containing the header and metadata in JSON format if list = JSON
+ *  @brief  Lists db_file, which must be locked, as described in do_list
  *
  *  @param  db_file :       The database to print
  *  @param  do_list_mode :  The output mode
@@ -26,7 +26,8 @@
  *  @return NULL if list = STDOUT, the JSON message if list = JSON, or an error
  *          message if something goes wrong
  */
-char* do_list(const struct pictdb_file* db_file, enum do_list_mode list)
+static char* list_locked(struct pictdb_file* db_file,
+                         enum do_list_mode list)
 {
     if (list == STDOUT) {
         if (db_file == NULL) {
@@ -39,20 +40,21 @@ char* do_list(const struct pictdb_file* db_file, enum do_list_mode list)
 
         if (db_file->header.num_files == 0) {
             printf("<< empty database >>\n");
-        } else for (size_t i = 0; i < db_file->header.max_files; i++) {
-                if (db_file->metadata[i].is_valid == NON_EMPTY) {
-                    print_metadata(&(db_file->metadata[i]));
-                }
+        } else for (size_t i = index_next_valid(db_file, 0);
+                        i < db_file->header.max_files;
+                        i = index_next_valid(db_file, i + 1)) {
+                print_metadata(get_metadata(db_file, i));
             }
         return NULL;
     } else if (list == JSON) {
         struct json_object* temp = json_object_new_array();
         struct json_object* result = json_object_new_object();
 
-        for (size_t i = 0; i < db_file->header.max_files; i++) {
-            if (db_file->metadata[i].is_valid == NON_EMPTY) {
-                json_object_array_add(temp, json_object_new_string(db_file->metadata[i].pict_id));
-            }
+        // only the valid pictures are read
+        for (size_t i = index_next_valid(db_file, 0); i < db_file->header.max_files;
+             i = index_next_valid(db_file, i + 1)) {
+            json_object_array_add(temp, json_object_new_string(
+                                      get_metadata(db_file, i)->pict_id));
         }
 
         if (temp == NULL) {
@@ -82,3 +84,29 @@ char* do_list(const struct pictdb_file* db_file, enum do_list_mode list)
     }
     return NULL;
 }
+
+/**
+ *  @brief  Prints the database to stdout if list = STDOUT, or returns a message
+ *          containing the header and metadata in JSON format if list = JSON
+ *
+ *  @param  db_file :       The database to print
+ *  @param  do_list_mode :  The output mode
+ *
+ *  @return NULL if list = STDOUT, the JSON message if list = JSON, or an error
+ *          message if something goes wrong
+ */
+char* do_list(const struct pictdb_file* db_file, enum do_list_mode list)
+{
+    // the lock and the resident pages are not part of the listed state
+    struct pictdb_file* file = (struct pictdb_file*) db_file;
+
+    if (file == NULL) {
+        return list_locked(file, list);
+    }
+
+    pthread_rwlock_rdlock(&file->lock);
+    char* message = list_locked(file, list);
+    pthread_rwlock_unlock(&file->lock);
+
+    return message;
+}
@@ -6,9 +6,417 @@
  */
 
 #include "pictDB.h"
+#include "db_index.h"
 #include "dedup.h"
 #include "image_content.h"
 
+#include <unistd.h> // for dup, close
+
+/**
+ *  @brief  Creates the missing resolutions of the image at index and
+ *			repercutes the changes to eventual copies of the image. db_file
+ *			must be locked exclusively.
+ *
+ *  @param  db_file :  	The file where the image is
+ *  @param  index :    	The index of the picture
+ *
+ *  @return An error code
+ */
+static int create_resolutions(struct pictdb_file* db_file, size_t index)
+{
+    int ret = 0;
+
+    if (!(ret = lazily_resize_all(RES_MASK(RES_THUMB) | RES_MASK(RES_SMALL),
+                                  db_file, index))) {
+        ret = do_name_and_content_dedup(db_file, index); //Avoid to resize every image
+    }
+
+    const int err = flush_dirty(db_file);
+    return ret ? ret : err;
+}
+
+/**
+ *  @brief  Stores the resized images of the picture of id id, unless it was
+ *			replaced or its resolutions were created in the meantime, and
+ *			repercutes the changes to eventual copies of the image
+ *
+ *  @param  id :		The id of the picture
+ *  @param  SHA :		The SHA of the picture that was resized
+ *  @param  resized :	The resized images, NULL for the resolutions to skip
+ *  @param  sizes :		The sizes of the resized images
+ *  @param  db_file :  	The file where the picture is
+ *
+ *  @return An error code
+ */
+static int store_resolutions(const char* id, const unsigned char* SHA,
+                             char* const* resized, const size_t* sizes,
+                             struct pictdb_file* db_file)
+{
+    size_t i = 0;
+    int ret = 0;
+    int stored = 0;
+
+    pthread_rwlock_wrlock(&db_file->lock);
+
+    if ((i = find_index(db_file, id)) == -1) {
+        ret = ERR_FILE_NOT_FOUND;
+    } else if (!compare_sha(get_metadata(db_file, i)->SHA, SHA)) {
+        for (int code = 0; !ret && code < RES_ORIG; code++) {
+            if (resized[code] != NULL && get_metadata(db_file, i)->offset[code] == 0) {
+                ret = store_resized(code, db_file, i, resized[code], sizes[code]);
+                stored = 1;
+            }
+        }
+
+        if (!ret && stored && !(ret = mark_metadata(db_file, i))) {
+            ret = do_name_and_content_dedup(db_file, i);
+        }
+
+        const int err = flush_dirty(db_file);
+        ret = ret ? ret : err;
+    }
+
+    pthread_rwlock_unlock(&db_file->lock);
+    return ret;
+}
+
+/**
+ *  @brief  Reads the original of the picture of id id, locating it again if
+ *			a garbage collection replaced the database file in between. The
+ *			reader epoch stays pinned for the whole read, so the image cannot
+ *			be freed and overwritten meanwhile, and the lock is not held.
+ *
+ *  @param  id :		The id of the picture
+ *  @param  location :	The location of the original, set
+ *  @param  image :		Set to the original, to be freed by the caller
+ *  @param  db_file :  	The file where the picture is
+ *
+ *  @return An error code
+ */
+static int read_original(const char* id, struct pict_location* location,
+                         char** image, struct pictdb_file* db_file)
+{
+    FILE* file = NULL;
+    int fd = -1;
+    int ret = 0;
+
+    do {
+        if ((ret = do_locate(id, RES_ORIG, location, db_file))) {
+            return ret;
+        }
+
+        if (!(ret = do_open_location(location, &fd, db_file))) {
+            if ((file = fdopen(fd, "rb")) == NULL) {
+                close(fd);
+                ret = ERR_IO;
+            } else {
+                if ((*image = calloc(location->size, sizeof(char))) == NULL) {
+                    ret = ERR_OUT_OF_MEMORY;
+                } else if ((ret = read_disk_image(file, image, location->size,
+                                                  location->offset))) {
+                    free(*image);
+                    *image = NULL;
+                }
+
+                fclose(file);
+            }
+        }
+
+        do_release_location(location, db_file);
+    } while (ret == ERR_MOVED);
+
+    return ret;
+}
+
+/**
+ *  @brief  Creates the missing thumbnail and small resolutions of the picture
+ *			of id id. The picture is decoded once and resized without holding
+ *			the lock of db_file, so readers are not blocked in the meantime.
+ *
+ *  @param  id :		The id of the picture
+ *  @param  db_file :  	The file where the picture is
+ *
+ *  @return An error code
+ */
+int do_prepare_resolutions(const char* id, struct pictdb_file* db_file)
+{
+    if (db_file == NULL) {
+        return ERR_IO;
+    }
+
+    if (id == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct pict_metadata metadata;
+    struct pict_location location;
+    struct pictdb_header header;
+    char* resized[RES_ORIG] = {NULL};
+    size_t sizes[RES_ORIG] = {0};
+    unsigned int codes = 0;
+    char* image = NULL;
+    int ret = 0;
+
+    if ((ret = do_stat(id, &metadata, db_file))) {
+        return ret;
+    }
+
+    for (int code = 0; code < RES_ORIG; code++) {
+        if (metadata.offset[code] == 0) {
+            codes |= RES_MASK(code);
+        }
+    }
+
+    if (codes == 0) {
+        return 0;
+    }
+
+    // a garbage collection may move the original and replace the header
+    pthread_rwlock_rdlock(&db_file->lock);
+    header = db_file->header;
+    pthread_rwlock_unlock(&db_file->lock);
+
+    if (!(ret = read_original(id, &location, &image, db_file))) {
+        ret = resize_images(image, location.size, &header, codes, resized,
+                            sizes);
+    }
+
+    free(image);
+
+    // store_resolutions drops them if the picture was replaced since
+    if (!ret) {
+        ret = store_resolutions(id, location.SHA, resized, sizes, db_file);
+    }
+
+    for (int code = 0; code < RES_ORIG; code++) {
+        g_free(resized[code]);
+    }
+
+    return ret;
+}
+
+/**
+ *  @brief  Locks db_file and finds the picture of id id, creating it in the
+ *			resolution code if needed. The lock is taken shared; a missing
+ *			resolution is created in between, by do_prepare_resolutions. Whatever
+ *			the result, db_file is still locked on return.
+ *
+ *  @param  id :		The id of the picture we want to find
+ *  @param  code :     	The code representing the resolution
+ *  @param  db_file :  	The file where the image is
+ *  @param  index :    	The index of the picture
+ *
+ *  @return An error code
+ */
+static int lock_picture(const char* id, int code, struct pictdb_file* db_file,
+                        size_t* index)
+{
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&db_file->lock);
+
+    if ((*index = find_index(db_file, id)) == -1) {
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    if (get_metadata(db_file, *index)->offset[code] != 0) {
+        return 0;
+    }
+
+    pthread_rwlock_unlock(&db_file->lock);
+    ret = do_prepare_resolutions(id, db_file);
+    pthread_rwlock_rdlock(&db_file->lock);
+
+    if (ret) {
+        return ret;
+    }
+
+    if ((*index = find_index(db_file, id)) == -1) {
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    if (get_metadata(db_file, *index)->offset[code] != 0) {
+        return 0;
+    }
+
+    // the picture was replaced in between: resize it with the lock held.
+    // The lock cannot be upgraded in place, so it is looked up again.
+    pthread_rwlock_unlock(&db_file->lock);
+    pthread_rwlock_wrlock(&db_file->lock);
+
+    if ((*index = find_index(db_file, id)) == -1) {
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    if (get_metadata(db_file, *index)->offset[code] != 0) {
+        return 0;
+    }
+
+    return create_resolutions(db_file, *index);
+}
+
+/**
+ *  @brief  Locates the image of id id and resolution code in the data section
+ *			of db_file, without reading it. If the image does not exist in the
+ *			resolution yet, creates it and repercutes the changes to eventual
+ *			copies of the image.
+ *
+ *  @param  id :		The id of the picture we want to locate
+ *  @param  code :     	The code representing the resolution
+ *  @param  location :	The location of the image in the database file
+ *  @param  db_file :  	The file where the image is
+ *
+ *  @return An error code
+ */
+int do_locate(const char* id, int code, struct pict_location* location,
+              struct pictdb_file* db_file)
+{
+    if (db_file == NULL || location == NULL) {
+        return ERR_IO;
+    }
+
+    if (id == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    if (code < 0 || code >= NB_RES) {
+        return ERR_RESOLUTIONS;
+    }
+
+    size_t i = 0;
+    int ret = 0;
+
+    if (!(ret = lock_picture(id, code, db_file, &i))) {
+        const struct pict_metadata* metadata = get_metadata(db_file, i);
+
+        location->index = i;
+        location->db_version = db_file->header.db_version;
+        location->generation = db_file->generation;
+        location->epoch = index_pin(db_file);
+        location->offset = metadata->offset[code];
+        location->size = metadata->size[code];
+        memcpy(location->SHA, metadata->SHA, SHA256_DIGEST_LENGTH);
+    }
+
+    pthread_rwlock_unlock(&db_file->lock);
+    return ret;
+}
+
+/**
+ *  @brief  Releases a location found by do_locate once its image was read.
+ *			Doesn't need the lock of db_file.
+ *
+ *  @param  location :	The location of the image
+ *  @param  db_file :  	The file where the image is
+ */
+void do_release_location(const struct pict_location* location,
+                         struct pictdb_file* db_file)
+{
+    if (db_file != NULL && location != NULL) {
+        index_unpin(db_file, location->epoch);
+    }
+}
+
+/**
+ *  @brief  Reads the image found by do_locate at location into tab, unless
+ *			the database file was replaced by a garbage collection since
+ *
+ *  @param  location :	The location of the image
+ *  @param  tab :   	A tab of location->size bytes
+ *  @param  db_file :  	The file where the image is
+ *
+ *  @return An error code, ERR_MOVED if the image must be located again
+ */
+int do_read_location(const struct pict_location* location, char* tab,
+                     struct pictdb_file* db_file)
+{
+    if (db_file == NULL || location == NULL || tab == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&db_file->lock);
+
+    if (location->generation != db_file->generation) {
+        ret = ERR_MOVED;
+    } else {
+        ret = read_disk_image(db_file->fpdb, &tab, location->size,
+                              location->offset);
+    }
+
+    pthread_rwlock_unlock(&db_file->lock);
+    return ret;
+}
+
+/**
+ *  @brief  Duplicates the descriptor of the database file, so that the image
+ *			found by do_locate at location can be read without the lock,
+ *			unless the file was replaced by a garbage collection since
+ *
+ *  @param  location :	The location of the image
+ *  @param  fd :   		The descriptor to set, to be closed by the caller
+ *  @param  db_file :  	The file where the image is
+ *
+ *  @return An error code, ERR_MOVED if the image must be located again
+ */
+int do_open_location(const struct pict_location* location, int* fd,
+                     struct pictdb_file* db_file)
+{
+    if (db_file == NULL || location == NULL || fd == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&db_file->lock);
+
+    if (location->generation != db_file->generation) {
+        ret = ERR_MOVED;
+    } else if ((*fd = dup(fileno(db_file->fpdb))) == -1) {
+        ret = ERR_IO;
+    }
+
+    pthread_rwlock_unlock(&db_file->lock);
+    return ret;
+}
+
+/**
+ *  @brief  Copies the metadata of the picture of id id in db_file, without
+ *			creating any resolution
+ *
+ *  @param  id :		The id of the picture
+ *  @param  metadata :	The copy of the metadata
+ *  @param  db_file :  	The file where the picture is
+ *
+ *  @return An error code
+ */
+int do_stat(const char* id, struct pict_metadata* metadata,
+            struct pictdb_file* db_file)
+{
+    if (db_file == NULL || metadata == NULL) {
+        return ERR_IO;
+    }
+
+    if (id == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    size_t i = 0;
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&db_file->lock);
+
+    if ((i = find_index(db_file, id)) == -1) {
+        ret = ERR_FILE_NOT_FOUND;
+    } else {
+        *metadata = *get_metadata(db_file, i);
+    }
+
+    pthread_rwlock_unlock(&db_file->lock);
+    return ret;
+}
+
 /**
  *  @brief  Reads an image of index id, resoution code and size size in db_file
  *			and puts it in tab. If the image does not exist in the resolution
@@ -34,34 +442,27 @@ int do_read(char* id, int code, char** tab, uint32_t* size,
         return ERR_INVALID_ARGUMENT;
     }
 
-    size_t i = 0, temp = 0;
-    int ret = 0;
-
-    if ((i = find_index(db_file, id)) == -1) {
-        return ERR_FILE_NOT_FOUND;
+    if (code < 0 || code >= NB_RES) {
+        return ERR_RESOLUTIONS;
     }
-    uint64_t offset = db_file->metadata[i].offset[RES_ORIG];
 
-    if (db_file->metadata[i].offset[code] == 0) {
-        if ((ret = lazily_resize(code, db_file, i)) ||
-            (ret = do_name_and_content_dedup(db_file, i))) { //Avoid to resize every image
-            return ret;
-        }
+    size_t i = 0;
+    int ret = 0;
+
+    if ((ret = lock_picture(id, code, db_file, &i))) {
+        pthread_rwlock_unlock(&db_file->lock);
+        return ret;
     }
 
-    db_file->metadata[i].offset[RES_ORIG] = offset;
-    *size = db_file->metadata[i].size[code];
-    temp = (size_t) *size;
+    *size = get_metadata(db_file, i)->size[code];
 
     if ((*tab = calloc(*size, sizeof(char))) == NULL) {
-        return ERR_OUT_OF_MEMORY;
-    }
-
-    if ((ret = read_disk_image(db_file->fpdb, tab, temp,
-                               db_file->metadata[i].offset[code]))) {
+        ret = ERR_OUT_OF_MEMORY;
+    } else if ((ret = read_disk_image(db_file->fpdb, tab, (size_t) *size,
+                                      get_metadata(db_file, i)->offset[code]))) {
         free(*tab);
-        return ret;
     }
 
-    return 0;
+    pthread_rwlock_unlock(&db_file->lock);
+    return ret;
 }
@@ -6,12 +6,20 @@
  */
 
 #include "pictDB.h"
+#include "db_index.h"
+#include "index_store.h"
+#include "pager.h"
+#include "wal.h"
 
 #include <stdint.h> // for uint8_t
 #include <stdio.h> // for sprintf
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 #include <inttypes.h> // for PRIu16 - PRIu32- PRIu64
 #include <string.h> // for strlen
+#include <sys/mman.h> // for mmap, msync
+#include <unistd.h> // for sysconf, pread, pwrite
+
+#define DIRTY_GAP 8		// clean metadata written to merge two dirty runs
 
 /**
  *  @brief  Converts a SHA to a string
@@ -89,6 +97,52 @@ void print_metadata (const struct pict_metadata* metadata)
     printf("*****************************************\n");
 }
 
+/**
+ *  @brief  Maps the header and metadata of db_file->fpdb in memory and points
+ *          db_file->metadata into the mapping. Databases opened read-only are
+ *          mapped privately, so that in-memory changes never reach the disk.
+ *
+ *  @param  db_file :   The database, with its header already read
+ *  @param  open_mode : The opening mode of db_file->fpdb
+ *
+ *  @return An error code
+ */
+static int map_metadata(struct pictdb_file* db_file, const char* open_mode)
+{
+    const int shared = strchr(open_mode, '+') != NULL;
+    size_t file_size = 0;
+    int ret = 0;
+
+    if (!shared && open_mode[0] != 'r') {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    db_file->map_size = sizeof(struct pictdb_header) +
+                        db_file->header.max_files * sizeof(struct pict_metadata);
+
+    if ((ret = get_file_size(db_file->fpdb, &file_size))) {
+        return ret;
+    }
+
+    if (file_size < db_file->map_size) {
+        return ERR_IO;
+    }
+
+    void* map = mmap(NULL, db_file->map_size, PROT_READ | PROT_WRITE,
+                     shared ? MAP_SHARED : MAP_PRIVATE,
+                     fileno(db_file->fpdb), 0);
+
+    if (map == MAP_FAILED) {
+        return ERR_IO;
+    }
+
+    db_file->map = map;
+    db_file->metadata = (struct pict_metadata*)
+                        ((char*) map + sizeof(struct pictdb_header));
+
+    return 0;
+}
+
 /**
  *  @brief  Opens and checks the database called db_filename and writes it to
  *			db_file
@@ -101,11 +155,67 @@ void print_metadata (const struct pict_metadata* metadata)
  */
 int do_open(const char* db_filename, const char* open_mode,
             struct pictdb_file* db_file)
+{
+    return do_open_ext(db_filename, open_mode, 0, db_file);
+}
+
+/**
+ *  @brief  Opens and checks the database called db_filename and writes it to
+ *			db_file, with the options given in flags
+ *
+ *  @param  db_filename :   The name of the database
+ *  @param  open_mode :     The opening mode for the database
+ *  @param  flags :         A combination of the OPEN_* flags
+ *  @param  db_file :       The memory structure with header and metadata
+ *
+ *	@return An error code
+ */
+int do_open_ext(const char* db_filename, const char* open_mode, int flags,
+                struct pictdb_file* db_file)
 {
     if (db_filename == NULL || open_mode == NULL || db_file == NULL) {
         return ERR_INVALID_ARGUMENT;
     }
 
+    db_file->fpdb = NULL;
+    db_file->metadata = NULL;
+    db_file->chunks = NULL;
+    db_file->chunk_count = 0;
+    db_file->map = NULL;
+    db_file->map_size = 0;
+    db_file->flags = flags;
+    db_file->id_index.buckets = NULL;
+    db_file->id_index.dirty = NULL;
+    db_file->sha_index.buckets = NULL;
+    db_file->sha_index.dirty = NULL;
+    db_file->stored.offset = 0;
+    db_file->stored.buckets = 0;
+    db_file->stored.stamp = 0;
+    db_file->stored.valid = 0;
+    db_file->stored.stale = 0;
+    db_file->free_slots.bits = NULL;
+    db_file->mirror.id_hashes = NULL;
+    db_file->mirror.sha_prefixes = NULL;
+    db_file->mirror.offsets = NULL;
+    db_file->mirror.sizes = NULL;
+    db_file->refs.offsets = NULL;
+    db_file->refs.counts = NULL;
+    db_file->free_extents.items = NULL;
+    db_file->free_extents.count = 0;
+    db_file->free_extents.capacity = 0;
+    db_file->free_extents.bytes = 0;
+    db_file->free_extents.epoch = 0;
+    db_file->free_extents.pins[0] = 0;
+    db_file->free_extents.pins[1] = 0;
+    db_file->free_extents.frozen = 0;
+    db_file->dirty.bits = NULL;
+    db_file->dirty.first = 0;
+    db_file->dirty.last = 0;
+    db_file->dirty.header = 0;
+    db_file->wal = NULL;
+    db_file->pager = NULL;
+    db_file->generation = 0;
+
     const char* modes[] = {"rb", "rb+", "r+b", "wb", "wb+",
                            "w+b", "ab", "ab+", "a+b"
                           };
@@ -115,6 +225,16 @@ int do_open(const char* db_filename, const char* open_mode,
         return ERR_INVALID_ARGUMENT;
     }
 
+    const int writable = open_mode[0] != 'r' || strchr(open_mode, '+') != NULL;
+
+    if ((flags & OPEN_WAL) && ((flags & OPEN_MMAP) || !writable)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    if ((flags & OPEN_PAGED) && (flags & ~OPEN_PAGED)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
     if (strlen(db_filename) > MAX_DB_NAME) {
         return ERR_INVALID_FILENAME;
     }
@@ -130,24 +250,146 @@ int do_open(const char* db_filename, const char* open_mode,
     }
 
     db_file->fpdb = temp;
+    pthread_rwlock_init(&db_file->lock, NULL);
 
     if (fread(&(db_file->header), sizeof(struct pictdb_header), 1, temp) != 1) {
         do_close(db_file);
         return ERR_IO;
     }
 
-    if ((db_file->metadata = calloc(db_file->header.max_files,
-                                    sizeof(struct pict_metadata))) == NULL) {
+    int ret = 0;
+
+    if ((db_file->header.format == PICTDB_CHUNKED &&
+         db_file->header.max_files > MAX_CHUNKED_FILES) ||
+        (ret = load_chunks(db_file))) {
         do_close(db_file);
-        return ERR_OUT_OF_MEMORY;
+        return ret ? ret : ERR_MAX_FILES;
+    }
+
+    // the chunks of a grown table are not contiguous, so they are read
+    if (db_file->chunk_count > 1) {
+        db_file->flags &= ~(OPEN_MMAP | OPEN_MMAP_SYNC);
+    }
+
+    // a log is replayed into the whole table, but not into stored indexes
+    db_file->stored.stale = wal_exists(db_filename);
+
+    if (db_file->stored.stale) {
+        db_file->flags &= ~OPEN_PAGED;
+    }
+
+    if (db_file->flags & OPEN_PAGED) {
+        if ((ret = pager_open(db_file))) {
+            do_close(db_file);
+            return ret;
+        }
+
+        index_store_load(db_file);
+        return 0;
+    } else if (db_file->flags & OPEN_MMAP) {
+        if ((ret = map_metadata(db_file, open_mode))) {
+            do_close(db_file);
+            return ret;
+        }
+    } else {
+        if ((db_file->metadata = calloc(db_file->header.max_files,
+                                        sizeof(struct pict_metadata))) == NULL) {
+            do_close(db_file);
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        for (size_t i = 0; i < db_file->chunk_count; i++) {
+            const struct pictdb_chunk* chunk = &db_file->chunks[i];
+
+            if (fseek(temp, (long) chunk->offset, SEEK_SET) ||
+                fread(&(db_file->metadata[chunk->first]),
+                      sizeof(struct pict_metadata), chunk->files,
+                      temp) != chunk->files) {
+                do_close(db_file);
+                return ERR_IO;
+            }
+        }
+    }
+
+    if ((ret = wal_recover(db_filename, writable, db_file)) ||
+        (ret = index_build(db_file))) {
+        do_close(db_file);
+        return ret;
     }
 
-    if (fread(db_file->metadata, sizeof(struct pict_metadata),
-              db_file->header.max_files, temp) != db_file->header.max_files) {
+    // best effort: without stored indexes, the next open rebuilds them
+    if (writable) {
+        index_store_sync(db_file);
+    }
+
+    if ((flags & OPEN_WAL) && (ret = wal_open(db_filename, db_file))) {
         do_close(db_file);
+        return ret;
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Makes file, a copy of the database with the same metadata table,
+ *          the file of db_file: the metadata is mapped again with OPEN_MMAP,
+ *          file is renamed from tempname to filename, the current file is
+ *          closed and the generation is incremented. If anything fails,
+ *          db_file and its name are left as they were. db_file must be
+ *          locked exclusively.
+ *
+ *  @param  db_file :   The database
+ *  @param  file :      The new file of the database
+ *  @param  tempname :  The name of file
+ *  @param  filename :  The name of the database
+ *
+ *  @return An error code
+ */
+int swap_database_file(struct pictdb_file* db_file, FILE* file,
+                       const char* tempname, const char* filename)
+{
+    if (db_file == NULL || db_file->fpdb == NULL || file == NULL ||
+        tempname == NULL || filename == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    FILE* old = db_file->fpdb;
+    void* old_map = db_file->map;
+    const size_t old_size = db_file->map_size;
+    int ret = 0;
+
+    db_file->fpdb = file;
+
+    if (old_map != NULL && (ret = map_metadata(db_file, "r+b"))) {
+        db_file->fpdb = old;
+        db_file->map = old_map;
+        db_file->map_size = old_size;
+        db_file->metadata = (struct pict_metadata*)
+                            ((char*) old_map + sizeof(struct pictdb_header));
+        return ret;
+    }
+
+    // the rename is the last step that can fail: once done, the new file is
+    // the database on disk and nothing is left to undo
+    if (rename(tempname, filename)) {
+        if (old_map != NULL) {
+            munmap(db_file->map, db_file->map_size);
+            db_file->map = old_map;
+            db_file->map_size = old_size;
+            db_file->metadata = (struct pict_metadata*)
+                                ((char*) old_map + sizeof(struct pictdb_header));
+        }
+
+        db_file->fpdb = old;
         return ERR_IO;
     }
 
+    if (old_map != NULL) {
+        munmap(old_map, old_size);
+    }
+
+    fclose(old);
+    db_file->generation++;
     return 0;
 }
 
@@ -188,15 +430,83 @@ void do_close(struct pictdb_file* db_file)
 {
     if (db_file != NULL) {
         if (db_file->fpdb != NULL) {
+            wal_close(db_file);
+            pthread_rwlock_destroy(&db_file->lock);
             fclose(db_file->fpdb);
             db_file->fpdb = NULL;
         }
 
+        if (db_file->map != NULL) {
+            munmap(db_file->map, db_file->map_size);
+            db_file->map = NULL;
+            db_file->metadata = NULL;
+        }
+
         if (db_file->metadata != NULL) {
             free(db_file->metadata);
             db_file->metadata = NULL;
         }
+
+        index_free(db_file);
+        pager_close(db_file);
+
+        free(db_file->dirty.bits);
+        db_file->dirty.bits = NULL;
+
+        free(db_file->chunks);
+        db_file->chunks = NULL;
+        db_file->chunk_count = 0;
+    }
+}
+
+/**
+ *  @brief  Returns the chunk of db_file that holds the metadata at index
+ *
+ *  @param  db_file :   The database
+ *  @param  index :     The index of the metadata
+ *
+ *  @return The index of the chunk in db_file->chunks
+ */
+static size_t chunk_of(const struct pictdb_file* db_file, size_t index)
+{
+    size_t low = 0;
+    size_t high = db_file->chunk_count - 1;
+
+    // last chunk that starts at or before index
+    while (low < high) {
+        const size_t middle = high - (high - low) / 2;
+
+        if (db_file->chunks[middle].first <= index) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    return low;
+}
+
+/**
+ *  @brief  Flushes a range of the metadata mapping of db_file to the disk if
+ *          the database was opened with OPEN_MMAP_SYNC
+ *
+ *  @param  db_file :   The mapped database
+ *  @param  start :     The offset of the range in the file
+ *  @param  length :    The length of the range
+ *
+ *  @return 0 if the flush was successful, ERR_IO otherwise
+ */
+static int sync_mapping(struct pictdb_file* db_file, size_t start, size_t length)
+{
+    if (!(db_file->flags & OPEN_MMAP_SYNC)) {
+        return 0;
     }
+
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t first = start - start % page;
+
+    return msync((char*) db_file->map + first, start + length - first, MS_SYNC)
+           ? ERR_IO : 0;
 }
 
 /**
@@ -218,16 +528,21 @@ int write_header(struct pictdb_file* db_file, FILE* file, int modif, int update)
         return ERR_INVALID_ARGUMENT;
     }
 
-    if (fseek(file, 0, SEEK_SET)) {
-        return ERR_IO;
-    }
-
     if (update) {
         db_file->header.db_version += 1;
     }
 
     db_file->header.num_files += modif;
 
+    if (db_file->map != NULL && file == db_file->fpdb) {
+        memcpy(db_file->map, &(db_file->header), sizeof(struct pictdb_header));
+        return sync_mapping(db_file, 0, sizeof(struct pictdb_header));
+    }
+
+    if (fseek(file, 0, SEEK_SET)) {
+        return ERR_IO;
+    }
+
     return !fwrite(&(db_file->header), sizeof(struct pictdb_header), 1, file);
 }
 
@@ -243,16 +558,379 @@ int write_header(struct pictdb_file* db_file, FILE* file, int modif, int update)
  */
 int write_metadata(struct pictdb_file* db_file, FILE* file, int index)
 {
-    if (db_file == NULL || file == NULL) {
+    if (index < 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    return write_metadata_range(db_file, file, (size_t) index, 1);
+}
+
+/**
+ *  @brief  Updates count consecutive image metadata starting at first in
+ *          db_file->fpdb, with a single write
+ *
+ *  @param  db_file :   The pictdb_file to edit
+ *  @param  file :      The file to write in
+ *  @param  first :     The index of the first metadata to update
+ *  @param  count :     The number of metadata to update
+ *
+ *  @return 0 if writing was successful, ERR_IO otherwise
+ */
+int write_metadata_range(struct pictdb_file* db_file, FILE* file,
+                         size_t first, size_t count)
+{
+    if (db_file == NULL || file == NULL ||
+        first + count > db_file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    if (db_file->map != NULL && file == db_file->fpdb) {
+        // the records already live in the mapping
+        return sync_mapping(db_file, metadata_offset(db_file, first),
+                            count * sizeof(struct pict_metadata));
+    }
+
+    if (db_file->pager != NULL) {
+        int ret = 0;
+
+        // a page that could not be read must not be written back
+        for (; !ret && count > 0; first++, count--) {
+            const struct pict_metadata* metadata = get_metadata(db_file, first);
+
+            if (!(ret = pager_error(db_file)) &&
+                (fseek(file, (long) metadata_offset(db_file, first), SEEK_SET) ||
+                 fwrite(metadata, sizeof(struct pict_metadata), 1, file) != 1)) {
+                ret = ERR_IO;
+            }
+        }
+
+        return ret;
+    }
+
+    // one write per chunk the range spans
+    while (count > 0) {
+        const struct pictdb_chunk* chunk = &db_file->chunks[chunk_of(db_file, first)];
+        const size_t length = chunk->first + chunk->files - first < count ?
+                              chunk->first + chunk->files - first : count;
+
+        if (fseek(file, (long) metadata_offset(db_file, first), SEEK_SET) ||
+            fwrite(&(db_file->metadata[first]), sizeof(struct pict_metadata),
+                   length, file) != length) {
+            return ERR_IO;
+        }
+
+        first += length;
+        count -= length;
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Reads the chunk directory of db_file into db_file->chunks, or
+ *          makes the table after the header its only chunk if the database
+ *          is not chunked
+ *
+ *  @param  db_file :   The database, with its header read
+ *
+ *  @return An error code
+ */
+int load_chunks(struct pictdb_file* db_file)
+{
+    if (db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const struct pictdb_header* header = &db_file->header;
+    struct pictdb_directory directory;
+    struct pictdb_chunk* chunks = NULL;
+    size_t count = 1;
+    char* buffer = (char*) &directory;
+    int ret = 0;
+
+    if (header->format != PICTDB_CHUNKED && db_file->chunks != NULL) {
+        // no allocation, so that a garbage collection cannot fail here
+        db_file->chunks[0].offset = sizeof(struct pictdb_header);
+        db_file->chunks[0].first = 0;
+        db_file->chunks[0].files = header->max_files;
+        db_file->chunk_count = 1;
+        return 0;
+    }
+
+    if (header->format == PICTDB_CHUNKED) {
+        if ((ret = read_disk_image(db_file->fpdb, &buffer, sizeof(directory),
+                                   header->directory))) {
+            return ret;
+        }
+
+        if (directory.magic != PICTDB_CHUNKED || directory.count == 0 ||
+            directory.count > header->max_files) {
+            return ERR_IO;
+        }
+
+        count = directory.count;
+    }
+
+    if ((chunks = calloc(count, sizeof(struct pictdb_chunk))) == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    if (header->format != PICTDB_CHUNKED) {
+        chunks[0].offset = sizeof(struct pictdb_header);
+        chunks[0].first = 0;
+        chunks[0].files = header->max_files;
+    } else {
+        buffer = (char*) chunks;
+
+        if ((ret = read_disk_image(db_file->fpdb, &buffer,
+                                   count * sizeof(struct pictdb_chunk),
+                                   header->directory + sizeof(directory)))) {
+            free(chunks);
+            return ret;
+        }
+
+        // the chunks cover every index once, the first one after the header
+        uint64_t next = 0;
+
+        for (size_t i = 0; !ret && i < count; i++) {
+            if (chunks[i].first != next || chunks[i].files == 0 ||
+                (i == 0 && chunks[i].offset != sizeof(struct pictdb_header))) {
+                ret = ERR_IO;
+            }
+
+            next += chunks[i].files;
+        }
+
+        if (ret || next != header->max_files) {
+            free(chunks);
+            return ERR_IO;
+        }
+    }
+
+    free(db_file->chunks);
+    db_file->chunks = chunks;
+    db_file->chunk_count = count;
+    return 0;
+}
+
+/**
+ *  @brief  Returns the offset in the file of the metadata at index
+ *
+ *  @param  db_file :   The database
+ *  @param  index :     The index of the metadata
+ *
+ *  @return The offset of the metadata
+ */
+uint64_t metadata_offset(const struct pictdb_file* db_file, size_t index)
+{
+    const struct pictdb_chunk* chunk = &db_file->chunks[chunk_of(db_file, index)];
+
+    return chunk->offset + (index - chunk->first) * sizeof(struct pict_metadata);
+}
+
+/**
+ *  @brief  Updates the header of db_file in memory like write_header does, and
+ *			marks it to be written by the next flush_dirty
+ *
+ *  @param  db_file :   The pictdb_file to edit
+ *  @param  modif :     The amount of files added (negative value if files were
+ *                      removed)
+ *  @param  update :    Determines if the version number should be incremented
+ */
+void mark_header(struct pictdb_file* db_file, int modif, int update)
+{
+    if (db_file != NULL) {
+        if (update) {
+            db_file->header.db_version += 1;
+        }
+
+        db_file->header.num_files += modif;
+        db_file->dirty.header = 1;
+    }
+}
+
+/**
+ *  @brief  Marks the metadata at index in db_file to be written by the next
+ *          flush_dirty. The metadata is written right away if the database
+ *          is paged or if there is no memory to track it.
+ *
+ *  @param  db_file :   The pictdb_file to edit
+ *  @param  index :     The index of the changed metadata
+ *
+ *  @return An error code
+ */
+int mark_metadata(struct pictdb_file* db_file, size_t index)
+{
+    if (db_file == NULL || index >= db_file->header.max_files) {
         return ERR_INVALID_ARGUMENT;
     }
 
-    if (fseek(file, sizeof(struct pictdb_header) + index *
-              sizeof(struct pict_metadata), SEEK_SET)) {
+    struct dirty_set* dirty = &db_file->dirty;
+
+    // a page may be evicted before the flush
+    if (db_file->pager != NULL) {
+        return write_metadata_range(db_file, db_file->fpdb, index, 1);
+    }
+
+    if (dirty->bits == NULL &&
+        (dirty->bits = calloc((db_file->header.max_files + WORD_BITS - 1) /
+                              WORD_BITS, sizeof(uint64_t))) == NULL) {
+        return write_metadata_range(db_file, db_file->fpdb, index, 1);
+    }
+
+    dirty->bits[index / WORD_BITS] |= (uint64_t) 1 << (index % WORD_BITS);
+
+    if (dirty->first == dirty->last) {
+        dirty->first = index;
+        dirty->last = index + 1;
+    } else if (index < dirty->first) {
+        dirty->first = index;
+    } else if (index >= dirty->last) {
+        dirty->last = index + 1;
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Writes the metadata from first to end (excluded) of db_file, and
+ *          its header too if it is dirty and first is close enough to the
+ *          start of the metadata
+ *
+ *  @param  db_file :   The pictdb_file to write
+ *  @param  first :     The index of the first metadata to write
+ *  @param  end :       The index after the last metadata to write
+ *  @param  header :    Whether the header still has to be written, cleared
+ *                      if it was
+ *
+ *  @return 0 if writing was successful, ERR_IO otherwise
+ */
+static int write_run(struct pictdb_file* db_file, size_t first, size_t end,
+                     int* header)
+{
+    // the first chunk follows the header
+    const int with_header = *header && first <= DIRTY_GAP &&
+                            end <= db_file->chunks[0].files;
+
+    if (with_header) {
+        first = 0;
+        *header = 0;
+    }
+
+    const size_t count = end - first;
+    const size_t start = with_header ? 0 : metadata_offset(db_file, first);
+    const size_t length = sizeof(struct pictdb_header) +
+                          end * sizeof(struct pict_metadata) - start;
+
+    if (db_file->map != NULL) {
+        if (with_header) {
+            memcpy(db_file->map, &(db_file->header), sizeof(struct pictdb_header));
+        }
+
+        return sync_mapping(db_file, start, length);
+    }
+
+    if (fseek(db_file->fpdb, start, SEEK_SET) ||
+        (with_header &&
+         fwrite(&(db_file->header), sizeof(struct pictdb_header), 1,
+                db_file->fpdb) != 1) ||
+        (count > 0 &&
+         fwrite(&(db_file->metadata[first]), sizeof(struct pict_metadata),
+                count, db_file->fpdb) != count)) {
         return ERR_IO;
     }
-    return !fwrite(&(db_file->metadata[index]),
-                   sizeof(struct pict_metadata), 1, file);
+
+    return 0;
+}
+
+/**
+ *  @brief  Writes the dirty header and metadata of db_file in place, in
+ *          increasing order and in as few writes as possible: dirty metadata
+ *          close to each other are written in a single run, along with the
+ *          clean ones in between, and so is the header with a run starting
+ *          near the first metadata.
+ *
+ *  @param  db_file :   The pictdb_file to write
+ *
+ *  @return 0 if writing was successful, ERR_IO otherwise
+ */
+int write_dirty(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->fpdb == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct dirty_set* dirty = &db_file->dirty;
+    int header = dirty->header;
+    size_t first = dirty->first;
+    size_t end = dirty->first;
+    size_t chunk_end = 0;
+    // the stored indexes are unstamped before anything they index changes
+    int ret = index_store_write(db_file);
+
+    for (size_t i = dirty->first; !ret && i < dirty->last; i++) {
+        if (dirty->bits[i / WORD_BITS] & ((uint64_t) 1 << (i % WORD_BITS))) {
+            // a run stays within a chunk
+            if (i - end > DIRTY_GAP || i >= chunk_end) {
+                if (end > first) {
+                    ret = write_run(db_file, first, end, &header);
+                }
+
+                const struct pictdb_chunk* chunk =
+                        &db_file->chunks[chunk_of(db_file, i)];
+                chunk_end = chunk->first + chunk->files;
+                first = i;
+            }
+
+            end = i + 1;
+        }
+    }
+
+    if (!ret && end > first) {
+        ret = write_run(db_file, first, end, &header);
+    }
+
+    if (!ret && header) {
+        ret = write_run(db_file, 0, 0, &header);
+    }
+
+    if (!ret && db_file->map == NULL && fflush(db_file->fpdb)) {
+        ret = ERR_IO;
+    }
+
+    if (!ret) {
+        index_store_stamp(db_file);
+    }
+
+    if (dirty->first != dirty->last) {
+        memset(&dirty->bits[dirty->first / WORD_BITS], 0,
+               ((dirty->last - 1) / WORD_BITS - dirty->first / WORD_BITS + 1) *
+               sizeof(uint64_t));
+    }
+
+    dirty->first = 0;
+    dirty->last = 0;
+    dirty->header = 0;
+
+    return ret;
+}
+
+/**
+ *  @brief  Commits the dirty header and metadata of db_file: appends them to
+ *          its log if it has one, writes them in place with write_dirty
+ *          otherwise
+ *
+ *  @param  db_file :   The pictdb_file to write
+ *
+ *  @return An error code
+ */
+int flush_dirty(struct pictdb_file* db_file)
+{
+    if (db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    return db_file->wal != NULL ? wal_append(db_file) : write_dirty(db_file);
 }
 
 /**
@@ -322,7 +1000,8 @@ int get_file_size(FILE* file, size_t* size)
 }
 
 /**
- *  @brief  Reads an image from file and stores it in tab.
+ *  @brief  Reads an image from file and stores it in tab. Several threads
+ *          may read from the same file concurrently.
  *
  *  @param  file :      The file to read into
  *  @param  tab :       A pointer to the array to store the image
@@ -337,20 +1016,29 @@ int read_disk_image(FILE* file, char** tab, size_t size, size_t offset)
         return ERR_INVALID_ARGUMENT;
     }
 
-    int a = 0, b = 0, c = 0;
-
-    if ((a = (file == NULL)) ||
-        (b = fseek(file, offset, SEEK_SET)) ||
-        (c = !fread(*tab, sizeof(char), size, file))) {
+    if (file == NULL) {
         return ERR_IO;
     }
 
+    // pread leaves the file position alone, so readers can share file
+    for (size_t done = 0; done < size;) {
+        ssize_t n = pread(fileno(file), *tab + done, size - done,
+                          (off_t) (offset + done));
+
+        if (n <= 0) {
+            return ERR_IO;
+        }
+
+        done += (size_t) n;
+    }
+
     return 0;
 }
 
 /**
  *  @brief  Writes an image of size size to the end of file from tab. Writes
- *          the image's offset in offset
+ *          the image's offset in offset. The image is flushed, so that it can
+ *          be read back through the file descriptor of file.
  *
  *  @param  file :      The file to write into
  *  @param  tab :       An array to read the image into
@@ -375,13 +1063,55 @@ int write_disk_image(FILE* file, const char* tab, size_t size, size_t* offset)
         return ret;
     }
 
-    if (!fwrite(tab, sizeof(char), size, file)) {
+    if (!fwrite(tab, sizeof(char), size, file) || fflush(file)) {
         return ERR_IO;
     }
 
     return 0;
 }
 
+/**
+ *  @brief  Writes an image of size size to the data section of db_file, in a
+ *          free extent if one is large enough, at the end of the file
+ *          otherwise. db_file must be locked exclusively.
+ *
+ *  @param  db_file :   The database to write into
+ *  @param  tab :       The image
+ *  @param  size :      The size of the image
+ *  @param  offset :    The offset the image was written at
+ *
+ *  @return An error code
+ */
+int store_image(struct pictdb_file* db_file, const char* tab, size_t size,
+                size_t* offset)
+{
+    if (db_file == NULL || tab == NULL || offset == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const uint64_t hole = index_alloc_extent(db_file, size);
+
+    if (hole == 0) {
+        *offset = 0;
+        return write_disk_image(db_file->fpdb, tab, size, offset);
+    }
+
+    // the stream was flushed by the last write: write around it
+    for (size_t done = 0; done < size;) {
+        ssize_t n = pwrite(fileno(db_file->fpdb), tab + done, size - done,
+                           (off_t) (hole + done));
+
+        if (n <= 0) {
+            return ERR_IO;
+        }
+
+        done += (size_t) n;
+    }
+
+    *offset = (size_t) hole;
+    return 0;
+}
+
 /**
  *  @brief  Creates a file name composed of an image name followed by a
  *			resolution name, the two split by a '_', and writes it into name.
@@ -427,6 +1157,50 @@ int create_name(char** name, char* pictID, int code)
     return 0;
 }
 
+/**
+ *  @brief  Tells whether metadata is a valid picture of id pict_id
+ *
+ *  @param  metadata :  The metadata to test
+ *  @param  pict_id :   The id to look for
+ *
+ *  @return 1 if it is, 0 otherwise
+ */
+static int match_id(const struct pict_metadata* metadata, const void* pict_id)
+{
+    return metadata->is_valid == NON_EMPTY && !strcmp(metadata->pict_id, pict_id);
+}
+
+/**
+ *  @brief  Tells whether metadata is an empty slot
+ *
+ *  @param  metadata :  The metadata to test
+ *  @param  key :       Unused
+ *
+ *  @return 1 if it is, 0 otherwise
+ */
+static int match_empty(const struct pict_metadata* metadata, const void* key)
+{
+    return metadata->is_valid == EMPTY;
+}
+
+/**
+ *  @brief  Returns the metadata at index of db_file, faulting its page in if
+ *			the database is paged. See pager_get for how long it stays valid.
+ *
+ *  @param  db_file :   The database
+ *  @param  index :     The index of the metadata, less than max_files
+ *
+ *  @return The metadata
+ */
+struct pict_metadata* get_metadata(struct pictdb_file* db_file, size_t index)
+{
+    if (db_file->pager != NULL) {
+        return pager_get(db_file, index);
+    }
+
+    return &db_file->metadata[index];
+}
+
 /**
  *  @brief  Finds the index of the valid image with id pict_id in db_file.
  *			Returns the index or -1 if the image wasn't found or the database is
@@ -443,6 +1217,22 @@ size_t find_index(struct pictdb_file* db_file, const char* pict_id)
         return -1;
     }
 
+    if (db_file->id_index.buckets != NULL) {
+        return index_find(db_file, pict_id);
+    }
+
+    if (db_file->pager != NULL) {
+        size_t index = -1;
+
+        // the stored index is only probed, then the whole table is scanned
+        if (db_file->stored.valid &&
+            !index_store_find_id(db_file, pict_id, &index)) {
+            return index;
+        }
+
+        return pager_find(db_file, match_id, pict_id, -1);
+    }
+
     for (size_t i = 0; i < db_file->header.max_files; i++) {
         if (db_file->metadata[i].is_valid == NON_EMPTY &&
             !strcmp(db_file->metadata[i].pict_id, pict_id)) {
@@ -450,4 +1240,34 @@ size_t find_index(struct pictdb_file* db_file, const char* pict_id)
         }
     }
     return -1;
-}
\ No newline at end of file
+}
+
+/**
+ *  @brief  Finds the first empty index of db_file. Returns the index or -1 if
+ *			the database is full or NULL.
+ *
+ *  @param  db_file :   The database to search into
+ *
+ *  @return The first empty index or -1 if there is none
+ */
+size_t find_free_slot(struct pictdb_file* db_file)
+{
+    if (db_file == NULL) {
+        return -1;
+    }
+
+    if (db_file->free_slots.bits != NULL) {
+        return index_free_slot(db_file);
+    }
+
+    if (db_file->pager != NULL) {
+        return pager_find(db_file, match_empty, NULL, -1);
+    }
+
+    for (size_t i = 0; i < db_file->header.max_files; i++) {
+        if (db_file->metadata[i].is_valid == EMPTY) {
+            return i;
+        }
+    }
+    return -1;
+}
@@ -6,6 +6,59 @@
  */
 
 #include "pictDB.h"
+#include "db_index.h"
+#include "index_store.h"
+#include "pager.h"
+
+/*
+ *	@brief	Tells whether metadata is a valid image of the given SHA
+ *
+ *	@param	metadata :	The metadata to test
+ *	@param	SHA :		The SHA to look for
+ *
+ *	@return 1 if it is, 0 otherwise
+ */
+static int match_sha(const struct pict_metadata* metadata, const void* SHA)
+{
+    return metadata->is_valid == NON_EMPTY && !compare_sha(metadata->SHA, SHA);
+}
+
+/*
+ *	@brief	Finds a valid image other than exclude with the given SHA, using
+ *			the content index when it has been built
+ *
+ *	@param	db_file :	The file to search into
+ *	@param	SHA :		The SHA to look for
+ *	@param	exclude :	The index to skip
+ *
+ *	@return The index of the image or -1 if there is none
+ */
+static size_t find_sha(struct pictdb_file* db_file,
+                       const unsigned char* SHA, size_t exclude)
+{
+    if (db_file->sha_index.buckets != NULL) {
+        return index_find_sha(db_file, SHA, exclude);
+    }
+
+    if (db_file->pager != NULL) {
+        size_t index = -1;
+
+        if (db_file->stored.valid &&
+            !index_store_find_sha(db_file, SHA, exclude, &index)) {
+            return index;
+        }
+
+        return pager_find(db_file, match_sha, SHA, exclude);
+    }
+
+    for (size_t i = 0; i < db_file->header.max_files; i++) {
+        if (i != exclude && match_sha(&db_file->metadata[i], SHA)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
 
 /*
  *	@brief	Deduplicates the image at index in the db_file if it appears more
@@ -19,52 +72,52 @@
 int do_name_and_content_dedup(struct pictdb_file* db_file, uint32_t index)
 {
     int ret = 0;
+    struct pict_metadata* metadata = get_metadata(db_file, index);
+    size_t i = find_index(db_file, metadata->pict_id);
+
+    if (i != (size_t) -1 && i != index) {
+        metadata->is_valid = EMPTY;
+        return ERR_DUPLICATE_ID;
+    }
+
+    if ((i = find_sha(db_file, metadata->SHA, index)) != (size_t) -1) {
+        const struct pict_metadata* other = get_metadata(db_file, i);
+        uint32_t copyTo = 0;
+        uint32_t copyFrom = 0;
 
-    for (uint32_t i = 0; i < db_file->header.max_files; i++) {
-        if (i != index && db_file->metadata[i].is_valid == NON_EMPTY) {
-            if (!strcmp(db_file->metadata[i].pict_id,
-                        db_file->metadata[index].pict_id)) {
-                db_file->metadata[index].is_valid = EMPTY;
-                return ERR_DUPLICATE_ID;
+        for (int j = 0; j < NB_RES; j++) {
+            copyTo = index;
+            copyFrom = i;
+
+            //If the other metadata is missing an image, we swap the process
+            if (other->offset[j] == 0) {
+                copyTo = i;
+                copyFrom = index;
             }
 
-            if (!compare_sha(db_file->metadata[i].SHA,
-                             db_file->metadata[index].SHA)) {
-                uint32_t copyTo = 0;
-                uint32_t copyFrom = 0;
-
-                for (size_t j = 0; j < NB_RES; j++) {
-                    copyTo = index;
-                    copyFrom = i;
-
-                    //If the other metadata is missing an image, we swap the process
-                    if (db_file->metadata[i].offset[j] == 0) {
-                        copyTo = i;
-                        copyFrom = index;
-                    }
-
-                    db_file->metadata[copyTo].offset[j] =
-                        db_file->metadata[copyFrom].offset[j];
-                    db_file->metadata[copyTo].size[j] =
-                        db_file->metadata[copyFrom].size[j];
-                }
-
-                db_file->metadata[index].res_orig[0] =
-                    db_file->metadata[i].res_orig[0];
-                db_file->metadata[index].res_orig[1] =
-                    db_file->metadata[i].res_orig[1];
-
-                if ((ret = write_header(db_file, db_file->fpdb, 0, 0)) ||
-                    (ret = write_metadata(db_file, db_file->fpdb, i)) ||
-                    (ret = write_metadata(db_file, db_file->fpdb, index))) {
-                    return ret;
-                }
-
-                return 0;
+            //A valid image keeps its own original
+            if (j == RES_ORIG && get_metadata(db_file, copyTo)->is_valid == NON_EMPTY) {
+                continue;
             }
+
+            index_set_image(db_file, copyTo, j,
+                            get_metadata(db_file, copyFrom)->offset[j],
+                            get_metadata(db_file, copyFrom)->size[j]);
+        }
+
+        metadata->res_orig[0] = other->res_orig[0];
+        metadata->res_orig[1] = other->res_orig[1];
+
+        if ((ret = mark_metadata(db_file, i))) {
+            return ret;
         }
+
+        return mark_metadata(db_file, index);
+    }
+
+    if (metadata->is_valid != NON_EMPTY) {
+        metadata->offset[RES_ORIG] = 0;
     }
-    db_file->metadata[index].offset[RES_ORIG] = 0;
 
     return 0;
 }
@@ -14,7 +14,7 @@
 
 /*
  *	@brief	Deduplicates the image at index in the db_file if it appears more
- *  		than once
+ *  		than once. db_file must be locked exclusively.
  *
  *	@param	db_file :	The file to analyse
  *	@param	index :		The index of the image to deduplicate
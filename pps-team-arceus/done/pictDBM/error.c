@@ -21,6 +21,8 @@ const char * const ERROR_MESSAGES[] = {
     "Not implemented",
     "Existing picture ID",
     "Vips error",
+    "Image moved by garbage collection",
+    "Garbage collection running",
     "Debug"
 };
 
@@ -27,6 +27,8 @@ enum error_codes {
     NOT_IMPLEMENTED,
     ERR_DUPLICATE_ID,
     ERR_VIPS,
+    ERR_MOVED,
+    ERR_GC_RUNNING,
     ERR_DEBUG
 };
 
@@ -5,6 +5,30 @@
  */
 
 #include "pictDB.h"
+#include "db_index.h"
+#include "image_content.h"
+
+// vips_thumbnail_buffer, which shrinks JPEGs while decoding them, appeared in
+// libvips 8.6. Defining SHRINK_ON_LOAD to 0 forces the full decoding, as the
+// Makefile does for resize_bench_decode.
+#ifndef SHRINK_ON_LOAD
+#if VIPS_MAJOR_VERSION > 8 || (VIPS_MAJOR_VERSION == 8 && VIPS_MINOR_VERSION >= 6)
+#define SHRINK_ON_LOAD 1
+#else
+#define SHRINK_ON_LOAD 0
+#endif
+#endif
+
+/* JPEG markers, following 0xFF */
+#define JPEG_SOF0	0xC0
+#define JPEG_DHT	0xC4
+#define JPEG_JPG	0xC8
+#define JPEG_DAC	0xCC
+#define JPEG_SOF15	0xCF
+#define JPEG_RST0	0xD0
+#define JPEG_SOI	0xD8
+#define JPEG_EOI	0xD9
+#define JPEG_SOS	0xDA
 
 // ======================================================================
 /**
@@ -32,22 +56,198 @@ shrink_value(const VipsImage* image,
 }
 
 /**
- * 	@brief 	Resizes the image from db_file at index with the code resolution
- *			(CODE FROM WEEK 2)
+ * 	@brief 	Resizes in to fit in the resolution code of header
  *
+ *	@param	in :		The image to resize
+ *	@param	out :		The resized image
+ *	@param	header :	The header holding the resolutions
  *	@param	code :		The code for the resolution we want
+ *
+ *	@return An error code
+ */
+static int shrink_image(VipsImage* in, VipsImage** out,
+                        const struct pictdb_header* header, int code)
+{
+    double ratio = shrink_value(in, header->res_resized[2 * code],
+                                header->res_resized[2 * code + 1]);
+
+#if VIPS_MAJOR_VERSION > 7 || (VIPS_MAJOR_VERSION == 7 && MINOR_VERSION > 40)
+
+    // was only introduced in libvips 7.42
+    return vips_resize(in, out, ratio, NULL) ? ERR_VIPS : 0;
+
+#else
+
+    if (ratio < 1.0) {
+        ratio = (int) (1./ratio) + 1.0;
+        return vips_shrink(in, out, ratio, ratio, NULL) ? ERR_VIPS : 0;
+    }
+
+    g_object_ref(in);
+    *out = in;
+    return 0;
+
+#endif
+}
+
+/**
+ * 	@brief 	Resizes the original image to fit in the resolution code of header.
+ *			With SHRINK_ON_LOAD, the JPEG decoder downscales in the DCT domain
+ *			and never builds the full size image. Otherwise the original is
+ *			decoded into images[RES_ORIG], once, and resized from there.
+ *			Both give the same geometry; the libvips versions that transform
+ *			an embedded colour profile to sRGB in vips_thumbnail_buffer can
+ *			still give slightly different colours.
+ *
+ *	@param	image :		The original image
+ *	@param	size :		The size of the original image
+ *	@param	images :	The NB_RES images being made
+ *	@param	header :	The header holding the resolutions
+ *	@param	code :		The code for the resolution we want
+ *
+ *	@return An error code
+ */
+static int shrink_original(const char* image, size_t size, VipsImage** images,
+                           const struct pictdb_header* header, int code)
+{
+#if SHRINK_ON_LOAD
+
+    // vips_thumbnail_buffer would turn the image by its EXIF orientation,
+    // which the original and the full decoding keep as stored
+    return vips_thumbnail_buffer((void*) image, size, &images[code],
+                                 header->res_resized[2 * code],
+                                 "height", header->res_resized[2 * code + 1],
+#if VIPS_MAJOR_VERSION > 8 || (VIPS_MAJOR_VERSION == 8 && VIPS_MINOR_VERSION >= 8)
+                                 "no_rotate", TRUE,
+#else
+                                 "auto_rotate", FALSE,
+#endif
+                                 NULL) ? ERR_VIPS : 0;
+
+#else
+
+    if (images[RES_ORIG] == NULL &&
+        vips_jpegload_buffer((void*) image, size, &images[RES_ORIG], NULL)) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    return shrink_image(images[RES_ORIG], &images[code], header, code);
+
+#endif
+}
+
+/**
+ * 	@brief 	Checks whether the resolution inner of header fits in outer
+ *
+ *	@param	header :	The header holding the resolutions
+ *	@param	inner :		The code of the smaller resolution
+ *	@param	outer :		The code of the larger resolution
+ *
+ *	@return 1 if it fits, 0 otherwise
+ */
+static int resolution_fits(const struct pictdb_header* header, int inner,
+                           int outer)
+{
+    const uint16_t* res = header->res_resized;
+
+    return res[2 * inner] <= res[2 * outer] &&
+           res[2 * inner + 1] <= res[2 * outer + 1];
+}
+
+/**
+ * 	@brief 	Resizes image to every resolution of codes, decoding it only once.
+ *			The largest resolutions are made first, and each one is made from
+ *			the smallest image already made that it fits in, or from the
+ *			original with shrink_original. Only computes the new images: the
+ *			database is not modified.
+ *
+ *	@param	image :		The original image
+ *	@param	size :		The size of the original image
+ *	@param	header :	The header holding the resolutions
+ *	@param	codes :		A RES_MASK combination of the resolutions to make
+ *	@param	resized :	The RES_ORIG resized images, to be freed with g_free,
+ *						NULL for the resolutions that are not in codes
+ *	@param	sizes :		The RES_ORIG sizes of the resized images
+ *
+ *	@return An error code
+ */
+int resize_images(const char* image, size_t size,
+                  const struct pictdb_header* header, unsigned int codes,
+                  char** resized, size_t* sizes)
+{
+    if (image == NULL || header == NULL || resized == NULL || sizes == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    if (codes & ~(RES_MASK(RES_ORIG) - 1)) {
+        return ERR_RESOLUTIONS;
+    }
+
+    VipsObject* process = VIPS_OBJECT(vips_image_new());
+    VipsImage** images = (VipsImage**) vips_object_local_array(process, NB_RES);
+    int ret = 0;
+
+    for (int code = 0; code < RES_ORIG; code++) {
+        resized[code] = NULL;
+        sizes[code] = 0;
+    }
+
+    for (int code = RES_ORIG - 1; !ret && code >= 0; code--) {
+        if (!(codes & RES_MASK(code))) {
+            continue;
+        }
+
+        int source = code + 1;
+        while (source < RES_ORIG &&
+               (images[source] == NULL || !resolution_fits(header, code, source))) {
+            source++;
+        }
+
+        if (source == RES_ORIG) {
+            ret = shrink_original(image, size, images, header, code);
+        } else {
+            ret = shrink_image(images[source], &images[code], header, code);
+        }
+
+        if (!ret && vips_jpegsave_buffer(images[code], (void**) &resized[code],
+                                         &sizes[code], NULL)) {
+            ret = ERR_OUT_OF_MEMORY;
+        }
+    }
+
+    g_object_unref(process);
+
+    if (ret) {
+        for (int code = 0; code < RES_ORIG; code++) {
+            g_free(resized[code]);
+            resized[code] = NULL;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * 	@brief 	Appends a resized image to db_file and records it as the
+ *			resolution code of the image at index. The metadata and header are
+ *			not written.
+ *
+ *	@param	code :		The code for the resolution
  *	@param	db_file :	The file to work on
  *	@param	index :		The index of the image
+ *	@param	resized :	The resized image
+ *	@param	size :		The size of the resized image
  *
  *	@return An error code
  */
-int lazily_resize(int code, struct pictdb_file* db_file, size_t index)
+int store_resized(int code, struct pictdb_file* db_file, size_t index,
+                  const char* resized, size_t size)
 {
-    if (db_file == NULL) {
+    if (db_file == NULL || resized == NULL) {
         return ERR_INVALID_ARGUMENT;
     }
 
-    if (code >= NB_RES || code < 0) {
+    if (code >= RES_ORIG || code < 0) {
         return ERR_RESOLUTIONS;
     }
 
@@ -55,79 +255,192 @@ int lazily_resize(int code, struct pictdb_file* db_file, size_t index)
         return ERR_INVALID_PICID;
     }
 
-    if (code != RES_ORIG && db_file->metadata[index].offset[code] == 0) {
-        size_t size = db_file->metadata[index].size[RES_ORIG];
-        size_t olen = 0;
-        void* buffer = NULL;
-        char* obuf = NULL;
-        int ret = 0;
+    size_t offset = 0;
+    int ret = 0;
 
-        if ((buffer = calloc(size, sizeof(char))) == NULL) {
-            return ERR_OUT_OF_MEMORY;
-        }
+    if ((ret = store_image(db_file, resized, size, &offset))) {
+        return ret;
+    }
+
+    index_set_image(db_file, index, code, offset, (uint32_t) size);
+    return 0;
+}
+
+/**
+ * 	@brief 	Creates the resolutions of codes that the image from db_file at
+ *			index is missing, with a single decoding of the original. Its
+ *			metadata is marked to be written by the next flush_dirty.
+ *
+ *	@param	codes :		A RES_MASK combination of the resolutions we want
+ *	@param	db_file :	The file to work on
+ *	@param	index :		The index of the image
+ *
+ *	@return An error code
+ */
+int lazily_resize_all(unsigned int codes, struct pictdb_file* db_file,
+                      size_t index)
+{
+    if (db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
 
-        if ((ret = read_disk_image(db_file->fpdb, (char**) &buffer,
-                                   size, db_file->metadata[index].offset[RES_ORIG]))) {
-            free(buffer);
-            return ret;
+    if (index >= db_file->header.max_files) {
+        return ERR_INVALID_PICID;
+    }
+
+    // the original always exists
+    codes &= RES_MASK(RES_ORIG) - 1;
+
+    for (int code = 0; code < RES_ORIG; code++) {
+        if (get_metadata(db_file, index)->offset[code] != 0) {
+            codes &= ~RES_MASK(code);
         }
+    }
 
-        VipsObject* process = VIPS_OBJECT(vips_image_new());
-        VipsImage** thumbs = (VipsImage**) vips_object_local_array(process, 1);
+    if (codes == 0) {
+        return 0;
+    }
+
+    size_t size = get_metadata(db_file, index)->size[RES_ORIG];
+    char* buffer = NULL;
+    char* resized[RES_ORIG];
+    size_t sizes[RES_ORIG];
+    int ret = 0;
+
+    if ((buffer = calloc(size, sizeof(char))) == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
 
-        if (vips_jpegload_buffer(buffer, size, thumbs, NULL)) {
-            g_object_unref(process);
-            free(buffer);
-            return ERR_OUT_OF_MEMORY;
+    if ((ret = read_disk_image(db_file->fpdb, &buffer, size,
+                               get_metadata(db_file, index)->offset[RES_ORIG])) ||
+        (ret = resize_images(buffer, size, &db_file->header, codes,
+                             resized, sizes))) {
+        free(buffer);
+        return ret;
+    }
+
+    free(buffer);
+
+    for (int code = 0; !ret && code < RES_ORIG; code++) {
+        if (resized[code] != NULL) {
+            ret = store_resized(code, db_file, index, resized[code], sizes[code]);
         }
+    }
 
-        double ratio = shrink_value(*thumbs,
-                                    db_file->header.res_resized[2 * code],
-                                    db_file->header.res_resized[2 * code + 1]);
+    if (!ret) {
+        ret = mark_metadata(db_file, index);
+    }
 
-#if VIPS_MAJOR_VERSION > 7 || (VIPS_MAJOR_VERSION == 7 && MINOR_VERSION > 40)
+    for (int code = 0; code < RES_ORIG; code++) {
+        g_free(resized[code]);
+    }
 
-        // was only introduced in libvips 7.42
-        vips_resize(thumbs[0], &thumbs[0], ratio, NULL);
+    return ret;
+}
 
-#else
+/**
+ * 	@brief 	Resizes the image from db_file at index with the code resolution
+ *			(CODE FROM WEEK 2)
+ *
+ *	@param	code :		The code for the resolution we want
+ *	@param	db_file :	The file to work on
+ *	@param	index :		The index of the image
+ *
+ *	@return An error code
+ */
+int lazily_resize(int code, struct pictdb_file* db_file, size_t index)
+{
+    if (db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    if (code >= NB_RES || code < 0) {
+        return ERR_RESOLUTIONS;
+    }
+
+    int ret = 0;
+
+    if ((ret = lazily_resize_all(RES_MASK(code), db_file, index))) {
+        return ret;
+    }
+
+    return flush_dirty(db_file);
+}
+
+/**
+ *  @brief	Reads the resolution of a JPEG from its start of frame segment,
+ *			without decoding the image
+ *
+ *	@param	height :		The height to write into
+ *	@param	width :			The width to write into
+ *	@param	image_buffer :	The buffer that contains the image
+ *	@param	image_size :	The size of the image
+ *
+ *	@return 0 if the resolution was found, 1 if the header could not be parsed
+ */
+static int jpeg_header_resolution(uint32_t* height, uint32_t* width,
+                                  const unsigned char* image_buffer,
+                                  size_t image_size)
+{
+    const unsigned char* p = image_buffer;
+    size_t pos = 2;
+
+    if (image_size < 4 || p[0] != 0xFF || p[1] != JPEG_SOI) {
+        return 1;
+    }
 
-        if (ratio < 1.0) {
-            ratio = (int) (1./ratio) + 1.0;
-            vips_shrink(thumbs[0], &thumbs[0], ratio, ratio, NULL);
+    while (pos + 4 <= image_size) {
+        if (p[pos] != 0xFF) {
+            return 1;
         }
 
-#endif
+        const unsigned char marker = p[pos + 1];
+        pos += 2;
 
-        if (vips_jpegsave_buffer(thumbs[0], (void**) &obuf, &olen, NULL)) {
-            g_object_unref(process);
-            free(buffer);
-            return ERR_OUT_OF_MEMORY;
+        // fill bytes and segments without a length
+        if (marker == 0xFF) {
+            pos--;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= JPEG_RST0 && marker <= JPEG_SOI)) {
+            continue;
         }
 
-        db_file->metadata[index].size[code] = olen;
+        // the image data starts before any frame header
+        if (marker == JPEG_SOS || marker == JPEG_EOI) {
+            return 1;
+        }
 
-        if ((ret = write_disk_image(db_file->fpdb, obuf, olen,
-                                    &(db_file->metadata[index].offset[code]))) ||
-            (ret = write_metadata(db_file, db_file->fpdb, index)) ||
-            (ret = write_header(db_file, db_file->fpdb, 0, 0))) {
-            g_object_unref(process);
-            g_free(obuf);
-            free(buffer);
-            return ret;
+        const size_t length = ((size_t) p[pos] << 8) | p[pos + 1];
+
+        if (length < 2 || pos + length > image_size) {
+            return 1;
         }
 
-        g_object_unref(process);
-        g_free(obuf);
-        free(buffer);
+        // SOF0 to SOF15, except DHT, JPG and DAC that share the range
+        if (marker >= JPEG_SOF0 && marker <= JPEG_SOF15 && marker != JPEG_DHT &&
+            marker != JPEG_JPG && marker != JPEG_DAC) {
+            if (length < 7) {
+                return 1;
+            }
+
+            *height = ((uint32_t) p[pos + 3] << 8) | p[pos + 4];
+            *width = ((uint32_t) p[pos + 5] << 8) | p[pos + 6];
+
+            // a zero height is only given later, by a DNL segment
+            return *height == 0 || *width == 0;
+        }
+
+        pos += length;
     }
 
-    return 0;
+    return 1;
 }
 
 /**
  *  @brief	Extracts the resolution values of image_buffer with size image_size
- *			using vips and writes them in height and width
+ *			from its JPEG header, or using vips if the header can't be parsed,
+ *			and writes them in height and width
  *
  *	@param	height :		The height to write into
  *	@param	width :			The width to write into
@@ -139,6 +452,16 @@ int lazily_resize(int code, struct pictdb_file* db_file, size_t index)
 int get_resolution(uint32_t* height, uint32_t* width, const char* image_buffer,
                    size_t image_size)
 {
+    if (height == NULL || width == NULL || image_buffer == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    if (!jpeg_header_resolution(height, width,
+                                (const unsigned char*) image_buffer,
+                                image_size)) {
+        return 0;
+    }
+
     VipsObject* process = VIPS_OBJECT(vips_image_new());
     VipsImage** thumbs = (VipsImage**) vips_object_local_array(process, 1);
 
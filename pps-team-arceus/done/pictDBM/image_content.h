@@ -9,12 +9,67 @@
 
 #include "pictDB.h"
 
+/* bit of a resolution code in a set of resolutions */
+#define RES_MASK(code) (1u << (code))
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /**
- * 	@brief 	Resizes the image from db_file at index with the code resolution
+ * 	@brief 	Resizes image to every resolution of codes, decoding it only once.
+ *			The largest resolutions are made first, and each one is made from
+ *			the smallest image already made that it fits in. Only computes the
+ *			new images: the database is not modified.
+ *
+ *	@param	image :		The original image
+ *	@param	size :		The size of the original image
+ *	@param	header :	The header holding the resolutions
+ *	@param	codes :		A RES_MASK combination of the resolutions to make
+ *	@param	resized :	The RES_ORIG resized images, to be freed with g_free,
+ *						NULL for the resolutions that are not in codes
+ *	@param	sizes :		The RES_ORIG sizes of the resized images
+ *
+ *	@return An error code
+ */
+int resize_images(const char* image, size_t size,
+                  const struct pictdb_header* header, unsigned int codes,
+                  char** resized, size_t* sizes);
+
+/**
+ * 	@brief 	Appends a resized image to db_file and records it as the
+ *			resolution code of the image at index. The metadata and header are
+ *			not written. db_file must be locked exclusively.
+ *
+ *	@param	code :		The code for the resolution
+ *	@param	db_file :	The file to work on
+ *	@param	index :		The index of the image
+ *	@param	resized :	The resized image
+ *	@param	size :		The size of the resized image
+ *
+ *	@return An error code
+ */
+int store_resized(int code, struct pictdb_file* db_file, size_t index,
+                  const char* resized, size_t size);
+
+/**
+ * 	@brief 	Creates the resolutions of codes that the image from db_file at
+ *			index is missing, with a single decoding of the original. Its
+ *			metadata is marked to be written by the next flush_dirty. db_file
+ *			must be locked exclusively.
+ *
+ *	@param	codes :		A RES_MASK combination of the resolutions we want
+ *	@param	db_file :	The file to work on
+ *	@param	index :		The index of the image
+ *
+ *	@return An error code
+ */
+int lazily_resize_all(unsigned int codes, struct pictdb_file* db_file,
+                      size_t index);
+
+/**
+ * 	@brief 	Resizes the image from db_file at index with the code resolution.
+ *			db_file must be locked exclusively.
  *
  *	@param	code :		The code for the resolution we want
  *	@param	db_file :	The file to work on
@@ -26,7 +81,8 @@ int lazily_resize(int code, struct pictdb_file* db_file, size_t index);
 
 /**
  *  @brief	Extracts the resolution values of image_buffer with size image_size
- *			using vips and writes them in height and width
+ *			from its JPEG header, or using vips if the header can't be parsed,
+ *			and writes them in height and width
  *
  *	@param	height :		The height to write into
  *	@param	width :			The width to write into
@@ -0,0 +1,790 @@
+/**
+ * @file index_store.c
+ * @brief copy of the pict_id and SHA indexes in the file of a pictDB
+ *
+ * The buckets of both tables are stored as they are laid out in memory, in a
+ * region of the data section that the chunk directory refers to. A database
+ * opened whole reads them back instead of hashing every key, and a paged one
+ * probes them in the file, so that finding a picture reads a few buckets and
+ * the pages of their metadata instead of the whole table.
+ *
+ * The region is stamped with the db_version of the metadata it matches. The
+ * stamp is cleared before any bucket is written, and set again once the
+ * metadata and header are: indexes interrupted in between, or older than the
+ * header, are rebuilt at the next open. So are those of a database whose log
+ * was replayed, which the log doesn't cover.
+ *
+ * Changes to the tables in memory are tracked in blocks of INDEX_BLOCK
+ * buckets, written along with the dirty metadata.
+ *
+ * @date 17 Oct 2026
+ */
+
+#include "pictDB.h"
+#include "db_index.h"
+#include "index_store.h"
+#include "pager.h"
+
+#include <stddef.h> // for offsetof
+#include <unistd.h> // for fsync
+
+#define ID_TABLE 0
+#define SHA_TABLE 1
+#define PROBE_WINDOW 64		// buckets read at once when probing
+
+/**
+ *  @brief  Returns the offset in the file of bucket b of a stored table
+ *
+ *  @param  db_file :   The database
+ *  @param  table :     ID_TABLE or SHA_TABLE
+ *  @param  b :         The bucket
+ *
+ *  @return The offset of the bucket
+ */
+static uint64_t bucket_offset(const struct pictdb_file* db_file, int table,
+                              uint64_t b)
+{
+    const struct index_store* stored = &db_file->stored;
+
+    return stored->offset + sizeof(struct pictdb_indexes) +
+           ((uint64_t) table * stored->buckets + b) * sizeof(uint32_t);
+}
+
+/**
+ *  @brief  Writes size bytes of data at offset in file
+ *
+ *  @param  file :      The file to write into
+ *  @param  offset :    The offset to write at
+ *  @param  data :      The bytes to write
+ *  @param  size :      The number of bytes
+ *
+ *  @return An error code
+ */
+static int write_at(FILE* file, uint64_t offset, const void* data, size_t size)
+{
+    if (fseek(file, (long) offset, SEEK_SET) ||
+        fwrite(data, 1, size, file) != size) {
+        return ERR_IO;
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Writes version as the stamp of the stored indexes of db_file. On
+ *          failure, they are no longer considered valid.
+ *
+ *  @param  db_file :   The database
+ *  @param  version :   The db_version they match, 0 while they are written
+ *
+ *  @return An error code
+ */
+static int write_stamp(struct pictdb_file* db_file, uint32_t version)
+{
+    struct index_store* stored = &db_file->stored;
+
+    if (write_at(db_file->fpdb, stored->offset +
+                 offsetof(struct pictdb_indexes, db_version),
+                 &version, sizeof(version)) ||
+        fflush(db_file->fpdb)) {
+        stored->valid = 0;
+        return ERR_IO;
+    }
+
+    stored->stamp = version;
+    return 0;
+}
+
+/**
+ *  @brief  Reads count buckets of a stored table from first on, wrapping
+ *          around its end
+ *
+ *  @param  db_file :   The database
+ *  @param  table :     ID_TABLE or SHA_TABLE
+ *  @param  first :     The first bucket
+ *  @param  buckets :   Room for count buckets
+ *  @param  count :     The number of buckets, at most the size of the table
+ *
+ *  @return An error code
+ */
+static int read_buckets(struct pictdb_file* db_file, int table, size_t first,
+                        uint32_t* buckets, size_t count)
+{
+    const size_t size = db_file->stored.buckets;
+
+    while (count > 0) {
+        const size_t length = size - first < count ? size - first : count;
+        char* tab = (char*) buckets;
+
+        if (read_disk_image(db_file->fpdb, &tab, length * sizeof(uint32_t),
+                            bucket_offset(db_file, table, first))) {
+            return ERR_IO;
+        }
+
+        buckets += length;
+        count -= length;
+        first = 0;
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Writes count buckets of a stored table from first on, wrapping
+ *          around its end
+ *
+ *  @param  db_file :   The database
+ *  @param  table :     ID_TABLE or SHA_TABLE
+ *  @param  first :     The first bucket
+ *  @param  buckets :   The count buckets to write
+ *  @param  count :     The number of buckets, at most the size of the table
+ *
+ *  @return An error code
+ */
+static int write_buckets(struct pictdb_file* db_file, int table, size_t first,
+                         const uint32_t* buckets, size_t count)
+{
+    const size_t size = db_file->stored.buckets;
+
+    while (count > 0) {
+        const size_t length = size - first < count ? size - first : count;
+
+        if (write_at(db_file->fpdb, bucket_offset(db_file, table, first),
+                     buckets, length * sizeof(uint32_t))) {
+            return ERR_IO;
+        }
+
+        buckets += length;
+        count -= length;
+        first = 0;
+    }
+
+    // read back with pread, past the buffer of the file
+    return fflush(db_file->fpdb) ? ERR_IO : 0;
+}
+
+/**
+ *  @brief  Reads the probe sequence of a stored table starting at start, up
+ *          to and including its first empty bucket
+ *
+ *  @param  db_file :   The database
+ *  @param  table :     ID_TABLE or SHA_TABLE
+ *  @param  start :     The first bucket
+ *  @param  cluster :   Set to the buckets, to be freed by the caller
+ *  @param  length :    Set to the number of buckets
+ *
+ *  @return An error code
+ */
+static int read_cluster(struct pictdb_file* db_file, int table, size_t start,
+                        uint32_t** cluster, size_t* length)
+{
+    const size_t size = db_file->stored.buckets;
+    uint32_t* buckets = NULL;
+    size_t count = 0;
+
+    while (count < size) {
+        const size_t window = size - count < PROBE_WINDOW ?
+                              size - count : PROBE_WINDOW;
+        uint32_t* temp = realloc(buckets, (count + window) * sizeof(uint32_t));
+
+        if (temp == NULL) {
+            free(buckets);
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        buckets = temp;
+
+        if (read_buckets(db_file, table, (start + count) & (size - 1),
+                         &buckets[count], window)) {
+            free(buckets);
+            return ERR_IO;
+        }
+
+        for (size_t j = count; j < count + window; j++) {
+            if (buckets[j] == 0) {
+                *cluster = buckets;
+                *length = j + 1;
+                return 0;
+            }
+        }
+
+        count += window;
+    }
+
+    // a table is at most half full
+    free(buckets);
+    return ERR_IO;
+}
+
+/**
+ *  @brief  Returns the bucket the key of the picture at index hashes to in a
+ *          stored table
+ *
+ *  @param  db_file :   The paged database
+ *  @param  table :     ID_TABLE or SHA_TABLE
+ *  @param  index :     The index of the picture
+ *  @param  home :      Set to the bucket
+ *
+ *  @return An error code
+ */
+static int home_of(struct pictdb_file* db_file, int table, size_t index,
+                   size_t* home)
+{
+    if (index >= db_file->header.max_files) {
+        return ERR_IO;
+    }
+
+    const struct pict_metadata* metadata = get_metadata(db_file, index);
+    const uint64_t hash = table == ID_TABLE ? index_hash_id(metadata->pict_id) :
+                          index_hash_sha(metadata->SHA);
+
+    *home = hash & (db_file->stored.buckets - 1);
+    return pager_error(db_file);
+}
+
+/**
+ *  @brief  Writes the stored indexes of db_file at offset from its tables in
+ *          memory, unstamped
+ *
+ *  @param  db_file :   The database
+ *  @param  offset :    The offset of the stored indexes
+ *
+ *  @return An error code
+ */
+static int write_tables(struct pictdb_file* db_file, uint64_t offset)
+{
+    const uint64_t buckets = db_file->id_index.mask + 1;
+    const size_t size = buckets * sizeof(uint32_t);
+    struct pictdb_indexes start;
+
+    memset(&start, 0, sizeof(start));
+    start.magic = PICTDB_INDEXES;
+    start.buckets = buckets;
+
+    if (write_at(db_file->fpdb, offset, &start, sizeof(start)) ||
+        write_at(db_file->fpdb, offset + sizeof(start),
+                 db_file->id_index.buckets, size) ||
+        write_at(db_file->fpdb, offset + sizeof(start) + size,
+                 db_file->sha_index.buckets, size) ||
+        fflush(db_file->fpdb)) {
+        return ERR_IO;
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Writes the tables of db_file to a new region, then a chunk
+ *          directory referring to it, and points the header to that
+ *          directory. The previous directory and indexes are freed once the
+ *          header is on the disk; until then, a crash leaves the database as
+ *          it was.
+ *
+ *  @param  db_file :   The database
+ *
+ *  @return An error code
+ */
+static int move_tables(struct pictdb_file* db_file)
+{
+    struct index_store* stored = &db_file->stored;
+    const struct pictdb_header header = db_file->header;
+    const uint64_t buckets = db_file->id_index.mask + 1;
+    const uint64_t size = index_store_size(buckets);
+    const uint64_t directory_size = sizeof(struct pictdb_directory) +
+                                    db_file->chunk_count *
+                                    sizeof(struct pictdb_chunk);
+    struct pictdb_directory start;
+    size_t end = 0;
+    int ret = 0;
+
+    if ((ret = get_file_size(db_file->fpdb, &end))) {
+        return ret;
+    }
+
+    uint64_t offset = index_alloc_extent(db_file, size);
+    uint64_t directory = index_alloc_extent(db_file, directory_size);
+
+    if (offset == 0) {
+        offset = end;
+        end += size;
+    }
+
+    if (directory == 0) {
+        directory = end;
+    }
+
+    memset(&start, 0, sizeof(start));
+    start.magic = PICTDB_CHUNKED;
+    start.count = (uint32_t) db_file->chunk_count;
+    start.indexes = offset;
+
+    if ((ret = write_tables(db_file, offset)) ||
+        write_at(db_file->fpdb, directory, &start, sizeof(start)) ||
+        write_at(db_file->fpdb, directory + sizeof(start), db_file->chunks,
+                 db_file->chunk_count * sizeof(struct pictdb_chunk)) ||
+        fflush(db_file->fpdb) || fsync(fileno(db_file->fpdb))) {
+        return ret ? ret : ERR_IO;
+    }
+
+    // a contiguous table becomes the only chunk
+    db_file->header.format = PICTDB_CHUNKED;
+    db_file->header.directory = directory;
+
+    if ((ret = write_header(db_file, db_file->fpdb, 0, 1)) ||
+        fflush(db_file->fpdb) || fsync(fileno(db_file->fpdb))) {
+        db_file->header = header;
+        return ret ? ret : ERR_IO;
+    }
+
+    if (header.format == PICTDB_CHUNKED) {
+        index_release_extent(db_file, header.directory, directory_size);
+    }
+
+    if (stored->offset != 0) {
+        index_release_extent(db_file, stored->offset,
+                             index_store_size(stored->buckets));
+    }
+
+    stored->offset = offset;
+    stored->buckets = buckets;
+    stored->stamp = 0;
+
+    return 0;
+}
+
+/**
+ *  @brief  Returns the size in the file of stored indexes of buckets buckets
+ *
+ *  @param  buckets :   The number of buckets per index
+ *
+ *  @return The size in bytes
+ */
+uint64_t index_store_size(uint64_t buckets)
+{
+    return sizeof(struct pictdb_indexes) + 2 * buckets * sizeof(uint32_t);
+}
+
+/**
+ *  @brief  Finds the stored indexes of db_file through its chunk directory
+ *          and tells whether they match its metadata. Unreadable or damaged
+ *          indexes are ignored.
+ *
+ *  @param  db_file :   The database, with its header read
+ */
+void index_store_load(struct pictdb_file* db_file)
+{
+    struct index_store* stored = &db_file->stored;
+    struct pictdb_directory directory;
+    struct pictdb_indexes indexes;
+    char* buffer = (char*) &directory;
+    size_t size = 0;
+
+    stored->offset = 0;
+    stored->buckets = 0;
+    stored->stamp = 0;
+    stored->valid = 0;
+
+    if (db_file->header.format != PICTDB_CHUNKED ||
+        get_file_size(db_file->fpdb, &size) ||
+        read_disk_image(db_file->fpdb, &buffer, sizeof(directory),
+                        db_file->header.directory) ||
+        directory.indexes == 0) {
+        return;
+    }
+
+    buffer = (char*) &indexes;
+
+    // buckets hold an index + 1 on 32 bits
+    if (read_disk_image(db_file->fpdb, &buffer, sizeof(indexes),
+                        directory.indexes) ||
+        indexes.magic != PICTDB_INDEXES || indexes.buckets == 0 ||
+        indexes.buckets > ((uint64_t) 1 << 32) ||
+        (indexes.buckets & (indexes.buckets - 1)) != 0 ||
+        directory.indexes + index_store_size(indexes.buckets) > size) {
+        return;
+    }
+
+    stored->offset = directory.indexes;
+    stored->buckets = indexes.buckets;
+    stored->stamp = indexes.db_version;
+    stored->valid = !stored->stale && stored->stamp != 0 &&
+                    stored->stamp == db_file->header.db_version &&
+                    stored->buckets == index_buckets(db_file->header.max_files);
+}
+
+/**
+ *  @brief  Reads the stored indexes of db_file into its pict_id and SHA
+ *          tables, allocated with as many buckets
+ *
+ *  @param  db_file :   The database, whose stored indexes are valid
+ *
+ *  @return An error code
+ */
+int index_store_read(struct pictdb_file* db_file)
+{
+    const struct index_store* stored = &db_file->stored;
+    uint32_t* tables[2] = {db_file->id_index.buckets, db_file->sha_index.buckets};
+
+    if (!stored->valid || tables[ID_TABLE] == NULL ||
+        tables[SHA_TABLE] == NULL ||
+        db_file->id_index.mask + 1 != stored->buckets ||
+        db_file->sha_index.mask + 1 != stored->buckets) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    for (int table = ID_TABLE; table <= SHA_TABLE; table++) {
+        char* tab = (char*) tables[table];
+
+        if (read_disk_image(db_file->fpdb, &tab,
+                            stored->buckets * sizeof(uint32_t),
+                            bucket_offset(db_file, table, 0))) {
+            return ERR_IO;
+        }
+
+        // an index out of the table would be read past the metadata
+        for (size_t b = 0; b < stored->buckets; b++) {
+            if (tables[table][b] > db_file->header.max_files) {
+                return ERR_IO;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Makes the stored indexes of db_file match its tables in memory,
+ *          writing them if they don't, and starts tracking the blocks of
+ *          buckets that change. Indexes of the wrong size are moved, which
+ *          rewrites the chunk directory and the header: a contiguous
+ *          database then becomes chunked. db_file must be writable and
+ *          locked exclusively, with an empty log if it has one.
+ *
+ *  @param  db_file :   The database, with its indexes built
+ *
+ *  @return An error code
+ */
+int index_store_sync(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->fpdb == NULL ||
+        db_file->id_index.buckets == NULL || db_file->sha_index.buckets == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct index_store* stored = &db_file->stored;
+    const uint64_t buckets = db_file->id_index.mask + 1;
+    const size_t words = ((buckets + INDEX_BLOCK - 1) / INDEX_BLOCK +
+                          WORD_BITS - 1) / WORD_BITS;
+    int ret = 0;
+
+    if ((db_file->id_index.dirty == NULL &&
+         (db_file->id_index.dirty = calloc(words, sizeof(uint64_t))) == NULL) ||
+        (db_file->sha_index.dirty == NULL &&
+         (db_file->sha_index.dirty = calloc(words, sizeof(uint64_t))) == NULL)) {
+        // changes could not be tracked: the next one makes the stamp too old
+        free(db_file->id_index.dirty);
+        db_file->id_index.dirty = NULL;
+        stored->valid = 0;
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    memset(db_file->id_index.dirty, 0, words * sizeof(uint64_t));
+    memset(db_file->sha_index.dirty, 0, words * sizeof(uint64_t));
+
+    if (stored->valid) {
+        return 0;
+    }
+
+    if (stored->offset != 0 && stored->buckets == buckets) {
+        // the stamp is cleared first
+        if (!(ret = write_tables(db_file, stored->offset))) {
+            stored->stamp = 0;
+        }
+    } else {
+        ret = move_tables(db_file);
+    }
+
+    if (!ret) {
+        stored->stale = 0;
+        stored->valid = 1;
+        ret = write_stamp(db_file, db_file->header.db_version);
+    }
+
+    return ret;
+}
+
+/**
+ *  @brief  Writes the blocks of buckets of db_file that changed since the
+ *          last call, after clearing the stamp of its stored indexes. Called
+ *          by write_dirty before the metadata.
+ *
+ *  @param  db_file :   The database
+ *
+ *  @return An error code
+ */
+int index_store_write(struct pictdb_file* db_file)
+{
+    struct index_store* stored = &db_file->stored;
+    struct pict_index* tables[2] = {&db_file->id_index, &db_file->sha_index};
+    int ret = 0;
+
+    for (int table = ID_TABLE; table <= SHA_TABLE; table++) {
+        uint64_t* dirty = tables[table]->dirty;
+        const size_t buckets = tables[table]->mask + 1;
+        const size_t blocks = (buckets + INDEX_BLOCK - 1) / INDEX_BLOCK;
+
+        if (dirty == NULL) {
+            continue;
+        }
+
+        // consecutive dirty blocks are written at once
+        for (size_t block = 0; block < blocks;) {
+            if (dirty[block / WORD_BITS] == 0) {
+                block += WORD_BITS - block % WORD_BITS;
+                continue;
+            }
+
+            if (!(dirty[block / WORD_BITS] & ((uint64_t) 1 << (block % WORD_BITS)))) {
+                block++;
+                continue;
+            }
+
+            size_t end = block + 1;
+
+            while (end < blocks &&
+                   (dirty[end / WORD_BITS] & ((uint64_t) 1 << (end % WORD_BITS)))) {
+                end++;
+            }
+
+            const size_t first = block * INDEX_BLOCK;
+            const size_t last = end * INDEX_BLOCK < buckets ?
+                                end * INDEX_BLOCK : buckets;
+
+            if (!ret && stored->valid && stored->stamp != 0) {
+                ret = write_stamp(db_file, 0);
+            }
+
+            if (!ret && stored->valid) {
+                ret = write_buckets(db_file, table, first,
+                                    &tables[table]->buckets[first], last - first);
+            }
+
+            block = end;
+        }
+
+        memset(dirty, 0, (blocks + WORD_BITS - 1) / WORD_BITS * sizeof(uint64_t));
+    }
+
+    if (ret) {
+        stored->valid = 0;
+    }
+
+    return ret;
+}
+
+/**
+ *  @brief  Stamps the stored indexes of db_file with its version, if they
+ *          match its metadata. Called by write_dirty once the metadata and
+ *          header are written.
+ *
+ *  @param  db_file :   The database
+ */
+void index_store_stamp(struct pictdb_file* db_file)
+{
+    // a failure only leaves them to be rebuilt
+    if (db_file->stored.valid &&
+        db_file->stored.stamp != db_file->header.db_version) {
+        write_stamp(db_file, db_file->header.db_version);
+    }
+}
+
+/**
+ *  @brief  Looks pict_id up in the stored pict_id index of db_file
+ *
+ *  @param  db_file :   The paged database, whose stored indexes are valid
+ *  @param  pict_id :   The id to look for
+ *  @param  index :     Set to the index of the picture, -1 if there is none
+ *
+ *  @return An error code
+ */
+int index_store_find_id(struct pictdb_file* db_file, const char* pict_id,
+                        size_t* index)
+{
+    if (db_file == NULL || pict_id == NULL || index == NULL ||
+        !db_file->stored.valid) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    uint32_t* cluster = NULL;
+    size_t length = 0;
+    int ret = 0;
+
+    *index = -1;
+
+    if ((ret = read_cluster(db_file, ID_TABLE, index_hash_id(pict_id) &
+                            (db_file->stored.buckets - 1), &cluster, &length))) {
+        return ret;
+    }
+
+    for (size_t j = 0; !ret && *index == (size_t) -1 && j + 1 < length; j++) {
+        const size_t i = cluster[j] - 1;
+
+        if (i >= db_file->header.max_files) {
+            ret = ERR_IO;
+        } else {
+            const struct pict_metadata* metadata = get_metadata(db_file, i);
+
+            if (!(ret = pager_error(db_file)) &&
+                metadata->is_valid == NON_EMPTY &&
+                !strcmp(metadata->pict_id, pict_id)) {
+                *index = i;
+            }
+        }
+    }
+
+    free(cluster);
+    return ret;
+}
+
+/**
+ *  @brief  Looks SHA up in the stored SHA index of db_file
+ *
+ *  @param  db_file :   The paged database, whose stored indexes are valid
+ *  @param  SHA :       The SHA to look for
+ *  @param  exclude :   An index to skip
+ *  @param  index :     Set to the index of a valid picture with that SHA, -1
+ *                      if there is none
+ *
+ *  @return An error code
+ */
+int index_store_find_sha(struct pictdb_file* db_file, const unsigned char* SHA,
+                         size_t exclude, size_t* index)
+{
+    if (db_file == NULL || SHA == NULL || index == NULL ||
+        !db_file->stored.valid) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    uint32_t* cluster = NULL;
+    size_t length = 0;
+    int ret = 0;
+
+    *index = -1;
+
+    if ((ret = read_cluster(db_file, SHA_TABLE, index_hash_sha(SHA) &
+                            (db_file->stored.buckets - 1), &cluster, &length))) {
+        return ret;
+    }
+
+    for (size_t j = 0; !ret && *index == (size_t) -1 && j + 1 < length; j++) {
+        const size_t i = cluster[j] - 1;
+
+        if (i >= db_file->header.max_files) {
+            ret = ERR_IO;
+        } else if (i != exclude) {
+            const struct pict_metadata* metadata = get_metadata(db_file, i);
+
+            if (!(ret = pager_error(db_file)) &&
+                metadata->is_valid == NON_EMPTY &&
+                !compare_sha(metadata->SHA, SHA)) {
+                *index = i;
+            }
+        }
+    }
+
+    free(cluster);
+    return ret;
+}
+
+/**
+ *  @brief  Removes the picture at index from a stored table, shifting the
+ *          following entries of its probe sequence back like the tables in
+ *          memory do
+ *
+ *  @param  db_file :   The paged database
+ *  @param  table :     ID_TABLE or SHA_TABLE
+ *  @param  home :      The bucket the key of the picture hashes to
+ *  @param  index :     The index of the picture
+ *
+ *  @return An error code
+ */
+static int remove_from(struct pictdb_file* db_file, int table, size_t home,
+                       size_t index)
+{
+    const size_t mask = db_file->stored.buckets - 1;
+    uint32_t* cluster = NULL;
+    size_t length = 0;
+    size_t hole = 0;
+    int ret = 0;
+
+    if ((ret = read_cluster(db_file, table, home, &cluster, &length))) {
+        return ret;
+    }
+
+    while (hole + 1 < length && cluster[hole] != index + 1) {
+        hole++;
+    }
+
+    // a duplicate id is not in the pict_id index
+    if (hole + 1 == length) {
+        free(cluster);
+        return 0;
+    }
+
+    const size_t first = hole;
+
+    for (size_t j = hole + 1; !ret && cluster[j] != 0; j++) {
+        const size_t b = (home + j) & mask;
+        size_t other = 0;
+
+        if (!(ret = home_of(db_file, table, cluster[j] - 1, &other)) &&
+            ((b - other) & mask) >= ((b - home - hole) & mask)) {
+            cluster[hole] = cluster[j];
+            hole = j;
+        }
+    }
+
+    cluster[hole] = 0;
+
+    if (!ret && db_file->stored.stamp != 0) {
+        ret = write_stamp(db_file, 0);
+    }
+
+    if (!ret) {
+        ret = write_buckets(db_file, table, (home + first) & mask,
+                            &cluster[first], length - 1 - first);
+    }
+
+    free(cluster);
+    return ret;
+}
+
+/**
+ *  @brief  Removes the picture at index from the stored indexes of db_file.
+ *          Must be called while its metadata still holds the indexed values.
+ *          If it fails, they are no longer stamped as valid afterwards.
+ *
+ *  @param  db_file :   The paged database
+ *  @param  index :     The index of the picture to remove
+ */
+void index_store_remove(struct pictdb_file* db_file, size_t index)
+{
+    if (db_file == NULL || !db_file->stored.valid) {
+        return;
+    }
+
+    size_t homes[2] = {0, 0};
+    int ret = 0;
+
+    for (int table = ID_TABLE; !ret && table <= SHA_TABLE; table++) {
+        ret = home_of(db_file, table, index, &homes[table]);
+    }
+
+    for (int table = ID_TABLE; !ret && table <= SHA_TABLE; table++) {
+        ret = remove_from(db_file, table, homes[table], index);
+    }
+
+    if (ret) {
+        db_file->stored.valid = 0;
+    }
+}
@@ -0,0 +1,120 @@
+/**
+ * @file index_store.h
+ * @brief copy of the pict_id and SHA indexes in the file of a pictDB
+ *
+ * @date 17 Oct 2026
+ */
+
+#ifndef PICTDBPRJ_INDEX_STORE_H
+#define PICTDBPRJ_INDEX_STORE_H
+
+#include "pictDB.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ *  @brief  Returns the size in the file of stored indexes of buckets buckets
+ *
+ *  @param  buckets :   The number of buckets per index
+ *
+ *  @return The size in bytes
+ */
+uint64_t index_store_size(uint64_t buckets);
+
+/**
+ *  @brief  Finds the stored indexes of db_file through its chunk directory
+ *          and tells whether they match its metadata. Unreadable or damaged
+ *          indexes are ignored.
+ *
+ *  @param  db_file :   The database, with its header read
+ */
+void index_store_load(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Reads the stored indexes of db_file into its pict_id and SHA
+ *          tables, allocated with as many buckets
+ *
+ *  @param  db_file :   The database, whose stored indexes are valid
+ *
+ *  @return An error code
+ */
+int index_store_read(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Makes the stored indexes of db_file match its tables in memory,
+ *          writing them if they don't, and starts tracking the blocks of
+ *          buckets that change. Indexes of the wrong size are moved, which
+ *          rewrites the chunk directory and the header: a contiguous
+ *          database then becomes chunked. db_file must be writable and
+ *          locked exclusively, with an empty log if it has one.
+ *
+ *  @param  db_file :   The database, with its indexes built
+ *
+ *  @return An error code
+ */
+int index_store_sync(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Writes the blocks of buckets of db_file that changed since the
+ *          last call, after clearing the stamp of its stored indexes. Called
+ *          by write_dirty before the metadata.
+ *
+ *  @param  db_file :   The database
+ *
+ *  @return An error code
+ */
+int index_store_write(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Stamps the stored indexes of db_file with its version, if they
+ *          match its metadata. Called by write_dirty once the metadata and
+ *          header are written.
+ *
+ *  @param  db_file :   The database
+ */
+void index_store_stamp(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Looks pict_id up in the stored pict_id index of db_file
+ *
+ *  @param  db_file :   The paged database, whose stored indexes are valid
+ *  @param  pict_id :   The id to look for
+ *  @param  index :     Set to the index of the picture, -1 if there is none
+ *
+ *  @return An error code
+ */
+int index_store_find_id(struct pictdb_file* db_file, const char* pict_id,
+                        size_t* index);
+
+/**
+ *  @brief  Looks SHA up in the stored SHA index of db_file
+ *
+ *  @param  db_file :   The paged database, whose stored indexes are valid
+ *  @param  SHA :       The SHA to look for
+ *  @param  exclude :   An index to skip
+ *  @param  index :     Set to the index of a valid picture with that SHA, -1
+ *                      if there is none
+ *
+ *  @return An error code
+ */
+int index_store_find_sha(struct pictdb_file* db_file, const unsigned char* SHA,
+                         size_t exclude, size_t* index);
+
+/**
+ *  @brief  Removes the picture at index from the stored indexes of db_file.
+ *          Must be called while its metadata still holds the indexed values.
+ *          If it fails, they are no longer stamped as valid afterwards.
+ *
+ *  @param  db_file :   The paged database
+ *  @param  index :     The index of the picture to remove
+ */
+void index_store_remove(struct pictdb_file* db_file, size_t index);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,287 @@
+/**
+ * @file pager.c
+ * @brief on-demand paging of the metadata of a pictDB opened with OPEN_PAGED
+ *
+ * The metadata table is split in pages of PAGE_FILES consecutive metadata.
+ * At most PAGER_FRAMES pages are resident, whatever max_files is: a page is
+ * read when one of its metadata is first asked for, and the least recently
+ * used one is evicted to make room. Scans go through a buffer of their own,
+ * so that a lookup doesn't evict the metadata its caller is working on.
+ *
+ * @date 17 Oct 2026
+ */
+
+#include "pictDB.h"
+#include "pager.h"
+
+#define PAGE_FILES 256		// metadata per page, 54 KiB
+#define PAGER_FRAMES 32		// resident pages
+#define NO_PAGE ((size_t) -1)
+
+/*resident pages of the metadata table*/
+struct pict_pager {
+    struct pict_metadata*	frames;					// PAGER_FRAMES pages
+    size_t					pages[PAGER_FRAMES];	// page held, or NO_PAGE
+    uint64_t				used[PAGER_FRAMES];		// last use, for the LRU
+    uint64_t				clock;
+    struct pict_metadata*	scan;					// page being scanned
+    struct pict_metadata	empty;					// given for unreadable pages
+    int						error;
+};
+
+/**
+ *  @brief  Reads page of the metadata table of db_file into buffer. The last
+ *          page is cut at max_files.
+ *
+ *  @param  db_file :   The paged database
+ *  @param  page :      The page to read
+ *  @param  buffer :    Room for PAGE_FILES metadata
+ *
+ *  @return An error code
+ */
+static int read_page(const struct pictdb_file* db_file, size_t page,
+                     struct pict_metadata* buffer)
+{
+    size_t first = page * PAGE_FILES;
+    const size_t end = first + PAGE_FILES < db_file->header.max_files ?
+                       first + PAGE_FILES : db_file->header.max_files;
+
+    // one read per chunk the page spans
+    for (size_t i = 0; first < end && i < db_file->chunk_count; i++) {
+        const struct pictdb_chunk* chunk = &db_file->chunks[i];
+        const size_t chunk_end = (size_t) chunk->first + chunk->files;
+
+        if (first >= chunk_end) {
+            continue;
+        }
+
+        const size_t count = (end < chunk_end ? end : chunk_end) - first;
+        char* tab = (char*) &buffer[first - page * PAGE_FILES];
+        int ret = 0;
+
+        if ((ret = read_disk_image(db_file->fpdb, &tab,
+                                   count * sizeof(struct pict_metadata),
+                                   chunk->offset + (first - chunk->first) *
+                                   sizeof(struct pict_metadata)))) {
+            return ret;
+        }
+
+        first += count;
+    }
+
+    return first < end ? ERR_IO : 0;
+}
+
+/**
+ *  @brief  Returns the frame holding page in the pager, -1 if it is not
+ *          resident
+ *
+ *  @param  pager :     The pager
+ *  @param  page :      The page to look for
+ *
+ *  @return The frame
+ */
+static size_t frame_of(const struct pict_pager* pager, size_t page)
+{
+    for (size_t f = 0; f < PAGER_FRAMES; f++) {
+        if (pager->pages[f] == page) {
+            return f;
+        }
+    }
+
+    return NO_PAGE;
+}
+
+/**
+ *  @brief  Makes page resident in the pager of db_file, evicting the least
+ *          recently used page if needed. The page is copied from loaded if
+ *          it is not NULL, read otherwise.
+ *
+ *  @param  db_file :   The paged database
+ *  @param  page :      The page to fault in
+ *  @param  loaded :    The content of the page, or NULL
+ *
+ *  @return The frame of the page, -1 if it couldn't be read
+ */
+static size_t fault_in(struct pictdb_file* db_file, size_t page,
+                       const struct pict_metadata* loaded)
+{
+    struct pict_pager* pager = db_file->pager;
+    size_t frame = frame_of(pager, page);
+
+    if (frame == NO_PAGE) {
+        frame = 0;
+
+        for (size_t f = 1; f < PAGER_FRAMES; f++) {
+            if (pager->used[f] < pager->used[frame]) {
+                frame = f;
+            }
+        }
+
+        struct pict_metadata* buffer = &pager->frames[frame * PAGE_FILES];
+        int ret = 0;
+
+        pager->pages[frame] = NO_PAGE;
+
+        if (loaded != NULL) {
+            memcpy(buffer, loaded, PAGE_FILES * sizeof(struct pict_metadata));
+        } else if ((ret = read_page(db_file, page, buffer))) {
+            pager->error = ret;
+            return NO_PAGE;
+        }
+
+        pager->pages[frame] = page;
+    }
+
+    pager->used[frame] = ++pager->clock;
+    return frame;
+}
+
+/**
+ *  @brief  Attaches an empty pager to db_file, whose header and chunks are
+ *          loaded
+ *
+ *  @param  db_file :   The database
+ *
+ *  @return An error code
+ */
+int pager_open(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->chunks == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct pict_pager* pager = calloc(1, sizeof(struct pict_pager));
+
+    if (pager == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    if ((pager->frames = calloc(PAGER_FRAMES * PAGE_FILES,
+                                sizeof(struct pict_metadata))) == NULL ||
+        (pager->scan = calloc(PAGE_FILES, sizeof(struct pict_metadata))) == NULL) {
+        free(pager->frames);
+        free(pager);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    for (size_t f = 0; f < PAGER_FRAMES; f++) {
+        pager->pages[f] = NO_PAGE;
+    }
+
+    db_file->pager = pager;
+    return 0;
+}
+
+/**
+ *  @brief  Returns the metadata at index of db_file, reading its page if it
+ *          is not resident. The least recently used page is evicted to make
+ *          room, so the pointer stays valid while less than PAGER_FRAMES
+ *          other pages are faulted in. If the page cannot be read, returns
+ *          an empty metadata and remembers the error for pager_error.
+ *
+ *  @param  db_file :   The paged database
+ *  @param  index :     The index of the metadata, less than max_files
+ *
+ *  @return The metadata
+ */
+struct pict_metadata* pager_get(struct pictdb_file* db_file, size_t index)
+{
+    struct pict_pager* pager = db_file->pager;
+    const size_t frame = fault_in(db_file, index / PAGE_FILES, NULL);
+
+    if (frame == NO_PAGE) {
+        memset(&pager->empty, 0, sizeof(struct pict_metadata));
+        return &pager->empty;
+    }
+
+    return &pager->frames[frame * PAGE_FILES + index % PAGE_FILES];
+}
+
+/**
+ *  @brief  Finds the first metadata of db_file other than exclude that
+ *          matches key. The pages are read through a buffer of their own,
+ *          so the scan only faults in the page of the match.
+ *
+ *  @param  db_file :   The paged database
+ *  @param  match :     The test of a metadata
+ *  @param  key :       The key given to match
+ *  @param  exclude :   The index to skip, -1 for none
+ *
+ *  @return The index of the metadata, -1 if none matches or on error
+ */
+size_t pager_find(struct pictdb_file* db_file, metadata_match match,
+                  const void* key, size_t exclude)
+{
+    if (db_file == NULL || db_file->pager == NULL || match == NULL) {
+        return -1;
+    }
+
+    struct pict_pager* pager = db_file->pager;
+    const size_t max_files = db_file->header.max_files;
+    const size_t pages = (max_files + PAGE_FILES - 1) / PAGE_FILES;
+
+    for (size_t page = 0; page < pages; page++) {
+        // a resident page may be newer than the file
+        const size_t frame = frame_of(pager, page);
+        const struct pict_metadata* buffer = frame != NO_PAGE ?
+                                             &pager->frames[frame * PAGE_FILES] :
+                                             pager->scan;
+        int ret = 0;
+
+        if (frame == NO_PAGE && (ret = read_page(db_file, page, pager->scan))) {
+            pager->error = ret;
+            return -1;
+        }
+
+        const size_t count = max_files - page * PAGE_FILES < PAGE_FILES ?
+                             max_files - page * PAGE_FILES : PAGE_FILES;
+
+        for (size_t i = 0; i < count; i++) {
+            const size_t index = page * PAGE_FILES + i;
+
+            if (index != exclude && match(&buffer[i], key)) {
+                // the caller is likely to use it next
+                fault_in(db_file, page, frame != NO_PAGE ? NULL : pager->scan);
+                return index;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/**
+ *  @brief  Returns and clears the error of the last page that couldn't be
+ *          read
+ *
+ *  @param  db_file :   The paged database
+ *
+ *  @return An error code
+ */
+int pager_error(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->pager == NULL) {
+        return 0;
+    }
+
+    const int ret = db_file->pager->error;
+    db_file->pager->error = 0;
+    return ret;
+}
+
+/**
+ *  @brief  Frees the pager of db_file, if it has one. Pages are never dirty:
+ *          metadata updates are written through by mark_metadata.
+ *
+ *  @param  db_file :   The database
+ */
+void pager_close(struct pictdb_file* db_file)
+{
+    if (db_file != NULL && db_file->pager != NULL) {
+        free(db_file->pager->frames);
+        free(db_file->pager->scan);
+        free(db_file->pager);
+        db_file->pager = NULL;
+    }
+}
@@ -0,0 +1,82 @@
+/**
+ * @file pager.h
+ * @brief on-demand paging of the metadata of a pictDB opened with OPEN_PAGED
+ *
+ * @date 17 Oct 2026
+ */
+
+#ifndef PICTDBPRJ_PAGER_H
+#define PICTDBPRJ_PAGER_H
+
+#include "pictDB.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*test of a metadata by pager_find*/
+typedef int (*metadata_match)(const struct pict_metadata* metadata,
+                              const void* key);
+
+/**
+ *  @brief  Attaches an empty pager to db_file, whose header and chunks are
+ *          loaded
+ *
+ *  @param  db_file :   The database
+ *
+ *  @return An error code
+ */
+int pager_open(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Returns the metadata at index of db_file, reading its page if it
+ *          is not resident. The least recently used page is evicted to make
+ *          room, so the pointer stays valid while less than PAGER_FRAMES
+ *          other pages are faulted in. If the page cannot be read, returns
+ *          an empty metadata and remembers the error for pager_error.
+ *
+ *  @param  db_file :   The paged database
+ *  @param  index :     The index of the metadata, less than max_files
+ *
+ *  @return The metadata
+ */
+struct pict_metadata* pager_get(struct pictdb_file* db_file, size_t index);
+
+/**
+ *  @brief  Finds the first metadata of db_file other than exclude that
+ *          matches key. The pages are read through a buffer of their own,
+ *          so the scan only faults in the page of the match.
+ *
+ *  @param  db_file :   The paged database
+ *  @param  match :     The test of a metadata
+ *  @param  key :       The key given to match
+ *  @param  exclude :   The index to skip, -1 for none
+ *
+ *  @return The index of the metadata, -1 if none matches or on error
+ */
+size_t pager_find(struct pictdb_file* db_file, metadata_match match,
+                  const void* key, size_t exclude);
+
+/**
+ *  @brief  Returns and clears the error of the last page that couldn't be
+ *          read
+ *
+ *  @param  db_file :   The paged database
+ *
+ *  @return An error code
+ */
+int pager_error(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Frees the pager of db_file, if it has one. Pages are never dirty:
+ *          metadata updates are written through by mark_metadata.
+ *
+ *  @param  db_file :   The database
+ */
+void pager_close(struct pictdb_file* db_file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,6 +11,16 @@
  * because it should be stored as raw bytes appended at the end of the
  * database file and addressed by offsets in the metadata structure.
  *
+ * A database grown by do_grow has the PICTDB_CHUNKED format: the metadata
+ * after the header is only the first chunk of the table, and the next chunks
+ * are appended to the file like images. A chunk directory, also in the data
+ * section, lists them all; the header gives its offset.
+ *
+ * The directory may also give the offset of a copy of the pict_id and SHA
+ * indexes, so that a lookup doesn't have to load the table (see
+ * index_store.h). A database opened for writing gets one, and becomes
+ * chunked, with a single chunk if it was not grown.
+ *
  * @date 2 Nov 2015
  */
 
@@ -25,6 +35,7 @@
 #include <stdlib.h> 		// for malloc, calloc
 #include <string.h>
 #include <openssl/sha.h> 	// for SHA256_DIGEST_LENGTH
+#include <pthread.h>		// for pthread_rwlock_t
 #include <vips/vips.h>		// for vips
 
 #define CAT_TXT "EPFL PictDB binary"
@@ -34,6 +45,7 @@
 #define MAX_PIC_ID 		127  	// max. size of a picture id
 #define MAX_SUFFIX_SIZE 10 		// max. size of a suffix name
 #define MAX_MAX_FILES 	100000  // max. number of files in a database
+#define MAX_CHUNKED_FILES 100000000	// max. number of files once grown
 #define MAX_THUMB_RES 	128		// max. thumbnail resolution
 #define MAX_SMALL_RES 	512		// max. small resolution
 
@@ -42,10 +54,25 @@
 #define DEF_THUMB_RES 64		// default thumbnail resolution
 #define DEF_SMALL_RES 256       // default small resolution     		 
 
+/* flags for do_open_ext */
+#define OPEN_MMAP		0x1		// metadata points into a mapping of the file,
+                                // unless the database is chunked
+#define OPEN_MMAP_SYNC	0x2		// msync every header and metadata update
+#define OPEN_WAL		0x4		// log updates in <db>.wal, see wal.h
+#define OPEN_PAGED		0x8		// fault metadata in on demand, see pager.h
+
+/* For format in pictdb_header */
+#define PICTDB_CONTIGUOUS	0			// metadata table right after the header
+#define PICTDB_CHUNKED		0x4b4e4843	// "CHNK": chunked metadata table
+#define PICTDB_INDEXES		0x53584449	// "IDXS": stored indexes
+
 /* For is_valid in pictdb_metadata */
 #define EMPTY 		0
 #define NON_EMPTY 	1
 
+/* For the bitmaps of free_slots and dirty_set, made of uint64_t words */
+#define WORD_BITS 64
+
 // pictDB library internal codes for different picture resolutions.
 #define RES_THUMB 0
 #define RES_SMALL 1
@@ -63,8 +90,30 @@ struct pictdb_header {
     uint32_t 		num_files;
     uint32_t 		max_files;
     uint16_t  		res_resized[2 * (NB_RES - 1)];
-    uint32_t 		unused_32;
-    uint64_t 		unused_64;
+    uint32_t 		format;			// PICTDB_CONTIGUOUS or PICTDB_CHUNKED
+    uint64_t 		directory;		// offset of the chunk directory if chunked
+};
+
+/*chunk of the metadata table, as listed in the chunk directory*/
+struct pictdb_chunk {
+    uint64_t		offset;			// offset of its first metadata in the file
+    uint32_t		first;			// index of its first metadata
+    uint32_t		files;			// number of metadata in the chunk
+};
+
+/*start of the chunk directory, followed by count chunks by index*/
+struct pictdb_directory {
+    uint32_t		magic;			// PICTDB_CHUNKED
+    uint32_t		count;
+    uint64_t		indexes;		// offset of the stored indexes, 0 if none
+};
+
+/*start of the stored indexes, followed by the buckets of the pict_id index,
+ *then by those of the SHA index, as laid out in memory*/
+struct pictdb_indexes {
+    uint32_t		magic;			// PICTDB_INDEXES
+    uint32_t		db_version;		// version they match, 0 while written
+    uint64_t		buckets;		// buckets per index
 };
 
 /*structure of the metadata*/
@@ -78,11 +127,123 @@ struct pict_metadata {
     uint16_t		unused_16;
 };
 
-/*structure of the file*/
+/*in-memory open-addressing hash index from a metadata key to its index*/
+struct pict_index {
+    uint32_t*				buckets;	// metadata index + 1, 0 if empty
+    size_t					mask;		// number of buckets - 1
+    uint64_t*				dirty;		// blocks to store again, or NULL
+};
+
+/*copy of the indexes in the file of the database*/
+struct index_store {
+    uint64_t				offset;		// of the pictdb_indexes, 0 if none
+    uint64_t				buckets;	// buckets per index
+    uint32_t				stamp;		// db_version stamped in the file
+    int						valid;		// whether they match the metadata
+    int						stale;		// a log was replayed since
+};
+
+/*compact copy of the metadata fields that scans test, one entry per index,
+ *up to date for the valid pictures. Their validity is the free slot bitmap.*/
+struct metadata_mirror {
+    uint64_t*				id_hashes;		// hash of the pict_id, 0 until used
+    uint64_t*				sha_prefixes;	// first bytes of the SHA, 0 until used
+    uint64_t*				offsets;		// NB_RES per index
+    uint32_t*				sizes;			// NB_RES per index
+};
+
+/*in-memory bitmap of the empty metadata slots*/
+struct free_slots {
+    uint64_t*				bits;		// one set bit per empty slot
+    size_t					first;		// no empty slot in the words before
+};
+
+/*in-memory open-addressing table of the number of valid pictures that refer
+ *to each image of the data section, by offset*/
+struct extent_refs {
+    uint64_t*				offsets;	// 0 if empty
+    uint32_t*				counts;
+    size_t					mask;		// number of buckets - 1
+    size_t					count;		// number of images referred to
+};
+
+/*part of the data section that no valid picture refers to anymore*/
+struct free_extent {
+    uint64_t				offset;
+    uint64_t				size;
+    uint64_t				logged;		// log bytes to be durable before reuse
+    uint32_t				epoch;		// reader epoch when it was freed
+};
+
+/*free parts of the data section, filled by store_image before the file grows.
+ *
+ * An extent freed at epoch e is only reused from epoch e + 2 on. do_locate
+ * pins the current epoch until do_release_location, and the epoch only moves
+ * on when nobody holds a pin from two epochs before, so a location is never
+ * overwritten while it is being read.*/
+struct free_extents {
+    struct free_extent*		items;		// by offset, adjacent ones merged
+    size_t					count;
+    size_t					capacity;
+    uint64_t				bytes;		// total size of the items
+    uint32_t				epoch;
+    uint32_t				pins[2];	// pinned locations, by epoch parity
+    int						frozen;		// running garbage collections
+};
+
+struct pict_wal;
+struct pict_pager;
+struct pictdb_gc;
+
+/*metadata changed in memory and not written yet*/
+struct dirty_set {
+    uint64_t*				bits;		// one set bit per dirty metadata
+    size_t					first;		// no dirty metadata before this index
+    size_t					last;		// nor from this one on
+    int						header;		// whether the header is dirty
+};
+
+/*structure of the file
+ *
+ * do_list, do_locate and do_read take lock shared, so lookups and reads of
+ * existing resolutions run in parallel; do_insert, do_delete, do_gbcollect
+ * and the lazy creation of a resolution take it exclusively. The other
+ * functions of the library expect the caller to hold the lock.
+ *
+ * A garbage collection replaces fpdb by the compacted file and increments
+ * generation: offsets found before then must not be read from the new file.*/
 struct pictdb_file {
     FILE*					fpdb;
     struct pictdb_header	header;
     struct pict_metadata*	metadata;
+    struct pictdb_chunk*	chunks;		// where the metadata is in the file
+    size_t					chunk_count;
+    void*					map;		// mapping of header + metadata or NULL
+    size_t					map_size;
+    int						flags;		// OPEN_* flags given to do_open_ext
+    struct pict_index		id_index;
+    struct pict_index		sha_index;
+    struct index_store		stored;
+    struct free_slots		free_slots;
+    struct metadata_mirror	mirror;
+    struct extent_refs		refs;
+    struct free_extents		free_extents;
+    struct dirty_set		dirty;
+    struct pict_wal*		wal;		// log of the updates, with OPEN_WAL
+    struct pict_pager*		pager;		// resident metadata, with OPEN_PAGED
+    uint32_t				generation;	// number of times fpdb was replaced
+    pthread_rwlock_t		lock;		// initialized while fpdb is open
+};
+
+/*position of an image in the data section, as found by do_locate*/
+struct pict_location {
+    size_t					index;		// index of the picture in the metadata
+    uint32_t				db_version;	// version of the database at lookup
+    uint32_t				generation;	// generation of the file at lookup
+    uint32_t				epoch;		// reader epoch pinned by the lookup
+    uint64_t				offset;
+    uint32_t				size;
+    unsigned char			SHA[SHA256_DIGEST_LENGTH];	// SHA of the original
 };
 
 /*modes de fonctionnement pour do_list*/
@@ -141,6 +302,32 @@ int do_create(const char* db_filename, struct pictdb_file* db_file);
 int do_open(const char* db_filename, const char* open_mode,
             struct pictdb_file* db_file);
 
+/**
+ *  @brief  Opens and checks the database called db_filename and writes it to
+ *			db_file, with the options given in flags. With OPEN_MMAP, the
+ *			metadata is not copied in memory: db_file->metadata points into a
+ *			mapping of the file, shared with the other processes unless the
+ *			database is opened read-only, and writing metadata or header only
+ *			stores into the mapping (followed by an msync with OPEN_MMAP_SYNC).
+ *			With OPEN_WAL, which excludes OPEN_MMAP, updates are appended to a
+ *			log and made durable by group commits. A log left by a crash is
+ *			replayed in any case.
+ *			With OPEN_PAGED, which excludes the other flags, metadata is NULL
+ *			and no index is built: metadata is read a page at a time by
+ *			get_metadata, lookups scan the table page by page, and updates are
+ *			written through. Meant for a single thread doing a few lookups, it
+ *			only loads the whole table to replay a log.
+ *
+ *  @param  db_filename :   The name of the database
+ *  @param  open_mode :     The opening mode for the database
+ *  @param  flags :         A combination of the OPEN_* flags
+ *  @param  db_file :       The memory structure with header and metadata
+ *
+ *	@return An error code
+ */
+int do_open_ext(const char* db_filename, const char* open_mode, int flags,
+                struct pictdb_file* db_file);
+
 /**
  *  @brief  Checks whether open_mode is part of modes
  *
@@ -199,6 +386,88 @@ int write_header(struct pictdb_file* db_file, FILE* file, int modif,
  */
 int write_metadata(struct pictdb_file* db_file, FILE* file, int index);
 
+/**
+ *  @brief  Updates count consecutive image metadata starting at first in
+ *          db_file->fpdb, with a single write
+ *
+ *  @param  db_file :   The pictdb_file to edit
+ *  @param  file :      The file to write in
+ *  @param  first :     The index of the first metadata to update
+ *  @param  count :     The number of metadata to update
+ *
+ *  @return 0 if writing was successful, ERR_IO otherwise
+ */
+int write_metadata_range(struct pictdb_file* db_file, FILE* file,
+                         size_t first, size_t count);
+
+/**
+ *  @brief  Reads the chunk directory of db_file into db_file->chunks, or
+ *          makes the table after the header its only chunk if the database
+ *          is not chunked
+ *
+ *  @param  db_file :   The database, with its header read
+ *
+ *  @return An error code
+ */
+int load_chunks(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Returns the offset in the file of the metadata at index
+ *
+ *  @param  db_file :   The database
+ *  @param  index :     The index of the metadata
+ *
+ *  @return The offset of the metadata
+ */
+uint64_t metadata_offset(const struct pictdb_file* db_file, size_t index);
+
+/**
+ *  @brief  Updates the header of db_file in memory like write_header does, and
+ *			marks it to be written by the next flush_dirty
+ *
+ *  @param  db_file :   The pictdb_file to edit
+ *  @param  modif :     The amount of files added (negative value if files were
+ *  					removed)
+ *  @param  update :    Determines if the version number should be incremented
+ */
+void mark_header(struct pictdb_file* db_file, int modif, int update);
+
+/**
+ *  @brief  Marks the metadata at index in db_file to be written by the next
+ *			flush_dirty. The metadata is written right away if there is no
+ *			memory to track it.
+ *
+ *  @param  db_file :   The pictdb_file to edit
+ *  @param  index :     The index of the changed metadata
+ *
+ *  @return An error code
+ */
+int mark_metadata(struct pictdb_file* db_file, size_t index);
+
+/**
+ *  @brief  Writes the dirty header and metadata of db_file in place, in
+ *			increasing order and in as few writes as possible: dirty metadata
+ *			close to each other are written in a single run, along with the
+ *			clean ones in between, and so is the header with a run starting
+ *			near the first metadata.
+ *
+ *  @param  db_file :   The pictdb_file to write
+ *
+ *  @return 0 if writing was successful, ERR_IO otherwise
+ */
+int write_dirty(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Commits the dirty header and metadata of db_file: appends them to
+ *			its log if it has one, writes them in place with write_dirty
+ *			otherwise
+ *
+ *  @param  db_file :   The pictdb_file to write
+ *
+ *  @return An error code
+ */
+int flush_dirty(struct pictdb_file* db_file);
+
 /**
  *  @brief  Compares the two sha values
  *
@@ -219,6 +488,85 @@ int compare_sha(const unsigned char* sha1, const unsigned char* sha2);
  */
 int resolution_atoi(const char* string);
 
+/**
+ *  @brief  Locates the image of id id and resolution code in the data section
+ *			of db_file, without reading it. If the image does not exist in the
+ *			resolution yet, creates it and repercutes the changes to eventual
+ *			copies of the image. On success, the image cannot be overwritten by
+ *			a new one until the location is given to do_release_location.
+ *
+ *  @param  id :		The id of the picture we want to locate
+ *  @param  code :     	The code representing the resolution
+ *  @param  location :	The location of the image in the database file
+ *  @param  db_file :  	The file where the image is
+ *
+ *  @return An error code
+ */
+int do_locate(const char* id, int code, struct pict_location* location,
+              struct pictdb_file* db_file);
+
+/**
+ *  @brief  Releases a location found by do_locate once its image was read.
+ *			Doesn't need the lock of db_file.
+ *
+ *  @param  location :	The location of the image
+ *  @param  db_file :  	The file where the image is
+ */
+void do_release_location(const struct pict_location* location,
+                         struct pictdb_file* db_file);
+
+/**
+ *  @brief  Copies the metadata of the picture of id id in db_file, without
+ *			creating any resolution
+ *
+ *  @param  id :		The id of the picture
+ *  @param  metadata :	The copy of the metadata
+ *  @param  db_file :  	The file where the picture is
+ *
+ *  @return An error code
+ */
+int do_stat(const char* id, struct pict_metadata* metadata,
+            struct pictdb_file* db_file);
+
+/**
+ *  @brief  Creates the missing thumbnail and small resolutions of the picture
+ *			of id id. The picture is decoded once and resized without holding
+ *			the lock of db_file, so readers are not blocked in the meantime.
+ *
+ *  @param  id :		The id of the picture
+ *  @param  db_file :  	The file where the picture is
+ *
+ *  @return An error code
+ */
+int do_prepare_resolutions(const char* id, struct pictdb_file* db_file);
+
+/**
+ *  @brief  Reads the image found by do_locate at location into tab, unless
+ *			the database file was replaced by a garbage collection since
+ *
+ *  @param  location :	The location of the image
+ *  @param  tab :   	A tab of location->size bytes
+ *  @param  db_file :  	The file where the image is
+ *
+ *  @return An error code, ERR_MOVED if the image must be located again
+ */
+int do_read_location(const struct pict_location* location, char* tab,
+                     struct pictdb_file* db_file);
+
+/**
+ *  @brief  Duplicates the descriptor of the database file, so that the image
+ *			found by do_locate at location can be read without the lock,
+ *			unless the file was replaced by a garbage collection since
+ *
+ *  @param  location :	The location of the image
+ *  @param  fd :   		The descriptor to set, to be closed by the caller
+ *  @param  db_file :  	The file where the image is
+ *
+ *  @return An error code, ERR_MOVED if the image must be located again
+ */
+int do_open_location(const struct pict_location* location, int* fd,
+                     struct pictdb_file* db_file);
+
 /**
  *  @brief  Reads an image of index id, resoution code and size size in db_file
  *			and puts it in tab. If the image does not exist in the resolution
@@ -262,7 +610,8 @@ int do_insert(const char* tab, size_t size, char* pict_id,
 int get_file_size(FILE* file, size_t* size);
 
 /**
- *  @brief  Reads an image from file and stores it in tab.
+ *  @brief  Reads an image from file and stores it in tab. Several threads
+ *          may read from the same file concurrently.
  *
  *  @param  file :      The file to read into
  *  @param  tab :       A pointer to the array to store the image
@@ -275,7 +624,8 @@ int read_disk_image(FILE* file, char** tab, size_t size, size_t offset);
 
 /**
  *  @brief  Writes an image of size size to the end of file from tab. Writes
- *          the image's offset in offset
+ *          the image's offset in offset. The image is flushed, so that it can
+ *          be read back through the file descriptor of file.
  *
  *  @param  file :      The file to write into
  *  @param  tab :       An array to read the image into
@@ -286,6 +636,21 @@ int read_disk_image(FILE* file, char** tab, size_t size, size_t offset);
  */
 int write_disk_image(FILE* file, const char* tab, size_t size, size_t* offset);
 
+/**
+ *  @brief  Writes an image of size size to the data section of db_file, in a
+ *          free extent if one is large enough, at the end of the file
+ *          otherwise. db_file must be locked exclusively.
+ *
+ *  @param  db_file :   The database to write into
+ *  @param  tab :       The image
+ *  @param  size :      The size of the image
+ *  @param  offset :    The offset the image was written at
+ *
+ *  @return An error code
+ */
+int store_image(struct pictdb_file* db_file, const char* tab, size_t size,
+                size_t* offset);
+
 /**
  *  @brief  Creates a file name composed of an image name followed by a
  *			resolution name, the two split by a '_', and writes it into name.
@@ -312,10 +677,139 @@ int create_name(char** name, char* pictID, int code);
 size_t find_index(struct pictdb_file* db_file, const char* pict_id);
 
 /**
+ *  @brief  Returns the metadata at index of db_file, faulting its page in if
+ *			the database is paged. See pager_get for how long it stays valid.
+ *
+ *  @param  db_file :   The database
+ *  @param  index :     The index of the metadata, less than max_files
+ *
+ *  @return The metadata
+ */
+struct pict_metadata* get_metadata(struct pictdb_file* db_file, size_t index);
+
+/**
+ *  @brief  Finds the first empty index of db_file. Returns the index or -1 if
+ *			the database is full or NULL.
  *
+ *  @param  db_file :   The database to search into
+ *
+ *  @return The first empty index or -1 if there is none
+ */
+size_t find_free_slot(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Imports count image files into db_file. The files are read,
+ *          hashed and probed in parallel, then appended in batches with a
+ *          single header update at the end. A file that cannot be imported
+ *          doesn't stop the others.
+ *
+ *  @param  filenames : The names of the files to import
+ *  @param  pict_ids :  The ids to give to the pictures
+ *  @param  results :   The error code of the import of each file
+ *  @param  count :     The number of files
+ *  @param  imported :  The number of pictures imported
+ *  @param  db_file :   The database to import into
+ *
+ *  @return An error code, if the database itself could not be written
+ */
+int do_import(const char* const* filenames, const char* const* pict_ids,
+              int* results, size_t count, size_t* imported,
+              struct pictdb_file* db_file);
+
+/**
+ *  @brief  Starts an incremental garbage collection of db_file, the database
+ *			called filename, into a new file called tempname
+ *
+ *  @param  db_file :   The database to compact
+ *  @param  filename :	The name of the database
+ *  @param  tempname :	The name of the compacted file, until it replaces the
+ *						database
+ *  @param  gc :		The state of the garbage collection
+ *
+ *  @return An error code
+ */
+int gc_begin(struct pictdb_file* db_file, const char* filename,
+             const char* tempname, struct pictdb_gc** gc);
+
+/**
+ *  @brief  Copies the next images to the compacted file, byte for byte,
+ *			until about budget bytes were copied. The lock of the database is
+ *			only taken shared, so that it can still be read.
+ *
+ *  @param  gc :		The garbage collection
+ *  @param  budget :	The number of bytes to copy
+ *  @param  done :		Set once every image was copied
+ *
+ *  @return An error code
+ */
+int gc_step(struct pictdb_gc* gc, size_t budget, int* done);
+
+/**
+ *  @brief  Copies the images that changed during the steps, writes the
+ *			metadata and replaces the database by the compacted file, which
+ *			becomes the fpdb of the database. The lock of the database is
+ *			taken exclusively, for a time bounded by these changes. The
+ *			garbage collection is freed in any case.
+ *
+ *  @param  gc :		The garbage collection
+ *
+ *  @return An error code
+ */
+int gc_finish(struct pictdb_gc* gc);
+
+/**
+ *  @brief  Stops a garbage collection, removes the compacted file and frees it
+ *
+ *  @param  gc :		The garbage collection
+ */
+void gc_abort(struct pictdb_gc* gc);
+
+/**
+ *  @brief  Compacts db_file, the database called filename, through the
+ *			temporary file tempname, then closes it. The pictures keep their
+ *			index and their images are copied byte for byte.
+ *
+ *  @param  db_file :   The database to compact
+ *  @param  filename :	The name of the database
+ *  @param  tempname :	The name of the temporary file
+ *
+ *  @return An error code
  */
 int do_gbcollect(struct pictdb_file* db_file, const char* filename, const char* tempname);
 
+/**
+ *  @brief  Raises the maximum number of files of db_file to max_files. The
+ *			new metadata is appended as a chunk, so no image is moved, and
+ *			the database is in the PICTDB_CHUNKED format from then on. A
+ *			table mapped with OPEN_MMAP is copied to memory and unmapped. Not
+ *			available with OPEN_PAGED; fails with ERR_GC_RUNNING during a
+ *			garbage collection.
+ *
+ *  @param  db_file :	The database to grow
+ *  @param  max_files :	The new maximum number of files
+ *
+ *  @return An error code
+ */
+int do_grow(struct pictdb_file* db_file, uint32_t max_files);
+
+/**
+ *  @brief  Makes file, a copy of the database with the same metadata table,
+ *			the file of db_file: the metadata is mapped again with OPEN_MMAP,
+ *			file is renamed from tempname to filename, the current file is
+ *			closed and the generation is incremented. If anything fails,
+ *			db_file and its name are left as they were. db_file must be
+ *			locked exclusively.
+ *
+ *  @param  db_file :   The database
+ *  @param  file :		The new file of the database
+ *  @param  tempname :	The name of file
+ *  @param  filename :	The name of the database
+ *
+ *  @return An error code
+ */
+int swap_database_file(struct pictdb_file* db_file, FILE* file,
+                       const char* tempname, const char* filename);
+
 #ifdef __cplusplus
 }
 #endif
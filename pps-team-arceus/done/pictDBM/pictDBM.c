@@ -11,7 +11,10 @@
 #include "image_content.h"
 #include "pictDBM_tools.h"
 
-#define COMMAND_COUNT 7
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define COMMAND_COUNT 9
 
 typedef int (*command)(int, char**);
 
@@ -59,6 +62,14 @@ int help(int args, char *argv[])
     puts("\tgc <dbfilename> <tmp dbfilename>: performs garbage collecting on pictDB."
          " Requires a temporary filename for copying the pictDB.");
 
+    puts("\timport <dbfilename> <directory|listfilename>: insert the images of a"
+         " directory, or listed one per line in a file.");
+    puts("\t\teach picture is named after its file, without the extension.");
+
+    puts("\tgrow <dbfilename> <max_files>: raise the maximum number of files of"
+         " the pictDB.");
+    puts("\t\t\t\t\t\t\t\t\tmaximum value is 100000000");
+
     return 0;
 }
 
@@ -76,7 +87,7 @@ int do_list_cmd(int args, char *argv[])
     const char* filename = argv[1];
     struct pictdb_file myfile;
 
-    if ((ret = do_open(filename, "rb", &myfile))) {
+    if ((ret = do_open_ext(filename, "rb", OPEN_PAGED, &myfile))) {
         return ret;
     }
 
@@ -207,7 +218,7 @@ int do_read_cmd(int args, char *argv[])
         return ERR_INVALID_ARGUMENT;
     }
 
-    if ((ret = do_open(filename, "r+b", &myfile))) {
+    if ((ret = do_open_ext(filename, "r+b", OPEN_PAGED, &myfile))) {
         return ret;
     }
 
@@ -299,7 +310,7 @@ int do_delete_cmd(int args, char *argv[])
     size_t len = strlen(pictID);
     struct pictdb_file myfile;
 
-    if ((ret = do_open(filename, "rb+", &myfile))) {
+    if ((ret = do_open_ext(filename, "rb+", OPEN_PAGED, &myfile))) {
         return ret;
     }
 
@@ -337,6 +348,207 @@ int do_gc_cmd(int args, char *argv[])
     return ret;
 }
 
+/********************************************************************//**
+ * Compares two strings, for qsort
+ */
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/********************************************************************//**
+ * Adds a copy of name to the array files of size count and capacity capacity
+ */
+static int add_file(char*** files, size_t* count, size_t* capacity,
+                    const char* name)
+{
+    if (*count == *capacity) {
+        size_t new_capacity = *capacity ? 2 * *capacity : 64;
+        char** temp = realloc(*files, new_capacity * sizeof(char*));
+
+        if (temp == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        *files = temp;
+        *capacity = new_capacity;
+    }
+
+    if (((*files)[*count] = calloc(strlen(name) + 1, sizeof(char))) == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    strcpy((*files)[*count], name);
+    (*count)++;
+    return 0;
+}
+
+/********************************************************************//**
+ * Lists the regular files of the directory source, or the files listed one
+ * per line in the file source, into files
+ */
+static int list_import_files(const char* source, char*** files, size_t* count)
+{
+    struct stat info;
+    size_t capacity = 0;
+    int ret = 0;
+
+    *files = NULL;
+    *count = 0;
+
+    if (stat(source, &info)) {
+        return ERR_IO;
+    }
+
+    if (S_ISDIR(info.st_mode)) {
+        DIR* dir = opendir(source);
+        struct dirent* entry = NULL;
+
+        if (dir == NULL) {
+            return ERR_IO;
+        }
+
+        while (!ret && (entry = readdir(dir)) != NULL) {
+            char path[strlen(source) + strlen(entry->d_name) + 2];
+            sprintf(path, "%s/%s", source, entry->d_name);
+
+            if (entry->d_name[0] != '.' && !stat(path, &info) &&
+                S_ISREG(info.st_mode)) {
+                ret = add_file(files, count, &capacity, path);
+            }
+        }
+
+        closedir(dir);
+        qsort(*files, *count, sizeof(char*), compare_names);
+    } else {
+        FILE* list = fopen(source, "r");
+        char* line = NULL;
+        size_t size = 0;
+        ssize_t len = 0;
+
+        if (list == NULL) {
+            return ERR_IO;
+        }
+
+        while (!ret && (len = getline(&line, &size, list)) != -1) {
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+                line[--len] = '\0';
+            }
+
+            if (len > 0) {
+                ret = add_file(files, count, &capacity, line);
+            }
+        }
+
+        free(line);
+        fclose(list);
+    }
+
+    return ret;
+}
+
+/********************************************************************//**
+ * Names a picture after its file: the file name without its directory and
+ * extension, cut at MAX_PIC_ID characters
+ */
+static void import_pict_id(char* pict_id, const char* path)
+{
+    const char* name = strrchr(path, '/');
+    name = name == NULL ? path : name + 1;
+
+    strncpy(pict_id, name, MAX_PIC_ID);
+    pict_id[MAX_PIC_ID] = '\0';
+
+    char* dot = strrchr(pict_id, '.');
+    if (dot != NULL && dot != pict_id) {
+        *dot = '\0';
+    }
+}
+
+/********************************************************************//**
+ * Imports the images of a directory or of a list file and calls the
+ * do_import command
+ */
+int do_import_cmd(int args, char *argv[])
+{
+    if (args < 3) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* filename = argv[1];
+    char** files = NULL;
+    char (*pict_ids)[MAX_PIC_ID + 1] = NULL;
+    const char** ids = NULL;
+    int* results = NULL;
+    size_t count = 0;
+    size_t imported = 0;
+    struct pictdb_file myfile;
+    int ret = 0;
+
+    if (!(ret = list_import_files(argv[2], &files, &count)) &&
+        ((pict_ids = calloc(count + 1, sizeof(*pict_ids))) == NULL ||
+         (ids = calloc(count + 1, sizeof(char*))) == NULL ||
+         (results = calloc(count + 1, sizeof(int))) == NULL)) {
+        ret = ERR_OUT_OF_MEMORY;
+    }
+
+    if (!ret && !(ret = do_open(filename, "r+b", &myfile))) {
+        for (size_t i = 0; i < count; i++) {
+            import_pict_id(pict_ids[i], files[i]);
+            ids[i] = pict_ids[i];
+        }
+
+        ret = do_import((const char* const*) files, ids, results, count,
+                        &imported, &myfile);
+        do_close(&myfile);
+
+        for (size_t i = 0; i < count; i++) {
+            if (results[i]) {
+                fprintf(stderr, "%s: %s\n", files[i], ERROR_MESSAGES[results[i]]);
+            }
+        }
+
+        printf("%zu picture(s) imported\n", imported);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        free(files[i]);
+    }
+
+    free(files);
+    free(pict_ids);
+    free(ids);
+    free(results);
+    return ret;
+}
+
+/********************************************************************//**
+ * Raises the maximum number of files of the database with do_grow
+ */
+int do_grow_cmd(int args, char *argv[])
+{
+    if (args < 3) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* filename = argv[1];
+    const uint32_t max_files = atouint32(argv[2]);
+    int ret = 0;
+    struct pictdb_file myfile;
+
+    if (max_files == 0 || max_files > MAX_CHUNKED_FILES) {
+        return ERR_MAX_FILES;
+    }
+
+    if ((ret = do_open(filename, "rb+", &myfile))) {
+        return ret;
+    }
+
+    ret = do_grow(&myfile, max_files);
+    do_close(&myfile);
+    return ret;
+}
+
 /********************************************************************//**
  * MAIN
  */
@@ -353,8 +565,12 @@ int main(int argc, char* argv[])
     command_mapping insert =    {"insert",  do_insert_cmd};
     command_mapping delete =    {"delete",  do_delete_cmd};
     command_mapping gc =        {"gc",      do_gc_cmd};
+    command_mapping import =    {"import",  do_import_cmd};
+    command_mapping grow =      {"grow",    do_grow_cmd};
 
-    command_mapping commands[] = {helper, list, create, read, insert, delete, gc};
+    command_mapping commands[] = {helper, list, create, read, insert, delete, gc,
+                                  import, grow
+                                 };
 
     int ret = 0;
     argc--;
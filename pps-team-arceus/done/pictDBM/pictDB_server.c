@@ -4,93 +4,878 @@
  *
  * Picture Database Management Tool
  *
+ * The mongoose event loop only does the network I/O. Calls to the pictDB
+ * library are queued as jobs and run by a pool of worker threads, which
+ * prepare a reply. Once a job is done, its worker pushes it on the done list
+ * and wakes the event loop up with mg_broadcast(), and the event loop sends
+ * the reply to the connection, if it is still open. The library locks the
+ * database itself, so reads of existing images run on the workers in parallel.
+ *
+ * Thumbnails and small images are served from an LRU cache bounded by a byte
+ * budget. Originals are streamed from the database file with sendfile().
+ *
+ * With -eager, a resizer thread creates the thumbnail and small resolutions
+ * of every inserted picture in the background. Reads that come first create
+ * them on their own, as without it.
+ *
+ * With -wal, inserts and deletes are logged and acknowledged once durable.
+ * Updates made by concurrent workers are synced together.
+ *
+ * /pictDB/gc starts a garbage collection thread, which compacts the database
+ * in bounded steps while it is still served. Images located before the
+ * compacted file replaces the database are located again.
+ *
+ * /pictDB/grow?max_files=N raises the maximum number of files of the database
+ * with do_grow, which appends the new metadata without moving any image.
+ *
  * @date 22 May 2016
  */
 
-#include "pictDB.h"
-#include "libmongoose/mongoose.h"
+#include "pictDB.h"
+#include "pictDBM_tools.h"
+#include "libmongoose/mongoose.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#define POLL_DELTA_T 1000
+#define SENDFILE_POLL_T 5	// poll period while images are being streamed
+#define MAX_QUERY_PARAM 5
+#define MAX_WORKERS 64
+#define CACHE_BUCKETS 1024
+#define DEF_CACHE_MB 16		// default byte budget of the image cache, in MB
+#define ETAG_SIZE (2 * SHA256_DIGEST_LENGTH + 8)
+#define CACHE_CONTROL "public, no-cache"	// keep, but revalidate with the ETag
+#define URI_DELIM "&="
+#define GC_SUFFIX ".gc"
+#define GC_STEP_BYTES (4 << 20)	// bytes copied by a garbage collection step
+
+#define MG_F_JOB_PENDING MG_F_USER_1	// nc->user_data is a pending job
+
+static const char* s_http_port = "8000";
+static struct mg_serve_http_opts s_http_server_opts;
+static struct pictdb_file myfile;
+static int s_sig_received = 0;
+static int s_transfers = 0;
+
+/*image being streamed from the database file to a connection*/
+struct image_transfer {
+    int		fd;			// duplicate of the database file descriptor
+    off_t	offset;		// next byte to send
+    size_t	remaining;	// bytes left to send
+    struct pict_location	location;	// released once the image is sent
+};
+
+/*reply prepared by a request handler, sent by the event loop*/
+struct reply {
+    char*					head;		// status line, headers and short body
+    char*					body;		// binary body to send after head, or NULL
+    size_t					body_len;
+    struct image_transfer*	transfer;	// image to stream after head, or NULL
+};
+
+/*image kept in memory by the cache*/
+struct cache_entry {
+    size_t					index;		// index of the picture in the metadata
+    int						code;		// resolution of the image
+    char*					data;
+    size_t					size;
+    struct cache_entry*		newer;		// neighbours in the LRU order
+    struct cache_entry*		older;
+    struct cache_entry*		chain;		// next entry in the same bucket
+};
+
+/*picture waiting for its resolutions to be created*/
+struct resize_task {
+    char					pict_id[MAX_PIC_ID + 1];
+    struct resize_task*		next;
+};
+
+/*LRU cache of images, keyed by (index, code, db_version). All the entries
+ *belong to the same db_version: a newer version empties the cache.*/
+struct image_cache {
+    struct cache_entry*		buckets[CACHE_BUCKETS];
+    struct cache_entry*		newest;
+    struct cache_entry*		oldest;
+    uint32_t				db_version;
+    size_t					bytes;		// total size of the cached images
+    size_t					budget;		// maximum of bytes, 0 disables the cache
+    size_t					hits;
+    size_t					misses;
+};
+
+/*parts of an http request used by the handlers*/
+struct request {
+    struct mg_str			query;		// query string
+    struct mg_str			body;
+    struct mg_str			if_none_match;	// If-None-Match header, or empty
+};
+
+typedef void (*handler)(struct reply*, const struct request*);
+
+/*request handed over to the worker threads*/
+struct job {
+    handler					handle;
+    struct request			request;	// copy of the request
+    struct reply			reply;
+    struct mg_connection*	nc;			// NULL once the connection is closed
+    struct job*				next;
+};
+
+/*list of jobs protected by a mutex*/
+struct job_list {
+    struct job*		head;
+    struct job*		tail;
+};
+
+static struct mg_mgr s_mgr;
+static pthread_mutex_t s_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_jobs_cond = PTHREAD_COND_INITIALIZER;
+static struct job_list s_todo;
+static struct job_list s_done;
+static int s_stop_workers = 0;
+static size_t s_num_workers = 0;
+static size_t s_running_workers = 0;
+static pthread_t s_workers[MAX_WORKERS];
+static pthread_mutex_t s_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct image_cache s_cache;
+static pthread_mutex_t s_resize_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_resize_cond = PTHREAD_COND_INITIALIZER;
+static struct resize_task* s_resize_head = NULL;
+static struct resize_task* s_resize_tail = NULL;
+static int s_stop_resizer = 0;
+static int s_eager = 0;
+static pthread_t s_resizer;
+static pthread_mutex_t s_gc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int s_gc_running = 0;
+static int s_gc_joinable = 0;
+static int s_stop_gc = 0;
+static pthread_t s_gc_thread;
+static const char* s_db_filename = NULL;
+
+static void signal_handler(int sig_num)
+{
+    signal(sig_num, signal_handler);
+    s_sig_received = sig_num;
+}
+
+/**
+ *  @brief  Parses a sequence of characters into a sequence of characters readable by the program
+ *
+ *  @param  result :        The tab of "strings" which would be interpreted further
+ *  @param  tmp :    		Parts of the query string
+ * 	@param 	src :			Query string
+ * 	@param	delim :			Delimiters used to separate the strings
+ * 	@param	len :			Length of the query string
+ */
+void split (char* result[], char* tmp, const char* src, const char* delim, size_t len)
+{
+    strncpy(tmp, src, len);
+    tmp = strtok(tmp, delim);
+
+    for (int i = 0; i < MAX_QUERY_PARAM; i++) {
+        result[i] = tmp;
+        tmp = strtok(NULL, delim);
+    }
+}
+
+/**
+ *  @brief  Formats the head of a reply
+ *
+ *  @param  reply :         The reply to fill
+ *  @param  format :    	The printf format of the head
+ */
+static void reply_printf(struct reply* reply, const char* format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (len < 0 || (reply->head = calloc((size_t) len + 1, sizeof(char))) == NULL) {
+        return;
+    }
+
+    va_start(args, format);
+    vsnprintf(reply->head, (size_t) len + 1, format, args);
+    va_end(args);
+}
+
+/**
+ *  @brief  Prepares an error message in case of failure
+ *
+ *  @param  reply :         The reply to fill
+ *  @param  error :    		Type of error
+ */
+void reply_error(struct reply* reply, int error)
+{
+    reply_printf(reply, "HTTP/1.1 500\r\n"
+                 "ERROR: %s\n", ERROR_MESSAGES[error]);
+}
+
+/**
+ *  @brief  Ends the image transfer of a connection, if any
+ *
+ *  @param  nc :           	Message connection
+ */
+static void end_image_transfer(struct mg_connection* nc)
+{
+    struct image_transfer* transfer = (struct image_transfer*) nc->user_data;
+
+    if (transfer != NULL && !(nc->flags & MG_F_JOB_PENDING)) {
+        close(transfer->fd);
+        do_release_location(&transfer->location, &myfile);
+        free(transfer);
+        nc->user_data = NULL;
+        s_transfers--;
+    }
+}
+
+/**
+ *  @brief  Sends as much of the image being streamed to nc as the socket
+ * 			accepts. The HTTP headers queued by mongoose are sent first.
+ *
+ *  @param  nc :           	Message connection
+ */
+static void send_image_data(struct mg_connection* nc)
+{
+    struct image_transfer* transfer = (struct image_transfer*) nc->user_data;
+
+    if (transfer == NULL || (nc->flags & MG_F_JOB_PENDING) ||
+        nc->send_mbuf.len > 0) {
+        return;
+    }
+
+    while (transfer->remaining > 0) {
+        ssize_t sent = sendfile(nc->sock, transfer->fd, &transfer->offset,
+                                transfer->remaining);
+
+        if (sent <= 0) {
+            if (sent < 0 && (errno == EAGAIN || errno == EINTR)) {
+                return;
+            }
+            end_image_transfer(nc);
+            nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+            return;
+        }
+
+        transfer->remaining -= (size_t) sent;
+    }
+
+    end_image_transfer(nc);
+    nc->flags |= MG_F_SEND_AND_CLOSE;
+}
+
+/**
+ *  @brief  Sends a reply prepared by a handler and releases it
+ *
+ *  @param  nc :           	Message connection
+ *  @param  reply :    		The reply to send
+ */
+static void send_reply(struct mg_connection* nc, struct reply* reply)
+{
+    if (reply->head != NULL) {
+        mg_send(nc, reply->head, (int) strlen(reply->head));
+        free(reply->head);
+        reply->head = NULL;
+    }
+
+    if (reply->body != NULL) {
+        mg_send(nc, reply->body, (int) reply->body_len);
+        free(reply->body);
+        reply->body = NULL;
+    }
+
+    if (reply->transfer != NULL) {
+        nc->user_data = reply->transfer;
+        reply->transfer = NULL;
+        s_transfers++;
+        send_image_data(nc);
+    } else {
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+    }
+}
+
+/**
+ *  @brief  Releases a reply that could not be sent
+ *
+ *  @param  reply :    		The reply to release
+ */
+static void free_reply(struct reply* reply)
+{
+    free(reply->head);
+    reply->head = NULL;
+    free(reply->body);
+    reply->body = NULL;
+
+    if (reply->transfer != NULL) {
+        close(reply->transfer->fd);
+        do_release_location(&reply->transfer->location, &myfile);
+        free(reply->transfer);
+        reply->transfer = NULL;
+    }
+}
+
+/**
+ *  @brief  Returns the bucket of an image in the cache
+ *
+ *  @param  index :         The index of the picture
+ *  @param  code :    		The resolution of the image
+ *
+ *  @return The bucket
+ */
+static size_t cache_bucket(size_t index, int code)
+{
+    return (index * NB_RES + (size_t) code) % CACHE_BUCKETS;
+}
+
+/**
+ *  @brief  Removes an entry from the LRU order. The caller must hold
+ * 			s_cache_mutex.
+ *
+ *  @param  entry :         The entry to unlink
+ */
+static void cache_unlink(struct cache_entry* entry)
+{
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        s_cache.newest = entry->older;
+    }
+
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        s_cache.oldest = entry->newer;
+    }
+
+    entry->newer = entry->older = NULL;
+}
+
+/**
+ *  @brief  Puts an entry first in the LRU order. The caller must hold
+ * 			s_cache_mutex.
+ *
+ *  @param  entry :         The unlinked entry
+ */
+static void cache_push_newest(struct cache_entry* entry)
+{
+    entry->older = s_cache.newest;
+    entry->newer = NULL;
+
+    if (s_cache.newest != NULL) {
+        s_cache.newest->newer = entry;
+    } else {
+        s_cache.oldest = entry;
+    }
+
+    s_cache.newest = entry;
+}
+
+/**
+ *  @brief  Removes an entry from the cache and frees it. The caller must hold
+ * 			s_cache_mutex.
+ *
+ *  @param  entry :         The entry to remove
+ */
+static void cache_remove(struct cache_entry* entry)
+{
+    struct cache_entry** link = &s_cache.buckets[cache_bucket(entry->index,
+                                                              entry->code)];
+
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+
+    *link = entry->chain;
+    cache_unlink(entry);
+    s_cache.bytes -= entry->size;
+
+    free(entry->data);
+    free(entry);
+}
+
+/**
+ *  @brief  Empties the cache. The caller must hold s_cache_mutex.
+ */
+static void cache_clear(void)
+{
+    while (s_cache.oldest != NULL) {
+        cache_remove(s_cache.oldest);
+    }
+}
+
+/**
+ *  @brief  Checks that the entries of the cache belong to db_version, and
+ * 			empties it if db_version is newer. The caller must hold
+ * 			s_cache_mutex.
+ *
+ *  @param  db_version :    The version of the database at lookup
+ *
+ *  @return 1 if the cache can be used for this version, 0 if it is older
+ */
+static int cache_check_version(uint32_t db_version)
+{
+    if (db_version > s_cache.db_version) {
+        cache_clear();
+        s_cache.db_version = db_version;
+    }
+
+    return db_version == s_cache.db_version;
+}
+
+/**
+ *  @brief  Looks an image up in the cache and copies it into the body of reply
+ *
+ *  @param  reply :         The reply to fill
+ *  @param  location :    	The location of the image
+ *  @param  code :    		The resolution of the image
+ *
+ *  @return 1 if the image was found, 0 otherwise
+ */
+static int cache_get(struct reply* reply, const struct pict_location* location,
+                     int code)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&s_cache_mutex);
+
+    if (cache_check_version(location->db_version)) {
+        struct cache_entry* entry = s_cache.buckets[cache_bucket(location->index, code)];
+
+        while (entry != NULL &&
+               (entry->index != location->index || entry->code != code)) {
+            entry = entry->chain;
+        }
+
+        if (entry != NULL && (reply->body = malloc(entry->size)) != NULL) {
+            memcpy(reply->body, entry->data, entry->size);
+            reply->body_len = entry->size;
+
+            cache_unlink(entry);
+            cache_push_newest(entry);
+            found = 1;
+        }
+    }
+
+    if (found) {
+        s_cache.hits++;
+    } else {
+        s_cache.misses++;
+    }
+
+    pthread_mutex_unlock(&s_cache_mutex);
+    return found;
+}
+
+/**
+ *  @brief  Stores a copy of an image in the cache, evicting the least
+ * 			recently used images to stay within the byte budget
+ *
+ *  @param  location :    	The location of the image
+ *  @param  code :    		The resolution of the image
+ *  @param  data :    		The image
+ */
+static void cache_put(const struct pict_location* location, int code,
+                      const char* data)
+{
+    pthread_mutex_lock(&s_cache_mutex);
+
+    // entries of an older version must go before the lookup, or they hide
+    // the current image
+    const int current = cache_check_version(location->db_version);
+    const size_t bucket = cache_bucket(location->index, code);
+    struct cache_entry* entry = s_cache.buckets[bucket];
+
+    while (entry != NULL &&
+           (entry->index != location->index || entry->code != code)) {
+        entry = entry->chain;
+    }
+
+    if (current && entry == NULL && location->size <= s_cache.budget &&
+        (entry = calloc(1, sizeof(struct cache_entry))) != NULL) {
+        if ((entry->data = malloc(location->size)) == NULL) {
+            free(entry);
+        } else {
+            while (s_cache.bytes + location->size > s_cache.budget) {
+                cache_remove(s_cache.oldest);
+            }
+
+            memcpy(entry->data, data, location->size);
+            entry->index = location->index;
+            entry->code = code;
+            entry->size = location->size;
+            entry->chain = s_cache.buckets[bucket];
+            s_cache.buckets[bucket] = entry;
+            s_cache.bytes += entry->size;
+            cache_push_newest(entry);
+        }
+    }
+
+    pthread_mutex_unlock(&s_cache_mutex);
+}
+
+/**
+ *  @brief  Puts an image in the body of reply, from the cache if it is there,
+ * 			from the database file otherwise
+ *
+ *  @param  reply :         The reply to fill
+ *  @param  location :    	The location of the image
+ *  @param  code :    		The resolution of the image
+ *
+ *  @return An error code
+ */
+static int reply_cached_image(struct reply* reply,
+                              const struct pict_location* location, int code)
+{
+    int ret = 0;
+
+    if (cache_get(reply, location, code)) {
+        return 0;
+    }
+
+    if ((reply->body = calloc(location->size + 1, sizeof(char))) == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    if ((ret = do_read_location(location, reply->body, &myfile))) {
+        free(reply->body);
+        reply->body = NULL;
+        return ret;
+    }
+
+    reply->body_len = location->size;
+    cache_put(location, code, reply->body);
+    return 0;
+}
+
+/**
+ *  @brief  Prepares the streaming of an image from the database file to the
+ * 			connection. The location is released with the transfer, or at
+ * 			once if it cannot be prepared.
+ *
+ *  @param  reply :         The reply to fill
+ *  @param  location :    	The location of the image
+ *
+ *  @return An error code
+ */
+static int reply_image_transfer(struct reply* reply,
+                                const struct pict_location* location)
+{
+    struct image_transfer* transfer = calloc(1, sizeof(struct image_transfer));
+    int ret = 0;
+
+    if (transfer == NULL) {
+        ret = ERR_OUT_OF_MEMORY;
+    } else if ((ret = do_open_location(location, &transfer->fd, &myfile))) {
+        free(transfer);
+    }
+
+    if (ret) {
+        do_release_location(location, &myfile);
+        return ret;
+    }
+
+    transfer->offset = (off_t) location->offset;
+    transfer->remaining = location->size;
+    transfer->location = *location;
+    reply->transfer = transfer;
+    return 0;
+}
+
+/**
+ *  @brief  Queues a picture for the resizer thread, if it is running
+ *
+ *  @param  pict_id :       The id of the picture
+ */
+static void queue_resize(const char* pict_id)
+{
+    if (!s_eager) {
+        return;
+    }
+
+    struct resize_task* task = calloc(1, sizeof(struct resize_task));
+
+    if (task == NULL) {
+        // the resolutions will be created by the first read
+        return;
+    }
+
+    strncpy(task->pict_id, pict_id, MAX_PIC_ID);
+
+    pthread_mutex_lock(&s_resize_mutex);
+
+    if (s_resize_tail == NULL) {
+        s_resize_head = task;
+    } else {
+        s_resize_tail->next = task;
+    }
+
+    s_resize_tail = task;
+    pthread_cond_signal(&s_resize_cond);
+    pthread_mutex_unlock(&s_resize_mutex);
+}
+
+/**
+ *  @brief  Creates the resolutions of the queued pictures until the resizer
+ * 			is stopped
+ *
+ *  @param  arg :           Unused
+ *
+ *  @return NULL
+ */
+static void* resizer_main(void* arg)
+{
+    pthread_mutex_lock(&s_resize_mutex);
+
+    while (!s_stop_resizer) {
+        struct resize_task* task = s_resize_head;
+
+        if (task == NULL) {
+            pthread_cond_wait(&s_resize_cond, &s_resize_mutex);
+            continue;
+        }
+
+        if ((s_resize_head = task->next) == NULL) {
+            s_resize_tail = NULL;
+        }
+
+        pthread_mutex_unlock(&s_resize_mutex);
+
+        // the picture may have been deleted since: nothing to do then
+        do_prepare_resolutions(task->pict_id, &myfile);
+        free(task);
+
+        pthread_mutex_lock(&s_resize_mutex);
+    }
+
+    pthread_mutex_unlock(&s_resize_mutex);
+
+    vips_thread_shutdown();
+    return NULL;
+}
+
+/**
+ *  @brief  Starts the resizer thread
+ *
+ *  @return An error code
+ */
+static int start_resizer(void)
+{
+    if (pthread_create(&s_resizer, NULL, resizer_main, NULL)) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    s_eager = 1;
+    return 0;
+}
+
+/**
+ *  @brief  Stops the resizer thread, dropping the pictures still queued
+ */
+static void stop_resizer(void)
+{
+    if (!s_eager) {
+        return;
+    }
+
+    pthread_mutex_lock(&s_resize_mutex);
+    s_stop_resizer = 1;
+    pthread_cond_signal(&s_resize_cond);
+    pthread_mutex_unlock(&s_resize_mutex);
+
+    pthread_join(s_resizer, NULL);
+    s_eager = 0;
+
+    while (s_resize_head != NULL) {
+        struct resize_task* next = s_resize_head->next;
+        free(s_resize_head);
+        s_resize_head = next;
+    }
+
+    s_resize_tail = NULL;
+}
+
+/**
+ *  @brief  Body of the garbage collection thread: compacts the database step
+ *          by step, unless the server stops in the meantime
+ *
+ *  @param  arg :           Unused
+ *
+ *  @return NULL
+ */
+static void* gc_main(void* arg)
+{
+    (void) arg;
+
+    const size_t len = strlen(s_db_filename);
+    char tempname[len + sizeof(GC_SUFFIX)];
+    struct pictdb_gc* gc = NULL;
+    int done = 0;
+    int stop = 0;
+    int ret = 0;
+
+    strcpy(tempname, s_db_filename);
+    strcpy(tempname + len, GC_SUFFIX);
+
+    if (!(ret = gc_begin(&myfile, s_db_filename, tempname, &gc))) {
+        while (!ret && !done && !stop) {
+            ret = gc_step(gc, GC_STEP_BYTES, &done);
+
+            pthread_mutex_lock(&s_gc_mutex);
+            stop = s_stop_gc;
+            pthread_mutex_unlock(&s_gc_mutex);
+        }
+
+        if (ret || stop) {
+            gc_abort(gc);
+        } else {
+            ret = gc_finish(gc);
+        }
+    }
+
+    if (ret) {
+        fprintf(stderr, "Garbage collection: %s\n", ERROR_MESSAGES[ret]);
+    }
+
+    pthread_mutex_lock(&s_gc_mutex);
+    s_gc_running = 0;
+    pthread_mutex_unlock(&s_gc_mutex);
+
+    return NULL;
+}
+
+/**
+ *  @brief  Starts the garbage collection thread, unless it is already running
+ *
+ *  @return An error code
+ */
+static int start_gc(void)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&s_gc_mutex);
+
+    if (!s_gc_running) {
+        if (s_gc_joinable) {
+            pthread_join(s_gc_thread, NULL);
+            s_gc_joinable = 0;
+        }
+
+        if (pthread_create(&s_gc_thread, NULL, gc_main, NULL)) {
+            ret = ERR_OUT_OF_MEMORY;
+        } else {
+            s_gc_running = 1;
+            s_gc_joinable = 1;
+        }
+    }
 
-#define POLL_DELTA_T 1000
-#define MAX_QUERY_PARAM 5
-#define URI_DELIM "&="
+    pthread_mutex_unlock(&s_gc_mutex);
+    return ret;
+}
 
-static const char* s_http_port = "8000";
-static struct mg_serve_http_opts s_http_server_opts;
-static struct pictdb_file myfile;
-static int s_sig_received = 0;
-static void signal_handler(int sig_num)
+/**
+ *  @brief  Stops the garbage collection thread, if it is running. The
+ *          compacted file is dropped, unless the last step was reached.
+ */
+static void stop_gc(void)
 {
-    signal(sig_num, signal_handler);
-    s_sig_received = sig_num;
+    pthread_mutex_lock(&s_gc_mutex);
+    s_stop_gc = 1;
+    pthread_mutex_unlock(&s_gc_mutex);
+
+    if (s_gc_joinable) {
+        pthread_join(s_gc_thread, NULL);
+        s_gc_joinable = 0;
+    }
 }
 
 /**
- *  @brief  Parses a sequence of characters into a sequence of characters readable by the program
+ *  @brief  Formats the strong ETag of an image: the SHA of the original
+ * 			picture, in hexadecimal, followed by the resolution code
  *
- *  @param  result :        The tab of "strings" which would be interpreted further
- *  @param  tmp :    		Parts of the query string
- * 	@param 	src :			Query string
- * 	@param	delim :			Delimiters used to separate the strings
- * 	@param	len :			Length of the query string
+ *  @param  etag :          The string to write in, of size ETAG_SIZE
+ *  @param  SHA :    		The SHA of the picture
+ *  @param  code :    		The resolution of the image
  */
-void split (char* result[], char* tmp, const char* src, const char* delim, size_t len)
+static void format_etag(char* etag, const unsigned char* SHA, int code)
 {
-    strncpy(tmp, src, len);
-    tmp = strtok(tmp, delim);
+    etag[0] = '"';
 
-    for (int i = 0; i < MAX_QUERY_PARAM; i++) {
-        result[i] = tmp;
-        tmp = strtok(NULL, delim);
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        sprintf(&etag[1 + 2 * i], "%02x", SHA[i]);
     }
+
+    snprintf(&etag[1 + 2 * SHA256_DIGEST_LENGTH], ETAG_SIZE - 1 -
+             2 * SHA256_DIGEST_LENGTH, "-%d\"", code);
 }
 
 /**
- *  @brief  Sends an error message in case of failure
+ *  @brief  Checks whether an If-None-Match header matches etag
  *
- *  @param  nc :           	Message connection
- *  @param  error :    		Type of error
+ *  @param  header :        The value of the header
+ *  @param  etag :    		The ETag of the image
+ *
+ *  @return 1 if the client already has the image, 0 otherwise
  */
-void mg_error(struct mg_connection* nc, int error)
+static int etag_matches(const struct mg_str* header, const char* etag)
 {
-    mg_printf(nc, "HTTP/1.1 500\r\n"
-              "ERROR: %s\n", ERROR_MESSAGES[error]);
-    mg_send(nc, "", 0);
+    const size_t len = strlen(etag);
+
+    if (header->len == 1 && header->p[0] == '*') {
+        return 1;
+    }
+
+    // the header is a list of ETags, possibly weak ones
+    for (size_t i = 0; i + len <= header->len; i++) {
+        if (!memcmp(&header->p[i], etag, len)) {
+            return 1;
+        }
+    }
+
+    return 0;
 }
 
 /**
  *  @brief  Prints the list of pictures contained in our database
  *
- *  @param  nc :           	Message connection
- *  @param  hm :    		Http message received
+ *  @param  reply :         The reply to fill
+ *  @param  request :    	The request
  */
-void handle_list_call(struct mg_connection* nc, struct http_message* hm)
+void handle_list_call(struct reply* reply, const struct request* request)
 {
     char* printer = do_list(&myfile, JSON);
 
     if (printer != NULL) {
-        mg_printf(nc, "HTTP/1.1 200 OK\r\n"
-                  "Content-Type: application/json\r\n"
-                  "Content-Length: %zu\r\n\r\n%s",
-                  strlen(printer), printer);
-        mg_send_http_chunk(nc, "", 0);
+        reply_printf(reply, "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: application/json\r\n"
+                     "Content-Length: %zu\r\n\r\n%s",
+                     strlen(printer), printer);
         free(printer);
     }
 }
 
 /**
  *  @brief  Reads an image in our database. Used to print the image on the screen and to quickly
- * 			compute the thumb image associated to the image.
+ * 			compute the thumb image associated to the image. Thumbnails and small
+ * 			images are served from the image cache, the other images are streamed
+ * 			from the database file to the socket with sendfile. Clients that
+ * 			already have the image get a 304 reply, without the image being
+ * 			created or read.
  *
- *  @param  nc :           	Message connection
- *  @param  hm :    		Http message received
+ *  @param  reply :         The reply to fill
+ *  @param  request :    	The request
  */
-void handle_read_call(struct mg_connection* nc, struct http_message* hm)
+void handle_read_call(struct reply* reply, const struct request* request)
 {
-    size_t size = 0;
-    size_t len = hm->query_string.len;
+    size_t len = request->query.len;
     char tmp[len + 1];
-    char pict_id[MAX_PIC_ID + 1];
-    char* tab = NULL;
+    char pict_id[MAX_PIC_ID + 1] = "";
     char* result[MAX_QUERY_PARAM];
     int code = RES_ORIG;
     int ret = 0;
@@ -98,15 +883,15 @@ void handle_read_call(struct mg_connection* nc, struct http_message* hm)
     int res_set = 0;
 
     tmp[len] = '\0';
-    split(result, tmp, hm->query_string.p, URI_DELIM, len);
+    split(result, tmp, request->query.p, URI_DELIM, len);
 
     for (int i = 0; i < MAX_QUERY_PARAM - 1 && result[i] != NULL; i++) {
         if (result[i + 1] == NULL) {
-            mg_error(nc, ERR_NOT_ENOUGH_ARGUMENTS);
+            reply_error(reply, ERR_NOT_ENOUGH_ARGUMENTS);
             return;
         } else if (!strcmp(result[i], "pict_id")) {
             if (pict_id_set) {
-                mg_error(nc, ERR_INVALID_ARGUMENT);
+                reply_error(reply, ERR_INVALID_ARGUMENT);
                 return;
             }
 
@@ -116,7 +901,7 @@ void handle_read_call(struct mg_connection* nc, struct http_message* hm)
             pict_id_set = 1;
         } else if (!strcmp(result[i], "res")) {
             if (res_set) {
-                mg_error(nc, ERR_INVALID_ARGUMENT);
+                reply_error(reply, ERR_INVALID_ARGUMENT);
                 return;
             }
 
@@ -126,27 +911,57 @@ void handle_read_call(struct mg_connection* nc, struct http_message* hm)
         }
     }
 
-    if ((ret = do_read(pict_id, code, &tab, (uint32_t*) (&size), &myfile))) {
-        mg_error(nc, ret);
-        return;
+    struct pict_location location;
+    char etag[ETAG_SIZE];
+
+    if (request->if_none_match.len > 0 && code >= 0 && code < NB_RES) {
+        struct pict_metadata metadata;
+
+        if (!do_stat(pict_id, &metadata, &myfile)) {
+            format_etag(etag, metadata.SHA, code);
+
+            if (etag_matches(&request->if_none_match, etag)) {
+                reply_printf(reply, "HTTP/1.1 304 Not Modified\r\n"
+                             "ETag: %s\r\n"
+                             "Cache-Control: %s\r\n\r\n",
+                             etag, CACHE_CONTROL);
+                return;
+            }
+        }
     }
 
-    mg_printf(nc, "HTTP/1.1 200 OK\r\n"
-              "Content-Type: image/jpeg\r\n"
-              "Content-Length: %zu\r\n\r\n",
-              size);
-    mg_send(nc, (void*) tab, size);
+    do {
+        if (!(ret = do_locate(pict_id, code, &location, &myfile))) {
+            if (code != RES_ORIG && s_cache.budget > 0) {
+                ret = reply_cached_image(reply, &location, code);
+                do_release_location(&location, &myfile);
+            } else {
+                ret = reply_image_transfer(reply, &location);
+            }
+        }
+    } while (ret == ERR_MOVED);
+
+    if (ret) {
+        reply_error(reply, ret);
+        return;
+    }
 
-    free(tab);
+    format_etag(etag, location.SHA, code);
+    reply_printf(reply, "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: image/jpeg\r\n"
+                 "Content-Length: %" PRIu32 "\r\n"
+                 "ETag: %s\r\n"
+                 "Cache-Control: %s\r\n\r\n",
+                 location.size, etag, CACHE_CONTROL);
 }
 
 /**
  *  @brief  Inserts an image in the database
  *
- *  @param  nc :           	Message connection
- *  @param  hm :    		Http message received
+ *  @param  reply :         The reply to fill
+ *  @param  request :    	The request
  */
-void handle_insert_call(struct mg_connection* nc, struct http_message* hm)
+void handle_insert_call(struct reply* reply, const struct request* request)
 {
     size_t image_size;
     char name[MAX_PIC_ID + 1];
@@ -154,70 +969,370 @@ void handle_insert_call(struct mg_connection* nc, struct http_message* hm)
     int ret = 0;
     const char* image;
 
-    mg_parse_multipart(hm->body.p, hm->body.len, dummy, MAX_PIC_ID, name, MAX_PIC_ID, &image, &image_size);
+    mg_parse_multipart(request->body.p, request->body.len, dummy, MAX_PIC_ID, name, MAX_PIC_ID, &image, &image_size);
     name[MAX_PIC_ID] = '\0';
 
-    if ((ret = do_insert((const char*) image, image_size, name, &myfile))) {
-        mg_error(nc, ret);
+    ret = do_insert((const char*) image, image_size, name, &myfile);
+
+    if (ret) {
+        reply_error(reply, ret);
         return;
     }
 
-    mg_printf(nc, "HTTP/1.1 302 Found\r\n"
-              "Location: http://localhost:%s/index.html\r\n\r\n",
-              s_http_port);
-    mg_send(nc, "", 0);
+    queue_resize(name);
+
+    reply_printf(reply, "HTTP/1.1 302 Found\r\n"
+                 "Location: http://localhost:%s/index.html\r\n\r\n",
+                 s_http_port);
 }
 
 /**
  *  @brief  Deletes an image from the database
  *
- *  @param  nc :           	Message connection
- *  @param  hm :    		Http message received
+ *  @param  reply :         The reply to fill
+ *  @param  request :    	The request
  */
-void handle_delete_call(struct mg_connection* nc, struct http_message* hm)
+void handle_delete_call(struct reply* reply, const struct request* request)
 {
-    size_t len = hm->query_string.len;
+    size_t len = request->query.len;
     char tmp[len + 1];
-    char pict_id[MAX_PIC_ID + 1];
+    char pict_id[MAX_PIC_ID + 1] = "";
     char* result[MAX_QUERY_PARAM];
     int ret = 0;
     int pict_id_set = 0;
 
     tmp[len] = '\0';
-    split(result, tmp, hm->query_string.p, URI_DELIM, len);
+    split(result, tmp, request->query.p, URI_DELIM, len);
 
     for (int i = 0; i < MAX_QUERY_PARAM - 1 && result[i] != NULL; i++) {
         if (!strcmp(result[i], "pict_id")) {
             if (pict_id_set) {
-                mg_error(nc, ERR_INVALID_ARGUMENT);
+                reply_error(reply, ERR_INVALID_ARGUMENT);
                 return;
             }
 
-            if (!strlen(result[i + 1])) {
-                mg_error(nc, ERR_NOT_ENOUGH_ARGUMENTS);
+            if (result[i + 1] == NULL || !strlen(result[i + 1])) {
+                reply_error(reply, ERR_NOT_ENOUGH_ARGUMENTS);
                 return;
             }
 
-            strcpy(pict_id, result[i + 1]);
+            strncpy(pict_id, result[i + 1], MAX_PIC_ID);
             pict_id[MAX_PIC_ID] = '\0';
             i++;
             pict_id_set = 1;
         }
     }
 
-    if ((ret = do_delete(pict_id, &myfile))) {
-        mg_error(nc, ret);
+    ret = do_delete(pict_id, &myfile);
+
+    if (ret) {
+        reply_error(reply, ret);
+        return;
+    }
+
+    reply_printf(reply, "HTTP/1.1 302 Found\r\n"
+                 "Location: http://localhost:%s/index.html\r\n\r\n",
+                 s_http_port);
+}
+
+/**
+ *  @brief  Starts a garbage collection of the database in the background
+ *
+ *  @param  reply :         The reply to fill
+ *  @param  request :    	The request
+ */
+void handle_gc_call(struct reply* reply, const struct request* request)
+{
+    (void) request;
+
+    int ret = 0;
+
+    if ((ret = start_gc())) {
+        reply_error(reply, ret);
+        return;
+    }
+
+    reply_printf(reply, "HTTP/1.1 302 Found\r\n"
+                 "Location: http://localhost:%s/index.html\r\n\r\n",
+                 s_http_port);
+}
+
+/**
+ *  @brief  Raises the maximum number of files of the database
+ *
+ *  @param  reply :         The reply to fill
+ *  @param  request :    	The request
+ */
+void handle_grow_call(struct reply* reply, const struct request* request)
+{
+    size_t len = request->query.len;
+    char tmp[len + 1];
+    char* result[MAX_QUERY_PARAM];
+    uint32_t max_files = 0;
+    int max_files_set = 0;
+    int ret = 0;
+
+    tmp[len] = '\0';
+    split(result, tmp, request->query.p, URI_DELIM, len);
+
+    for (int i = 0; i < MAX_QUERY_PARAM - 1 && result[i] != NULL; i++) {
+        if (!strcmp(result[i], "max_files")) {
+            if (max_files_set) {
+                reply_error(reply, ERR_INVALID_ARGUMENT);
+                return;
+            }
+
+            if (result[i + 1] == NULL || !strlen(result[i + 1])) {
+                reply_error(reply, ERR_NOT_ENOUGH_ARGUMENTS);
+                return;
+            }
+
+            max_files = atouint32(result[i + 1]);
+            i++;
+            max_files_set = 1;
+        }
+    }
+
+    if (!max_files_set) {
+        reply_error(reply, ERR_NOT_ENOUGH_ARGUMENTS);
+        return;
+    }
+
+    if ((ret = do_grow(&myfile, max_files))) {
+        reply_error(reply, ret);
+        return;
+    }
+
+    reply_printf(reply, "HTTP/1.1 302 Found\r\n"
+                 "Location: http://localhost:%s/index.html\r\n\r\n",
+                 s_http_port);
+}
+
+/**
+ *  @brief  Appends a job to a list. The caller must hold s_jobs_mutex.
+ *
+ *  @param  list :          The list to append to
+ *  @param  job :    		The job to append
+ */
+static void push_job(struct job_list* list, struct job* job)
+{
+    job->next = NULL;
+
+    if (list->tail == NULL) {
+        list->head = job;
+    } else {
+        list->tail->next = job;
+    }
+
+    list->tail = job;
+}
+
+/**
+ *  @brief  Removes the first job of a list. The caller must hold s_jobs_mutex.
+ *
+ *  @param  list :          The list to pop from
+ *
+ *  @return The first job, or NULL if the list is empty
+ */
+static struct job* pop_job(struct job_list* list)
+{
+    struct job* job = list->head;
+
+    if (job != NULL) {
+        list->head = job->next;
+        if (list->head == NULL) {
+            list->tail = NULL;
+        }
+    }
+
+    return job;
+}
+
+/**
+ *  @brief  Releases a job and its copies of the request
+ *
+ *  @param  job :    		The job to release
+ */
+static void free_job(struct job* job)
+{
+    free_reply(&job->reply);
+    free((char*) job->request.query.p);
+    free((char*) job->request.body.p);
+    free((char*) job->request.if_none_match.p);
+    free(job);
+}
+
+/**
+ *  @brief  Copies a mongoose string, so that it outlives the request
+ *
+ *  @param  dest :          The copy
+ *  @param  src :    		The string to copy
+ *
+ *  @return An error code
+ */
+static int copy_mg_str(struct mg_str* dest, const struct mg_str* src)
+{
+    char* p = calloc(src->len + 1, sizeof(char));
+
+    if (p == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    if (src->len > 0) {
+        memcpy(p, src->p, src->len);
+    }
+    dest->p = p;
+    dest->len = src->len;
+    return 0;
+}
+
+/**
+ *  @brief  Copies a request, so that it outlives the http message
+ *
+ *  @param  dest :          The copy
+ *  @param  src :    		The request to copy
+ *
+ *  @return An error code
+ */
+static int copy_request(struct request* dest, const struct request* src)
+{
+    int ret = 0;
+
+    if ((ret = copy_mg_str(&dest->query, &src->query)) ||
+        (ret = copy_mg_str(&dest->body, &src->body)) ||
+        (ret = copy_mg_str(&dest->if_none_match, &src->if_none_match))) {
+        return ret;
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Does nothing: mg_broadcast() is only used to wake the event loop
+ *
+ *  @param  nc :           	Message connection
+ *  @param  ev :    		Event
+ * 	@param	ev_data :		Message
+ */
+static void wake_handler(struct mg_connection* nc, int ev, void* ev_data)
+{
+}
+
+/**
+ *  @brief  Runs queued jobs until the workers are stopped
+ *
+ *  @param  arg :           Unused
+ *
+ *  @return NULL
+ */
+static void* worker_main(void* arg)
+{
+    pthread_mutex_lock(&s_jobs_mutex);
+
+    while (!s_stop_workers) {
+        struct job* job = pop_job(&s_todo);
+
+        if (job == NULL) {
+            pthread_cond_wait(&s_jobs_cond, &s_jobs_mutex);
+            continue;
+        }
+
+        pthread_mutex_unlock(&s_jobs_mutex);
+        job->handle(&job->reply, &job->request);
+        pthread_mutex_lock(&s_jobs_mutex);
+
+        push_job(&s_done, job);
+
+        pthread_mutex_unlock(&s_jobs_mutex);
+        mg_broadcast(&s_mgr, wake_handler, "", 1);
+        pthread_mutex_lock(&s_jobs_mutex);
+    }
+
+    s_running_workers--;
+    pthread_mutex_unlock(&s_jobs_mutex);
+
+    vips_thread_shutdown();
+    return NULL;
+}
+
+/**
+ *  @brief  Sends the replies of the jobs done by the workers. Called by the
+ * 			event loop only.
+ */
+static void deliver_done_jobs(void)
+{
+    pthread_mutex_lock(&s_jobs_mutex);
+    struct job* job = s_done.head;
+    s_done.head = s_done.tail = NULL;
+    pthread_mutex_unlock(&s_jobs_mutex);
+
+    while (job != NULL) {
+        struct job* next = job->next;
+
+        if (job->nc != NULL) {
+            job->nc->flags &= ~MG_F_JOB_PENDING;
+            job->nc->user_data = NULL;
+            send_reply(job->nc, &job->reply);
+        }
+
+        free_job(job);
+        job = next;
+    }
+}
+
+/**
+ *  @brief  Runs a library call for a connection, on a worker thread if there
+ * 			are any, or right away otherwise
+ *
+ *  @param  nc :           	Message connection
+ *  @param  hm :    		Http message received
+ *  @param  handle :    	The handler of the call
+ */
+static void dispatch(struct mg_connection* nc, struct http_message* hm,
+                     handler handle)
+{
+    struct mg_str* etag = mg_get_http_header(hm, "If-None-Match");
+    struct request request = {hm->query_string, hm->body, {NULL, 0}};
+
+    if (etag != NULL) {
+        request.if_none_match = *etag;
+    }
+
+    if (s_num_workers == 0) {
+        struct reply reply = {NULL, NULL, 0, NULL};
+        handle(&reply, &request);
+        send_reply(nc, &reply);
+        return;
+    }
+
+    struct job* job = calloc(1, sizeof(struct job));
+
+    if (job == NULL || copy_request(&job->request, &request)) {
+        struct reply reply = {NULL, NULL, 0, NULL};
+
+        if (job != NULL) {
+            free_job(job);
+        }
+
+        reply_error(&reply, ERR_OUT_OF_MEMORY);
+        send_reply(nc, &reply);
         return;
     }
 
-    mg_printf(nc, "HTTP/1.1 302 Found\r\n"
-              "Location: http://localhost:%s/index.html\r\n\r\n",
-              s_http_port);
-    mg_send(nc, "", 0);
+    job->handle = handle;
+    job->nc = nc;
+    nc->user_data = job;
+    nc->flags |= MG_F_JOB_PENDING;
+
+    pthread_mutex_lock(&s_jobs_mutex);
+    push_job(&s_todo, job);
+    pthread_cond_signal(&s_jobs_cond);
+    pthread_mutex_unlock(&s_jobs_mutex);
 }
 
 /**
- *  @brief  Handles the last http message received : List, Read, Insert, Delete
+ *  @brief  Handles the last http message received : List, Read, Insert, Delete,
+ *			Gc, Grow
  *
  *  @param  nc :           	Message connection
  *  @param  ev :    		Integer describing the event: In that case we want a Http message
@@ -230,26 +1345,96 @@ static void ev_handler(struct mg_connection* nc, int ev, void* ev_data)
     switch (ev) {
     case MG_EV_HTTP_REQUEST:
         if (mg_vcmp(&hm->uri, "/pictDB/list") == 0) {
-            handle_list_call(nc, hm);
-            nc->flags |= MG_F_SEND_AND_CLOSE;
+            dispatch(nc, hm, handle_list_call);
         } else if (mg_vcmp(&hm->uri, "/pictDB/read") == 0) {
-            handle_read_call(nc, hm);
-            nc->flags |= MG_F_SEND_AND_CLOSE;
+            dispatch(nc, hm, handle_read_call);
         } else if (mg_vcmp(&hm->uri, "/pictDB/insert") == 0) {
-            handle_insert_call(nc, hm);
-            nc->flags |= MG_F_SEND_AND_CLOSE;
+            dispatch(nc, hm, handle_insert_call);
         } else if (mg_vcmp(&hm->uri, "/pictDB/delete") == 0) {
-            handle_delete_call(nc, hm);
-            nc->flags |= MG_F_SEND_AND_CLOSE;
+            dispatch(nc, hm, handle_delete_call);
+        } else if (mg_vcmp(&hm->uri, "/pictDB/gc") == 0) {
+            dispatch(nc, hm, handle_gc_call);
+        } else if (mg_vcmp(&hm->uri, "/pictDB/grow") == 0) {
+            dispatch(nc, hm, handle_grow_call);
         } else {
             mg_serve_http(nc, hm, s_http_server_opts);
         }
         break;
+    case MG_EV_POLL:
+    case MG_EV_SEND:
+        send_image_data(nc);
+        break;
+    case MG_EV_CLOSE:
+        if (nc->flags & MG_F_JOB_PENDING) {
+            // the worker still owns the job, its reply will be dropped
+            ((struct job*) nc->user_data)->nc = NULL;
+            nc->user_data = NULL;
+            nc->flags &= ~MG_F_JOB_PENDING;
+        }
+        end_image_transfer(nc);
+        break;
     default:
         break;
     }
 }
 
+/**
+ *  @brief  Starts the worker threads
+ *
+ *  @param  count :         The number of workers to start
+ *
+ *  @return An error code
+ */
+static int start_workers(size_t count)
+{
+    for (s_num_workers = 0; s_num_workers < count; s_num_workers++) {
+        pthread_mutex_lock(&s_jobs_mutex);
+        s_running_workers++;
+        pthread_mutex_unlock(&s_jobs_mutex);
+
+        if (pthread_create(&s_workers[s_num_workers], NULL, worker_main, NULL)) {
+            pthread_mutex_lock(&s_jobs_mutex);
+            s_running_workers--;
+            pthread_mutex_unlock(&s_jobs_mutex);
+            return ERR_OUT_OF_MEMORY;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Stops the worker threads. The event loop keeps polling until they
+ * 			have all exited, since a worker may be waiting in mg_broadcast().
+ */
+static void stop_workers(void)
+{
+    pthread_mutex_lock(&s_jobs_mutex);
+    s_stop_workers = 1;
+    pthread_cond_broadcast(&s_jobs_cond);
+    pthread_mutex_unlock(&s_jobs_mutex);
+
+    size_t running = 0;
+
+    do {
+        mg_mgr_poll(&s_mgr, SENDFILE_POLL_T);
+        pthread_mutex_lock(&s_jobs_mutex);
+        running = s_running_workers;
+        pthread_mutex_unlock(&s_jobs_mutex);
+    } while (running > 0);
+
+    for (size_t i = 0; i < s_num_workers; i++) {
+        pthread_join(s_workers[i], NULL);
+    }
+
+    deliver_done_jobs();
+
+    struct job* job = NULL;
+    while ((job = pop_job(&s_todo)) != NULL) {
+        free_job(job);
+    }
+}
+
 /********************************************************************//**
  * MAIN
  */
@@ -259,15 +1444,14 @@ int main(int argc, char* argv[])
         vips_error_exit("unable to start VIPS");
     }
 
-    struct mg_mgr mgr;
     struct mg_connection *nc;
 
     signal(SIGTERM, signal_handler);
     signal(SIGINT, signal_handler);
 
-    mg_mgr_init(&mgr, 0);
+    mg_mgr_init(&s_mgr, 0);
 
-    nc = mg_bind(&mgr, s_http_port, ev_handler);
+    nc = mg_bind(&s_mgr, s_http_port, ev_handler);
 
     if (nc == NULL) {
         printf("Unable to start listener at %s\n", s_http_port);
@@ -279,25 +1463,72 @@ int main(int argc, char* argv[])
     argv++;
 
     const char* filename = argv[0];
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t cache_mb = DEF_CACHE_MB;
+    int eager = 0;
+    int flags = OPEN_MMAP;
 
     if (argc < 1) {
         ret = ERR_NOT_ENOUGH_ARGUMENTS;
     }
 
+    for (int i = 1; !ret && i < argc; i++) {
+        if (!strcmp(argv[i], "-workers") && i + 1 < argc) {
+            workers = atouint16(argv[++i]);
+            if (workers == 0 && strcmp(argv[i], "0")) {
+                ret = ERR_INVALID_ARGUMENT;
+            }
+        } else if (!strcmp(argv[i], "-eager")) {
+            eager = 1;
+        } else if (!strcmp(argv[i], "-wal")) {
+            flags = OPEN_WAL;
+        } else if (!strcmp(argv[i], "-cache") && i + 1 < argc) {
+            cache_mb = atouint32(argv[++i]);
+            if (cache_mb == 0 && strcmp(argv[i], "0")) {
+                ret = ERR_INVALID_ARGUMENT;
+            }
+        } else {
+            ret = ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    if (workers < 0) {
+        workers = 0;
+    } else if (workers > MAX_WORKERS) {
+        workers = MAX_WORKERS;
+    }
+
     if (!ret &&
-        !(ret = do_open(filename, "r+b", &myfile))) {
+        !(ret = do_open_ext(filename, "r+b", flags, &myfile))) {
         print_header(&(myfile.header));
+        s_db_filename = filename;
         mg_set_protocol_http_websocket(nc);
+        s_cache.budget = (size_t) cache_mb << 20;
+        s_cache.db_version = myfile.header.db_version;
 
-        while (!s_sig_received) {
-            mg_mgr_poll(&mgr, POLL_DELTA_T);
+        if (!(ret = start_workers((size_t) workers)) && eager) {
+            ret = start_resizer();
         }
 
-        printf("Exiting on signal %d\n", s_sig_received);
+        if (!ret) {
+            while (!s_sig_received) {
+                mg_mgr_poll(&s_mgr, s_transfers > 0 ? SENDFILE_POLL_T : POLL_DELTA_T);
+                deliver_done_jobs();
+            }
+
+            printf("Exiting on signal %d\n", s_sig_received);
+        }
 
-        mg_mgr_free(&mgr);
+        stop_workers();
+        stop_resizer();
+        stop_gc();
+        printf("Image cache: %zu hits, %zu misses\n", s_cache.hits, s_cache.misses);
+        cache_clear();
+        mg_mgr_free(&s_mgr);
         do_close(&myfile);
-    } else {
+    }
+
+    if (ret) {
         fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ret]);
     }
 
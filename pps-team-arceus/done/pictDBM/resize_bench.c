@@ -0,0 +1,155 @@
+/**
+ * @file resize_bench.c
+ * @brief pictDB benchmark: latency and memory of resize_images
+ *
+ * Makes the thumbnail and small resolutions of each image given, as the
+ * resizer does for a new picture, and prints the mean time per image and
+ * the peak resident memory of the process. The Makefile links it twice:
+ * resize_bench shrinks the JPEGs while decoding them when libvips can,
+ * resize_bench_decode always decodes the full image and resizes it.
+ *
+ * Usage: resize_bench <image>...
+ *
+ * @date 17 Oct 2026
+ */
+
+#include "pictDB.h"
+#include "image_content.h"
+
+#include <sys/resource.h> // for getrusage
+#include <time.h> // for clock_gettime
+
+#define ROUNDS 10	// resizes of each image
+
+/**
+ *  @brief  Returns the time elapsed since an arbitrary point, in seconds
+ *
+ *  @return The time in seconds
+ */
+static double now(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ *  @brief  Reads the file called filename
+ *
+ *  @param  filename :  The name of the file
+ *  @param  image :     Set to the content of the file, to be freed
+ *  @param  size :      Set to the size of the file
+ *
+ *  @return An error code
+ */
+static int read_file(const char* filename, char** image, size_t* size)
+{
+    FILE* file = NULL;
+    long length = 0;
+    int ret = 0;
+
+    if ((file = fopen(filename, "rb")) == NULL) {
+        return ERR_IO;
+    }
+
+    if (fseek(file, 0, SEEK_END) || (length = ftell(file)) <= 0) {
+        ret = ERR_IO;
+    } else if ((*image = calloc(length, sizeof(char))) == NULL) {
+        ret = ERR_OUT_OF_MEMORY;
+    } else if ((ret = read_disk_image(file, image, length, 0))) {
+        free(*image);
+    } else {
+        *size = length;
+    }
+
+    fclose(file);
+    return ret;
+}
+
+/**
+ *  @brief  Resizes image ROUNDS times to the resolutions of header and
+ *          prints the mean time
+ *
+ *  @param  filename :  The name of the image
+ *  @param  header :    The header holding the resolutions
+ *
+ *  @return An error code
+ */
+static int bench(const char* filename, const struct pictdb_header* header)
+{
+    char* resized[RES_ORIG];
+    size_t sizes[RES_ORIG];
+    char* image = NULL;
+    size_t size = 0;
+    int ret = 0;
+
+    if ((ret = read_file(filename, &image, &size))) {
+        return ret;
+    }
+
+    const double start = now();
+
+    for (int round = 0; !ret && round < ROUNDS; round++) {
+        if (!(ret = resize_images(image, size, header,
+                                  RES_MASK(RES_THUMB) | RES_MASK(RES_SMALL),
+                                  resized, sizes))) {
+            for (int code = 0; code < RES_ORIG; code++) {
+                g_free(resized[code]);
+            }
+        }
+    }
+
+    const double elapsed = (now() - start) / ROUNDS;
+
+    if (!ret) {
+        printf("%-40s %8zu bytes: %8.2f ms\n", filename, size, elapsed * 1e3);
+    }
+
+    free(image);
+    return ret;
+}
+
+/********************************************************************//**
+ * MAIN
+ */
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <image>...\n", argv[0]);
+        return 1;
+    }
+
+    if (VIPS_INIT(argv[0])) {
+        vips_error_exit("unable to start VIPS");
+    }
+
+    struct pictdb_header header;
+    struct rusage usage;
+    int ret = 0;
+
+    memset(&header, 0, sizeof(header));
+    header.res_resized[2 * RES_THUMB] = DEF_THUMB_RES;
+    header.res_resized[2 * RES_THUMB + 1] = DEF_THUMB_RES;
+    header.res_resized[2 * RES_SMALL] = DEF_SMALL_RES;
+    header.res_resized[2 * RES_SMALL + 1] = DEF_SMALL_RES;
+
+    printf("%s\n", argv[0]);
+
+    for (int i = 1; !ret && i < argc; i++) {
+        ret = bench(argv[i], &header);
+    }
+
+    vips_shutdown();
+
+    if (ret) {
+        fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ret]);
+        return ret;
+    }
+
+    // ru_maxrss is in kilobytes on Linux
+    getrusage(RUSAGE_SELF, &usage);
+    printf("peak resident memory: %ld kB\n", usage.ru_maxrss);
+
+    return 0;
+}
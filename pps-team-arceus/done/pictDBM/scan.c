@@ -0,0 +1,205 @@
+/**
+ * @file scan.c
+ * @brief vectorized scans of the free slot bitmap of a pictDB
+ *
+ * Listing and garbage collection walk the valid pictures through the free
+ * slot bitmap, whose words are all ones over runs of empty slots. The words
+ * are tested 4 at a time with AVX2 and 2 at a time with SSE4.2, that is 256
+ * and 128 slots per instruction, when the processor has them: the kernel is
+ * chosen once at run time, so the binary still runs on any x86 processor
+ * and on other architectures, where the scalar loop is used.
+ *
+ * @date 17 Oct 2026
+ */
+
+#include "pictDB.h"
+#include "scan.h"
+
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+#define ALL_EMPTY UINT64_MAX
+
+/*returns the first word of empty from word on that is not all ones, or
+ *words if there is none*/
+typedef size_t (*word_scan)(const uint64_t* empty, size_t word, size_t words);
+
+static word_scan s_scan = NULL;
+static pthread_once_t s_scan_once = PTHREAD_ONCE_INIT;
+
+/**
+ *  @brief  Skips the words of empty that are all ones, one at a time
+ *
+ *  @param  empty :     The bitmap
+ *  @param  word :      The first word to test
+ *  @param  words :     The number of words
+ *
+ *  @return The first word with a clear bit, words if there is none
+ */
+static size_t scan_scalar(const uint64_t* empty, size_t word, size_t words)
+{
+    while (word < words && empty[word] == ALL_EMPTY) {
+        word++;
+    }
+
+    return word;
+}
+
+#ifdef SCAN_X86
+/**
+ *  @brief  Skips the words of empty that are all ones, 4 at a time
+ *
+ *  @param  empty :     The bitmap
+ *  @param  word :      The first word to test
+ *  @param  words :     The number of words
+ *
+ *  @return The first word with a clear bit, words if there is none
+ */
+__attribute__((target("avx2")))
+static size_t scan_avx2(const uint64_t* empty, size_t word, size_t words)
+{
+    const __m256i ones = _mm256_set1_epi64x(-1);
+
+    for (; word + 4 <= words; word += 4) {
+        const __m256i bits = _mm256_loadu_si256((const __m256i*) &empty[word]);
+
+        if (!_mm256_testc_si256(bits, ones)) {
+            break;
+        }
+    }
+
+    return scan_scalar(empty, word, words);
+}
+
+/**
+ *  @brief  Skips the words of empty that are all ones, 2 at a time
+ *
+ *  @param  empty :     The bitmap
+ *  @param  word :      The first word to test
+ *  @param  words :     The number of words
+ *
+ *  @return The first word with a clear bit, words if there is none
+ */
+__attribute__((target("sse4.2")))
+static size_t scan_sse42(const uint64_t* empty, size_t word, size_t words)
+{
+    const __m128i ones = _mm_set1_epi64x(-1);
+
+    for (; word + 2 <= words; word += 2) {
+        const __m128i bits = _mm_loadu_si128((const __m128i*) &empty[word]);
+
+        if (!_mm_testc_si128(bits, ones)) {
+            break;
+        }
+    }
+
+    return scan_scalar(empty, word, words);
+}
+#endif
+
+/**
+ *  @brief  Returns the kernel of scan_next_valid of code kernel, if the
+ *          processor supports it
+ *
+ *  @param  kernel :    SCAN_SCALAR, SCAN_SSE42 or SCAN_AVX2
+ *
+ *  @return The kernel, NULL if it is not supported
+ */
+static word_scan scan_kernel(int kernel)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+
+    if (kernel == SCAN_AVX2 && __builtin_cpu_supports("avx2")) {
+        return scan_avx2;
+    }
+
+    if (kernel == SCAN_SSE42 && __builtin_cpu_supports("sse4.2")) {
+        return scan_sse42;
+    }
+#endif
+
+    return kernel == SCAN_SCALAR ? scan_scalar : NULL;
+}
+
+/**
+ *  @brief  Chooses the widest kernel the processor supports
+ */
+static void scan_choose(void)
+{
+    for (int kernel = NB_SCANS - 1; s_scan == NULL; kernel--) {
+        s_scan = scan_kernel(kernel);
+    }
+}
+
+/**
+ *  @brief  Returns the first slot from from on whose bit is clear in empty,
+ *          a bitmap with one set bit per empty slot. Full words are skipped
+ *          with the widest vectors the processor supports.
+ *
+ *  @param  empty :     The bitmap, of count bits rounded up to a word
+ *  @param  from :      The first slot to test
+ *  @param  count :     The number of slots
+ *
+ *  @return The first valid slot, count if there is none
+ */
+size_t scan_next_valid(const uint64_t* empty, size_t from, size_t count)
+{
+    if (empty == NULL || from >= count) {
+        return count;
+    }
+
+    pthread_once(&s_scan_once, scan_choose);
+
+    const size_t words = (count + WORD_BITS - 1) / WORD_BITS;
+    size_t word = from / WORD_BITS;
+
+    // the first word may be entered in its middle
+    const uint64_t valid = ~empty[word] >> (from % WORD_BITS);
+
+    if (valid == 0) {
+        // in a dense bitmap, the next word mostly has a valid slot already
+        if (++word < words && empty[word] == ALL_EMPTY) {
+            word = s_scan(empty, word + 1, words);
+        }
+
+        if (word >= words) {
+            return count;
+        }
+
+        from = word * WORD_BITS + __builtin_ctzll(~empty[word]);
+    } else {
+        from += __builtin_ctzll(valid);
+    }
+
+    // the bits after count are clear, so they read as valid
+    return from < count ? from : count;
+}
+
+/**
+ *  @brief  Makes scan_next_valid use kernel instead of the widest one the
+ *          processor supports, to compare them. Must not be called while
+ *          a scan is running.
+ *
+ *  @param  kernel :    SCAN_SCALAR, SCAN_SSE42 or SCAN_AVX2
+ *
+ *  @return An error code, ERR_INVALID_ARGUMENT if the processor does not
+ *          support kernel
+ */
+int scan_use(int kernel)
+{
+    word_scan scan = NULL;
+
+    if (kernel < 0 || kernel >= NB_SCANS || (scan = scan_kernel(kernel)) == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    pthread_once(&s_scan_once, scan_choose);
+    s_scan = scan;
+
+    return 0;
+}
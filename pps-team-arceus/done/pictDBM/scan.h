@@ -0,0 +1,52 @@
+/**
+ * @file scan.h
+ * @brief vectorized scans of the free slot bitmap of a pictDB
+ *
+ * @date 17 Oct 2026
+ */
+
+#ifndef PICTDBPRJ_SCAN_H
+#define PICTDBPRJ_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* For scan_use */
+#define SCAN_SCALAR	0	// one word at a time
+#define SCAN_SSE42	1	// 2 words at a time
+#define SCAN_AVX2	2	// 4 words at a time
+#define NB_SCANS	3
+
+/**
+ *  @brief  Returns the first slot from from on whose bit is clear in empty,
+ *          a bitmap with one set bit per empty slot. Full words are skipped
+ *          with the widest vectors the processor supports.
+ *
+ *  @param  empty :     The bitmap, of count bits rounded up to a word
+ *  @param  from :      The first slot to test
+ *  @param  count :     The number of slots
+ *
+ *  @return The first valid slot, count if there is none
+ */
+size_t scan_next_valid(const uint64_t* empty, size_t from, size_t count);
+
+/**
+ *  @brief  Makes scan_next_valid use kernel instead of the widest one the
+ *          processor supports, to compare them. Must not be called while
+ *          a scan is running.
+ *
+ *  @param  kernel :    SCAN_SCALAR, SCAN_SSE42 or SCAN_AVX2
+ *
+ *  @return An error code, ERR_INVALID_ARGUMENT if the processor does not
+ *          support kernel
+ */
+int scan_use(int kernel);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,134 @@
+/**
+ * @file scan_bench.c
+ * @brief pictDB benchmark: kernels of the free slot bitmap scan
+ *
+ * Walks the valid slots of free slot bitmaps of 100k and 10M slots, as
+ * do_list and the garbage collection do, with each kernel of scan_next_valid
+ * the processor supports. The valid slots are spread at random, from none to
+ * one in a hundred: the sparser they are, the more full words are skipped.
+ *
+ * Usage: scan_bench
+ *
+ * @date 17 Oct 2026
+ */
+
+#include "pictDB.h"
+#include "scan.h"
+
+#include <time.h> // for clock_gettime
+
+#define MIN_TIME 0.2	// seconds each measure lasts at least
+
+static const char* const KERNELS[NB_SCANS] = {"scalar", "sse4.2", "avx2"};
+
+/**
+ *  @brief  Returns the time elapsed since an arbitrary point, in seconds
+ *
+ *  @return The time in seconds
+ */
+static double now(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ *  @brief  Fills the bitmap empty of count slots, with one valid slot out of
+ *          every ratio, at random
+ *
+ *  @param  empty :     The bitmap
+ *  @param  count :     The number of slots
+ *  @param  ratio :     The inverse density of valid slots, 0 for none
+ */
+static void fill(uint64_t* empty, size_t count, size_t ratio)
+{
+    const size_t words = (count + WORD_BITS - 1) / WORD_BITS;
+
+    memset(empty, 0xff, words * sizeof(uint64_t));
+
+    // the bits after count are clear, as in the free slot bitmap
+    if (count % WORD_BITS != 0) {
+        empty[words - 1] = ((uint64_t) 1 << (count % WORD_BITS)) - 1;
+    }
+
+    for (size_t i = 0; ratio != 0 && i < count / ratio; i++) {
+        const size_t slot = ((size_t) rand() * RAND_MAX + rand()) % count;
+        empty[slot / WORD_BITS] &= ~((uint64_t) 1 << (slot % WORD_BITS));
+    }
+}
+
+/**
+ *  @brief  Walks the valid slots of empty until MIN_TIME has elapsed
+ *
+ *  @param  empty :     The bitmap
+ *  @param  count :     The number of slots
+ *  @param  valid :     Set to the number of valid slots
+ *
+ *  @return The time of one walk, in seconds
+ */
+static double walk(const uint64_t* empty, size_t count, size_t* valid)
+{
+    const double start = now();
+    double elapsed = 0;
+    size_t walks = 0;
+
+    do {
+        *valid = 0;
+
+        for (size_t i = scan_next_valid(empty, 0, count); i < count;
+             i = scan_next_valid(empty, i + 1, count)) {
+            (*valid)++;
+        }
+
+        walks++;
+    } while ((elapsed = now() - start) < MIN_TIME);
+
+    return elapsed / walks;
+}
+
+/********************************************************************//**
+ * MAIN
+ */
+int main(void)
+{
+    const size_t counts[] = {100000, 10000000};
+    const size_t ratios[] = {0, 10000, 100};
+
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        const size_t count = counts[c];
+        uint64_t* empty = NULL;
+
+        if ((empty = calloc((count + WORD_BITS - 1) / WORD_BITS,
+                            sizeof(uint64_t))) == NULL) {
+            fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ERR_OUT_OF_MEMORY]);
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        for (size_t r = 0; r < sizeof(ratios) / sizeof(ratios[0]); r++) {
+            size_t valid = 0;
+
+            srand(1);
+            fill(empty, count, ratios[r]);
+
+            for (int kernel = 0; kernel < NB_SCANS; kernel++) {
+                if (scan_use(kernel)) {
+                    printf("%8zu slots: %-6s not supported\n", count,
+                           KERNELS[kernel]);
+                    continue;
+                }
+
+                const double time = walk(empty, count, &valid);
+
+                printf("%8zu slots, %6zu valid: %-6s %10.1f us, %6.2f slots/ns\n",
+                       count, valid, KERNELS[kernel], time * 1e6,
+                       count / time / 1e9);
+            }
+        }
+
+        free(empty);
+    }
+
+    return 0;
+}
@@ -0,0 +1,617 @@
+/**
+ * @file wal.c
+ * @brief write-ahead log of the header and metadata updates of a pictDB
+ *
+ * With a log, updates are not written in place when they are flushed. Each
+ * flush appends a record to the log buffer instead: the whole header and the
+ * changed metadata, followed by a CRC-32. wal_commit then writes the buffer
+ * to <db>.wal and syncs it, after syncing the database so that the images the
+ * records refer to are on the disk first. Threads that commit while a sync is
+ * in progress wait for it and are synced together by the next one.
+ *
+ * The metadata changed since the last checkpoint is tracked in a dirty set of
+ * its own. A checkpoint writes it in place, syncs the database and empties
+ * the log. A crash in between leaves the log to be replayed by the next
+ * do_open; a torn record at its end is recognized by its CRC and dropped,
+ * along with everything after it.
+ *
+ * @date 17 Oct 2026
+ */
+
+#include "pictDB.h"
+#include "wal.h"
+
+#include <fcntl.h> // for open
+#include <unistd.h> // for write, fdatasync, ftruncate, access
+
+#define WAL_SUFFIX ".wal"
+#define WAL_MAGIC 0x4c415750	// "PWAL"
+#define WAL_CHECKPOINT_SIZE (4 << 20)	// log size that triggers a checkpoint
+
+/*start of a log record, followed by the header and count entries*/
+struct wal_record {
+    uint32_t		magic;
+    uint32_t		count;
+    uint32_t		crc;		// CRC-32 of the header and entries
+    uint32_t		unused_32;
+};
+
+/*metadata logged in a record*/
+struct wal_entry {
+    uint32_t				index;
+    uint32_t				unused_32;
+    struct pict_metadata	metadata;
+};
+
+/*log of a database*/
+struct pict_wal {
+    char				path[MAX_DB_NAME + sizeof(WAL_SUFFIX)];
+    int					fd;
+    char*				buffer;		// records appended and not written yet
+    size_t				length;
+    size_t				capacity;
+    char*				spare;		// buffer given back by the last sync
+    size_t				spare_capacity;
+    uint64_t			appended;	// bytes ever appended to the log
+    uint64_t			durable;	// bytes of them that are on the disk
+    uint64_t			checkpointed;	// bytes appended at the last checkpoint
+    int					syncing;	// a thread is writing to the log
+    int					error;		// the log could not be written since the
+                                    // last checkpoint
+    pthread_mutex_t		mutex;
+    pthread_cond_t		synced;
+    struct dirty_set	pending;	// metadata not written in place yet
+};
+
+/**
+ *  @brief  Computes the CRC-32 of data
+ *
+ *  @param  crc :       The CRC of the data before, 0 to start
+ *  @param  data :      The data
+ *  @param  length :    The length of the data
+ *
+ *  @return The updated CRC
+ */
+static uint32_t crc32_update(uint32_t crc, const void* data, size_t length)
+{
+    const unsigned char* p = data;
+
+    crc = ~crc;
+
+    while (length-- > 0) {
+        crc ^= *p++;
+
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+        }
+    }
+
+    return ~crc;
+}
+
+/**
+ *  @brief  Writes the name of the log of db_filename into path
+ *
+ *  @param  path :          The name of the log, of size
+ *                          MAX_DB_NAME + sizeof(WAL_SUFFIX)
+ *  @param  db_filename :   The name of the database
+ */
+static void wal_path(char* path, const char* db_filename)
+{
+    snprintf(path, MAX_DB_NAME + sizeof(WAL_SUFFIX), "%s%s", db_filename,
+             WAL_SUFFIX);
+}
+
+/**
+ *  @brief  Tells whether the database db_filename has a log to replay
+ *
+ *  @param  db_filename :   The name of the database
+ *
+ *  @return 1 if it has one, 0 otherwise
+ */
+int wal_exists(const char* db_filename)
+{
+    char path[MAX_DB_NAME + sizeof(WAL_SUFFIX)];
+    wal_path(path, db_filename);
+
+    return access(path, F_OK) == 0;
+}
+
+/**
+ *  @brief  Replays the log of the database db_filename, if there is one, into
+ *          the header and metadata of db_file. If db_file is writable, the
+ *          replayed updates are then written in place and the log is emptied.
+ *
+ *  @param  db_filename :   The name of the database
+ *  @param  writable :      Whether db_file was opened for writing
+ *  @param  db_file :       The database, with its header and metadata loaded
+ *
+ *  @return An error code
+ */
+int wal_recover(const char* db_filename, int writable,
+                struct pictdb_file* db_file)
+{
+    if (db_filename == NULL || db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    char path[MAX_DB_NAME + sizeof(WAL_SUFFIX)];
+    wal_path(path, db_filename);
+
+    FILE* log = fopen(path, "rb");
+
+    if (log == NULL) {
+        return 0;
+    }
+
+    const uint32_t max_files = db_file->header.max_files;
+    struct wal_entry* entries = NULL;
+    struct wal_record record;
+    struct pictdb_header header;
+    size_t replayed = 0;
+    int ret = 0;
+
+    while (!ret && fread(&record, sizeof(record), 1, log) == 1 &&
+           record.magic == WAL_MAGIC && record.count <= max_files) {
+        struct wal_entry* temp = realloc(entries, (record.count + 1) *
+                                         sizeof(struct wal_entry));
+
+        if (temp == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+            break;
+        }
+
+        entries = temp;
+
+        // a record is only replayed once it has been read and checked whole
+        if (fread(&header, sizeof(header), 1, log) != 1 ||
+            fread(entries, sizeof(struct wal_entry), record.count,
+                  log) != record.count ||
+            crc32_update(crc32_update(0, &header, sizeof(header)), entries,
+                         record.count * sizeof(struct wal_entry)) != record.crc ||
+            header.max_files != max_files) {
+            break;
+        }
+
+        size_t i = 0;
+        while (i < record.count && entries[i].index < max_files) {
+            i++;
+        }
+
+        if (i < record.count) {
+            break;
+        }
+
+        db_file->header = header;
+
+        if (writable) {
+            mark_header(db_file, 0, 0);
+        }
+
+        for (i = 0; !ret && i < record.count; i++) {
+            db_file->metadata[entries[i].index] = entries[i].metadata;
+
+            if (writable) {
+                ret = mark_metadata(db_file, entries[i].index);
+            }
+        }
+
+        replayed++;
+    }
+
+    free(entries);
+    fclose(log);
+
+    if (!ret && writable) {
+        if (replayed > 0 &&
+            ((ret = write_dirty(db_file)) || fsync(fileno(db_file->fpdb)))) {
+            return ret ? ret : ERR_IO;
+        }
+
+        if (unlink(path)) {
+            ret = ERR_IO;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ *  @brief  Opens the log of the database db_filename and attaches it to
+ *          db_file. From then on, flush_dirty appends the updates to the log
+ *          and they are written in place at checkpoints only.
+ *
+ *  @param  db_filename :   The name of the database
+ *  @param  db_file :       The database, already recovered
+ *
+ *  @return An error code
+ */
+int wal_open(const char* db_filename, struct pictdb_file* db_file)
+{
+    if (db_filename == NULL || db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct pict_wal* wal = calloc(1, sizeof(struct pict_wal));
+
+    if (wal == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    wal_path(wal->path, db_filename);
+
+    if ((wal->pending.bits = calloc((db_file->header.max_files + WORD_BITS - 1) /
+                                    WORD_BITS, sizeof(uint64_t))) == NULL) {
+        free(wal);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    if ((wal->fd = open(wal->path, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1) {
+        free(wal->pending.bits);
+        free(wal);
+        return ERR_IO;
+    }
+
+    pthread_mutex_init(&wal->mutex, NULL);
+    pthread_cond_init(&wal->synced, NULL);
+    db_file->wal = wal;
+
+    return 0;
+}
+
+/**
+ *  @brief  Appends the dirty header and metadata of db_file to its log and
+ *          clears them. The log is checkpointed when it grows too large, or
+ *          when writing to it failed since the last checkpoint.
+ *          db_file must be locked exclusively.
+ *
+ *  @param  db_file :   The database
+ *
+ *  @return An error code
+ */
+int wal_append(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->wal == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct pict_wal* wal = db_file->wal;
+    struct dirty_set* dirty = &db_file->dirty;
+    struct wal_record record = {WAL_MAGIC, 0, 0, 0};
+    struct wal_entry entry;
+
+    if (dirty->first == dirty->last && !dirty->header) {
+        return 0;
+    }
+
+    for (size_t i = dirty->first; i < dirty->last; i++) {
+        if (dirty->bits[i / WORD_BITS] & ((uint64_t) 1 << (i % WORD_BITS))) {
+            record.count++;
+        }
+    }
+
+    const size_t length = sizeof(record) + sizeof(struct pictdb_header) +
+                          record.count * sizeof(entry);
+
+    pthread_mutex_lock(&wal->mutex);
+
+    if (wal->length + length > wal->capacity) {
+        const size_t capacity = 2 * (wal->length + length);
+        char* temp = realloc(wal->buffer, capacity);
+
+        if (temp == NULL) {
+            pthread_mutex_unlock(&wal->mutex);
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        wal->buffer = temp;
+        wal->capacity = capacity;
+    }
+
+    char* const start = wal->buffer + wal->length;
+    char* p = start + sizeof(record);
+
+    memcpy(p, &(db_file->header), sizeof(struct pictdb_header));
+    p += sizeof(struct pictdb_header);
+    memset(&entry, 0, sizeof(entry));
+
+    for (size_t i = dirty->first; i < dirty->last; i++) {
+        uint64_t* word = &dirty->bits[i / WORD_BITS];
+        const uint64_t bit = (uint64_t) 1 << (i % WORD_BITS);
+
+        if (*word & bit) {
+            *word &= ~bit;
+            wal->pending.bits[i / WORD_BITS] |= bit;
+
+            entry.index = (uint32_t) i;
+            entry.metadata = db_file->metadata[i];
+            memcpy(p, &entry, sizeof(entry));
+            p += sizeof(entry);
+        }
+    }
+
+    record.crc = crc32_update(0, start + sizeof(record), length - sizeof(record));
+    memcpy(start, &record, sizeof(record));
+
+    wal->length += length;
+    wal->appended += length;
+    // after a failed write, a checkpoint is what makes the log usable again
+    const int full = wal->error ||
+                     wal->appended - wal->checkpointed > WAL_CHECKPOINT_SIZE;
+
+    pthread_mutex_unlock(&wal->mutex);
+
+    if (dirty->first != dirty->last) {
+        struct dirty_set* pending = &wal->pending;
+
+        if (pending->first == pending->last) {
+            pending->first = dirty->first;
+            pending->last = dirty->last;
+        } else {
+            pending->first = dirty->first < pending->first ?
+                             dirty->first : pending->first;
+            pending->last = dirty->last > pending->last ?
+                            dirty->last : pending->last;
+        }
+    }
+
+    wal->pending.header = 1;
+    dirty->first = 0;
+    dirty->last = 0;
+    dirty->header = 0;
+
+    return full ? wal_checkpoint(db_file) : 0;
+}
+
+/**
+ *  @brief  Writes size bytes of buffer to fd
+ *
+ *  @param  fd :        The file descriptor to write to
+ *  @param  buffer :    The bytes to write
+ *  @param  size :      The number of bytes
+ *
+ *  @return 0 if writing was successful, ERR_IO otherwise
+ */
+static int write_fully(int fd, const char* buffer, size_t size)
+{
+    while (size > 0) {
+        const ssize_t written = write(fd, buffer, size);
+
+        if (written <= 0) {
+            return ERR_IO;
+        }
+
+        buffer += written;
+        size -= (size_t) written;
+    }
+
+    return 0;
+}
+
+/**
+ *  @brief  Waits until everything appended to the log of db_file so far is on
+ *          the disk, along with the images it refers to. The first thread to
+ *          wait writes and syncs the log for all the others, so concurrent
+ *          updates share a single sync. db_file should not be locked, so
+ *          that other updates can join the group in the meantime.
+ *
+ *  @param  db_file :   The database, with or without a log
+ *
+ *  @return An error code, ERR_IO if the log could not be written since the
+ *          last checkpoint
+ */
+int wal_commit(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->wal == NULL) {
+        return 0;
+    }
+
+    struct pict_wal* wal = db_file->wal;
+
+    pthread_mutex_lock(&wal->mutex);
+
+    const uint64_t target = wal->appended;
+
+    while (!wal->error && wal->durable < target) {
+        if (wal->syncing) {
+            pthread_cond_wait(&wal->synced, &wal->mutex);
+            continue;
+        }
+
+        // lead the group: take every record appended so far
+        char* buffer = wal->buffer;
+        const size_t length = wal->length;
+        const size_t capacity = wal->capacity;
+        const uint64_t end = wal->appended;
+
+        wal->buffer = wal->spare;
+        wal->capacity = wal->spare_capacity;
+        wal->length = 0;
+        wal->spare = NULL;
+        wal->spare_capacity = 0;
+        wal->syncing = 1;
+
+        pthread_mutex_unlock(&wal->mutex);
+
+        // the images must be on the disk before the records referring to them
+        const int err = fdatasync(fileno(db_file->fpdb)) ||
+                        write_fully(wal->fd, buffer, length) ||
+                        fdatasync(wal->fd) ? ERR_IO : 0;
+
+        pthread_mutex_lock(&wal->mutex);
+
+        free(wal->spare);
+        wal->spare = buffer;
+        wal->spare_capacity = capacity;
+        wal->syncing = 0;
+
+        if (err) {
+            wal->error = err;
+        } else if (end > wal->durable) {
+            wal->durable = end;
+        }
+
+        pthread_cond_broadcast(&wal->synced);
+    }
+
+    const int ret = wal->error;
+    pthread_mutex_unlock(&wal->mutex);
+
+    return ret;
+}
+
+/**
+ *  @brief  Returns the number of bytes appended to the log of db_file so far.
+ *          db_file must be locked.
+ *
+ *  @param  db_file :   The database, with or without a log
+ *
+ *  @return The position in the log, 0 if there is no log
+ */
+uint64_t wal_position(const struct pictdb_file* db_file)
+{
+    // only appended to with db_file locked exclusively
+    return db_file->wal == NULL ? 0 : db_file->wal->appended;
+}
+
+/**
+ *  @brief  Returns the number of bytes of the log of db_file that are on the
+ *          disk
+ *
+ *  @param  db_file :   The database, with or without a log
+ *
+ *  @return The durable position in the log, UINT64_MAX if there is no log
+ */
+uint64_t wal_durable(struct pictdb_file* db_file)
+{
+    if (db_file->wal == NULL) {
+        return UINT64_MAX;
+    }
+
+    pthread_mutex_lock(&db_file->wal->mutex);
+    const uint64_t durable = db_file->wal->durable;
+    pthread_mutex_unlock(&db_file->wal->mutex);
+
+    return durable;
+}
+
+/**
+ *  @brief  Writes every update logged since the last checkpoint in place,
+ *          syncs the database and empties the log. db_file must be locked
+ *          exclusively.
+ *
+ *  @param  db_file :   The database
+ *
+ *  @return An error code
+ */
+int wal_checkpoint(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->wal == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct pict_wal* wal = db_file->wal;
+
+    pthread_mutex_lock(&wal->mutex);
+
+    while (wal->syncing) {
+        pthread_cond_wait(&wal->synced, &wal->mutex);
+    }
+
+    wal->syncing = 1;
+    pthread_mutex_unlock(&wal->mutex);
+
+    // the memory holds the latest version of every pending metadata
+    const struct dirty_set dirty = db_file->dirty;
+    db_file->dirty = wal->pending;
+    int ret = write_dirty(db_file);
+    wal->pending = db_file->dirty;
+    db_file->dirty = dirty;
+
+    if (!ret && (fsync(fileno(db_file->fpdb)) || ftruncate(wal->fd, 0))) {
+        ret = ERR_IO;
+    }
+
+    pthread_mutex_lock(&wal->mutex);
+
+    if (ret) {
+        // the log is kept as it is, for the next do_open to replay
+        wal->error = ret;
+    } else {
+        // everything appended is in place now, even what failed to be logged
+        wal->length = 0;
+        wal->durable = wal->appended;
+        wal->checkpointed = wal->appended;
+        wal->error = 0;
+    }
+
+    wal->syncing = 0;
+    pthread_cond_broadcast(&wal->synced);
+    pthread_mutex_unlock(&wal->mutex);
+
+    return ret;
+}
+
+/**
+ *  @brief  Resizes the set of metadata pending in the log of db_file to its
+ *          current max_files, after the table grew. The log must have been
+ *          checkpointed since.
+ *
+ *  @param  db_file :   The database, with or without a log
+ *
+ *  @return An error code
+ */
+int wal_resize(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->wal == NULL) {
+        return 0;
+    }
+
+    struct dirty_set* pending = &db_file->wal->pending;
+    uint64_t* bits = calloc((db_file->header.max_files + WORD_BITS - 1) / WORD_BITS,
+                            sizeof(uint64_t));
+
+    if (bits == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // empty since the checkpoint
+    free(pending->bits);
+    pending->bits = bits;
+    pending->first = 0;
+    pending->last = 0;
+
+    return 0;
+}
+
+/**
+ *  @brief  Checkpoints and removes the log of db_file, then detaches it
+ *
+ *  @param  db_file :   The database
+ *
+ *  @return An error code
+ */
+int wal_close(struct pictdb_file* db_file)
+{
+    if (db_file == NULL || db_file->wal == NULL) {
+        return 0;
+    }
+
+    struct pict_wal* wal = db_file->wal;
+    int ret = 0;
+
+    if (!(ret = wal_checkpoint(db_file))) {
+        unlink(wal->path);
+    }
+
+    close(wal->fd);
+    pthread_mutex_destroy(&wal->mutex);
+    pthread_cond_destroy(&wal->synced);
+    free(wal->buffer);
+    free(wal->spare);
+    free(wal->pending.bits);
+    free(wal);
+    db_file->wal = NULL;
+
+    return ret;
+}
@@ -0,0 +1,132 @@
+/**
+ * @file wal.h
+ * @brief write-ahead log of the header and metadata updates of a pictDB
+ *
+ * @date 17 Oct 2026
+ */
+
+#ifndef PICTDBPRJ_WAL_H
+#define PICTDBPRJ_WAL_H
+
+#include "pictDB.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ *  @brief  Tells whether the database db_filename has a log to replay
+ *
+ *  @param  db_filename :   The name of the database
+ *
+ *  @return 1 if it has one, 0 otherwise
+ */
+int wal_exists(const char* db_filename);
+
+/**
+ *  @brief  Replays the log of the database db_filename, if there is one, into
+ *          the header and metadata of db_file. If db_file is writable, the
+ *          replayed updates are then written in place and the log is emptied.
+ *
+ *  @param  db_filename :   The name of the database
+ *  @param  writable :      Whether db_file was opened for writing
+ *  @param  db_file :       The database, with its header and metadata loaded
+ *
+ *  @return An error code
+ */
+int wal_recover(const char* db_filename, int writable,
+                struct pictdb_file* db_file);
+
+/**
+ *  @brief  Opens the log of the database db_filename and attaches it to
+ *          db_file. From then on, flush_dirty appends the updates to the log
+ *          and they are written in place at checkpoints only.
+ *
+ *  @param  db_filename :   The name of the database
+ *  @param  db_file :       The database, already recovered
+ *
+ *  @return An error code
+ */
+int wal_open(const char* db_filename, struct pictdb_file* db_file);
+
+/**
+ *  @brief  Appends the dirty header and metadata of db_file to its log and
+ *          clears them. The log is checkpointed when it grows too large, or
+ *          when writing to it failed since the last checkpoint.
+ *          db_file must be locked exclusively.
+ *
+ *  @param  db_file :   The database
+ *
+ *  @return An error code
+ */
+int wal_append(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Waits until everything appended to the log of db_file so far is on
+ *          the disk, along with the images it refers to. The first thread to
+ *          wait writes and syncs the log for all the others, so concurrent
+ *          updates share a single sync. db_file should not be locked, so
+ *          that other updates can join the group in the meantime.
+ *
+ *  @param  db_file :   The database, with or without a log
+ *
+ *  @return An error code, ERR_IO if the log could not be written since the
+ *          last checkpoint
+ */
+int wal_commit(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Returns the number of bytes appended to the log of db_file so far.
+ *          db_file must be locked.
+ *
+ *  @param  db_file :   The database, with or without a log
+ *
+ *  @return The position in the log, 0 if there is no log
+ */
+uint64_t wal_position(const struct pictdb_file* db_file);
+
+/**
+ *  @brief  Returns the number of bytes of the log of db_file that are on the
+ *          disk
+ *
+ *  @param  db_file :   The database, with or without a log
+ *
+ *  @return The durable position in the log, UINT64_MAX if there is no log
+ */
+uint64_t wal_durable(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Writes every update logged since the last checkpoint in place,
+ *          syncs the database and empties the log. db_file must be locked
+ *          exclusively.
+ *
+ *  @param  db_file :   The database
+ *
+ *  @return An error code
+ */
+int wal_checkpoint(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Resizes the set of metadata pending in the log of db_file to its
+ *          current max_files, after the table grew. The log must have been
+ *          checkpointed since.
+ *
+ *  @param  db_file :   The database, with or without a log
+ *
+ *  @return An error code
+ */
+int wal_resize(struct pictdb_file* db_file);
+
+/**
+ *  @brief  Checkpoints and removes the log of db_file, then detaches it
+ *
+ *  @param  db_file :   The database
+ *
+ *  @return An error code
+ */
+int wal_close(struct pictdb_file* db_file);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,202 @@
+/**
+ * @file wal_bench.c
+ * @brief pictDB benchmark: throughput of inserts with and without the log
+ *
+ * Inserts copies of an image, made distinct by a counter appended after its
+ * end, into a new database. Without a log, the updates are written in place
+ * and left in the page cache: an insert is not durable when it returns. With
+ * OPEN_WAL, an insert returns once its record and its image are synced, and
+ * concurrent inserts share their syncs. Both are run with 1 and 8 threads.
+ *
+ * Usage: wal_bench <image> [inserts]
+ *
+ * @date 17 Oct 2026
+ */
+
+#include "pictDB.h"
+#include "pictDBM_tools.h"
+
+#include <inttypes.h> // for PRIu64
+#include <time.h> // for clock_gettime
+
+#define BENCH_DB "wal_bench.db"
+#define DEF_INSERTS 2000
+#define MAX_THREADS 8
+
+/*what each thread inserts*/
+struct bench_thread {
+    struct pictdb_file*		db_file;
+    const char*				image;
+    size_t					size;
+    size_t					first;		// number of its first copy
+    size_t					count;
+    int						ret;
+    pthread_t				thread;
+};
+
+/**
+ *  @brief  Returns the time elapsed since an arbitrary point, in seconds
+ *
+ *  @return The time in seconds
+ */
+static double now(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ *  @brief  Inserts the copies of the image of a thread
+ *
+ *  @param  arg :       The bench_thread
+ *
+ *  @return NULL
+ */
+static void* insert_copies(void* arg)
+{
+    struct bench_thread* bench = arg;
+    const size_t size = bench->size + sizeof(uint64_t);
+    char pict_id[MAX_PIC_ID + 1];
+    char* copy = NULL;
+
+    if ((copy = malloc(size)) == NULL) {
+        bench->ret = ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+
+    memcpy(copy, bench->image, bench->size);
+
+    for (size_t i = 0; !bench->ret && i < bench->count; i++) {
+        const uint64_t number = bench->first + i;
+
+        memcpy(copy + bench->size, &number, sizeof(uint64_t));
+        snprintf(pict_id, sizeof(pict_id), "pic%" PRIu64, number);
+        bench->ret = do_insert(copy, size, pict_id, bench->db_file);
+    }
+
+    free(copy);
+    return NULL;
+}
+
+/**
+ *  @brief  Inserts inserts copies of image in a new database with threads
+ *          threads, and prints the throughput
+ *
+ *  @param  image :     The image
+ *  @param  size :      The size of the image
+ *  @param  inserts :   The number of copies to insert
+ *  @param  threads :   The number of threads
+ *  @param  flags :     The flags of do_open_ext
+ *
+ *  @return An error code
+ */
+static int run(const char* image, size_t size, size_t inserts, int threads,
+               int flags)
+{
+    struct pictdb_file db_file;
+    struct bench_thread bench[MAX_THREADS];
+    int ret = 0;
+
+    remove(BENCH_DB);
+    memset(&db_file, 0, sizeof(db_file));
+    db_file.header.max_files = inserts;
+    db_file.header.res_resized[0] = DEF_THUMB_RES;
+    db_file.header.res_resized[1] = DEF_THUMB_RES;
+    db_file.header.res_resized[2] = DEF_SMALL_RES;
+    db_file.header.res_resized[3] = DEF_SMALL_RES;
+
+    if ((ret = do_create(BENCH_DB, &db_file))) {
+        return ret;
+    }
+
+    do_close(&db_file);
+
+    if ((ret = do_open_ext(BENCH_DB, "rb+", flags, &db_file))) {
+        return ret;
+    }
+
+    const double start = now();
+
+    for (int t = 0; t < threads; t++) {
+        bench[t].db_file = &db_file;
+        bench[t].image = image;
+        bench[t].size = size;
+        bench[t].first = inserts * t / threads;
+        bench[t].count = inserts * (t + 1) / threads - bench[t].first;
+        bench[t].ret = 0;
+        pthread_create(&bench[t].thread, NULL, insert_copies, &bench[t]);
+    }
+
+    for (int t = 0; t < threads; t++) {
+        pthread_join(bench[t].thread, NULL);
+        ret = ret ? ret : bench[t].ret;
+    }
+
+    const double elapsed = now() - start;
+
+    do_close(&db_file);
+    remove(BENCH_DB);
+
+    if (!ret) {
+        printf("%-10s %2d thread(s): %6zu inserts in %7.3f s, %9.1f inserts/s\n",
+               flags & OPEN_WAL ? "log" : "in place", threads, inserts,
+               elapsed, inserts / elapsed);
+    }
+
+    return ret;
+}
+
+/********************************************************************//**
+ * MAIN
+ */
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <image> [inserts]\n", argv[0]);
+        return 1;
+    }
+
+    // images whose JPEG header can't be parsed are measured with vips
+    if (VIPS_INIT(argv[0])) {
+        vips_error_exit("unable to start VIPS");
+    }
+
+    const size_t inserts = argc > 2 ? atouint32(argv[2]) : DEF_INSERTS;
+    FILE* file = NULL;
+    char* image = NULL;
+    long size = 0;
+    int ret = 0;
+
+    if ((file = fopen(argv[1], "rb")) == NULL ||
+        fseek(file, 0, SEEK_END) || (size = ftell(file)) <= 0) {
+        ret = ERR_IO;
+    } else if ((image = calloc(size, sizeof(char))) == NULL) {
+        ret = ERR_OUT_OF_MEMORY;
+    } else {
+        ret = read_disk_image(file, &image, size, 0);
+    }
+
+    if (file != NULL) {
+        fclose(file);
+    }
+
+    const int flags[] = {0, OPEN_WAL};
+    const int threads[] = {1, MAX_THREADS};
+
+    for (size_t f = 0; !ret && f < sizeof(flags) / sizeof(flags[0]); f++) {
+        for (size_t t = 0; !ret && t < sizeof(threads) / sizeof(threads[0]); t++) {
+            ret = run(image, size, inserts, threads[t], flags[f]);
+        }
+    }
+
+    free(image);
+    vips_shutdown();
+
+    if (ret) {
+        fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[ret]);
+    }
+
+    return ret;
+}